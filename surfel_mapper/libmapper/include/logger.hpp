@@ -1,7 +1,7 @@
 /**
- *  @file logger.hpp 
+ *  @file logger.hpp
  *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
- * 
+ *
  *  @section LICENSE
  *
  *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
@@ -13,21 +13,80 @@
 
 #include <string>
 #include <vector>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
+/**
+ * @brief Handle of a log field (index of the column), -1 - invalid field
+ */
+typedef int LogField ;
 
 /**
-* @brief A class providing logging capabilities 
+ * @brief Output format of the log file
+ */
+enum LogFormat {
+	LOG_FORMAT_CSV = 0, /**< @brief text, one row per line, fields separated with ';', missing values written as 'n/a' */
+	LOG_FORMAT_BINARY = 1 /**< @brief header with field names followed by rows of doubles (NaN - missing value) */
+} ;
+
+/**
+* @brief A class providing logging capabilities
 *
 * The object of this class is used for logging certain outputs of the surfel mapper
-* in order to provide experiments' evidence for further processing. The logger output
-* is saved in CSV format.
+* in order to provide experiments' evidence for further processing. Fields are registered
+* once and referred to by handles afterwards, so logging a value is a single store into the
+* current row. Completed rows are queued in a fixed-size ring buffer and written to the file
+* by a background thread, which keeps the file open. When the writer falls behind and the ring
+* is full, new rows are dropped (and counted) rather than blocking the caller.
+*
+* Binary log layout (native byte order): 8-byte magic "SMLOG01\0", uint32 number of fields, for every field
+* uint32 name length followed by the name, then rows of double values (NaN - value not logged).
 */
 class Logger {
 protected:
-	std::vector<std::string> fields ; /**< Log field names */ 
-	std::string fileName ; /**< Log file name */ 
-	size_t curr_index ; /**< Current field index */ 
+	std::vector<std::string> fields ; /**< Log field names */
+	std::string fileName ; /**< Log file name */
+	LogFormat format ; /**< Log file format */
 	bool loggingOn ; /**< Is logging turned on or off */
+	std::vector<double> row ; /**< Values of the current row (NaN - not logged) */
+
+	std::vector<double> ring ; /**< Ring buffer of completed rows */
+	size_t ring_capacity ; /**< Capacity of the ring buffer (rows) */
+	size_t ring_head ; /**< Index of the oldest row in the ring buffer */
+	size_t ring_count ; /**< Number of rows in the ring buffer */
+	size_t pushed_rows ; /**< Number of rows queued so far */
+	size_t written_rows ; /**< Number of rows written so far */
+	size_t dropped_rows ; /**< Number of rows dropped because of the full ring buffer */
+
+	std::ofstream file ; /**< Log file stream (used by the writer thread) */
+	std::thread writer ; /**< Writer thread */
+	std::mutex mutex ; /**< Mutex guarding the ring buffer and the writer state */
+	std::condition_variable write_cond ; /**< Wakes up the writer thread */
+	std::condition_variable written_cond ; /**< Signals rows written by the writer thread */
+	bool flush_requested ; /**< Immediate write requested */
+	bool stop ; /**< Writer termination flag */
+	bool started ; /**< Is the log file initialized and the writer running */
+
+	/**
+	 * @brief Main loop of the writer thread
+	 */
+	void writerLoop() ;
+
+	/**
+	 * @brief Writes a header to the log file
+	 */
+	void writeHeader() ;
+
+	/**
+	 * @brief Writes rows to the log file
+	 *
+	 * @param rows row values (nrows x number of fields)
+	 * @param nrows number of rows
+	 */
+	void writeRows(const double *rows, size_t nrows) ;
+
 public:
 	/**
 	 * Logger default constructor. Initalizes logger with default 'log.csv' file name
@@ -37,46 +96,67 @@ public:
 	/**
 	 * @brief Logger constructor.
 	 *
-	 * @param fileName log file name
+	 * @param fileName log file name, the binary format is used for the '.bin' extension, CSV otherwise
+	 * @param ring_capacity capacity of the ring buffer (rows)
 	 */
-	Logger(const std::string &fileName) ;
+	Logger(const std::string &fileName, size_t ring_capacity = 1024) ;
 
 	/**
-	 * @brief Logger destructor
+	 * @brief Logger destructor. Writes the queued rows and stops the writer thread
 	 */
 	~Logger() ;
 
 	/**
 	 * @brief Registers field name for logging
-	 * 
+	 *
+	 * Registering an already known name returns its handle. New fields cannot be added after initFile.
+	 *
 	 * @param field new field name
+	 * @return field handle (-1 if the field cannot be added)
+	 */
+	LogField addField(const std::string &field) ;
+
+	/**
+	 * @brief Gets handle of the registered field
+	 *
+	 * @param field field name
+	 * @return field handle (-1 if not registered)
 	 */
-	void addField(const std::string &field) ;
+	LogField getField(const std::string &field) const ;
 
 	/**
-	 * @brief Inserts a new line in the log file and resets field index
+	 * @brief Queues the current row for writing and starts a new one
 	 */
 	void nextRow() ;
 
 	/**
-	 * @brief Initializes log file by writing a header
+	 * @brief Opens the log file, writes a header (CSV - only to a new file) and starts the writer thread
 	 */
 	void initFile() ;
 
 	/**
-	 * @brief Writes a header to the log file 
+	 * @brief Stores a value of the given field in the current row
+	 *
+	 * @param field field handle
+	 * @param value information to log
 	 */
-	void logHeader() ;
+	template<typename T> void log(LogField field, const T value)
+	{
+		if (loggingOn && field >= 0)
+			row[field] = double(value) ;
+	}
 
 	/**
-	 * @brief Writes an information associated with the given field name to the log file. 
-	 *
-	 * Consecutive columns are skipped until the specified field name is found.
+	 * @brief Waits until all queued rows are written to the file
+	 */
+	void flush() ;
+
+	/**
+	 * @brief Gets number of rows dropped because the writer did not keep up
 	 *
-	 * @param field field name
-	 * @param value information to log
+	 * @return number of dropped rows
 	 */
-	template<typename T> void log(const std::string &field, const T value) ;
+	size_t getDroppedRows() ;
 
 	/**
 	 * @brief Turns logging on and off
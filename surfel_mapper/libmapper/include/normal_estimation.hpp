@@ -0,0 +1,41 @@
+/**
+ *  @file normal_estimation.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef NORMAL_ESTIMATION_HPP
+#define NORMAL_ESTIMATION_HPP
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include "thread_pool.hpp"
+
+/**
+ * @brief Normal estimation backends available for organized input frames
+ */
+enum NormalEstimationMethod {
+	NORMAL_ESTIMATION_PCL = 0, /**< @brief PCL integral image estimation (average 3D gradient) - the reference method */
+	NORMAL_ESTIMATION_CROSS_PRODUCT = 1 /**< @brief native cross product of neighbouring pixels (faster, less smoothed) */
+} ;
+
+/**
+ * @brief Estimates normals of an organized cloud from cross products of neighbouring pixels
+ *
+ * For every pixel the normal is the cross product of horizontal and vertical central differences taken
+ * at the given pixel distance. The normal is invalid (NaN) if any of the neighbours is missing or its depth
+ * differs from the depth of the pixel by more than max_depth_change_factor * depth * radius (depth discontinuity).
+ * Normals are oriented towards the sensor origin of the cloud. Bands of rows are processed by threads of the pool.
+ *
+ * @param cloud input organized cloud, normals and curvature are written in place (curvature is set to 0)
+ * @param radius distance (in pixels) between the pixel and its neighbours used for differences
+ * @param max_depth_change_factor depth discontinuity threshold relative to the depth of the pixel
+ * @param pool threads used for the computation
+ */
+void estimateNormalsCrossProduct(pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud, int radius, float max_depth_change_factor, ThreadPool &pool) ;
+
+#endif
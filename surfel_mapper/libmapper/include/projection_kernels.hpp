@@ -0,0 +1,72 @@
+/**
+ *  @file projection_kernels.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef PROJECTION_KERNELS_HPP
+#define PROJECTION_KERNELS_HPP
+
+#include <cstddef>
+
+/**
+ * @brief Parameters of the rigid transformation and pinhole projection used by batch kernels
+ */
+typedef struct {
+	float m[12] ; /**< @brief first three rows of the world to camera transformation (row-major) */
+	float alpha ; /**< @brief x-focal length (fx) */
+	float beta ; /**< @brief y-focal length (fy) */
+	float cx ; /**< @brief x coordinate of the camera optical center*/
+	float cy ; /**< @brief y coordinate of the camera optical center*/
+} ProjectionParams ;
+
+/**
+ * @brief Transforms a batch of points into the camera frame and projects them onto the image plane
+ *
+ * Coordinates of the k-th point are read from x[indices[k] * stride], y[indices[k] * stride] and z[indices[k] * stride],
+ * so both interleaved (AoS) and separate (SoA) coordinate arrays can be used. The best implementation available
+ * on the current CPU (AVX2, SSE or scalar) is selected at runtime.
+ *
+ * @param x x-coordinates
+ * @param y y-coordinates
+ * @param z z-coordinates
+ * @param stride distance (in floats) between coordinates of consecutive points
+ * @param indices indices of the points to process
+ * @param n number of points to process
+ * @param params transformation and projection parameters
+ * @param u output image x-coordinates
+ * @param v output image y-coordinates
+ * @param zc output depths in the camera frame
+ */
+void transformProjectBatch(const float *x, const float *y, const float *z, size_t stride, const int *indices, size_t n,
+		const ProjectionParams &params, float *u, float *v, float *zc) ;
+
+/**
+ * @brief Scalar reference version of transformProjectBatch
+ *
+ * @param x x-coordinates
+ * @param y y-coordinates
+ * @param z z-coordinates
+ * @param stride distance (in floats) between coordinates of consecutive points
+ * @param indices indices of the points to process
+ * @param n number of points to process
+ * @param params transformation and projection parameters
+ * @param u output image x-coordinates
+ * @param v output image y-coordinates
+ * @param zc output depths in the camera frame
+ */
+void transformProjectBatchScalar(const float *x, const float *y, const float *z, size_t stride, const int *indices, size_t n,
+		const ProjectionParams &params, float *u, float *v, float *zc) ;
+
+/**
+ * @brief Gets the name of the implementation selected for the current CPU
+ *
+ * @return "avx2", "sse" or "scalar"
+ */
+const char *getProjectionKernelName() ;
+
+#endif
@@ -0,0 +1,148 @@
+/**
+ *  @file surfel_index.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef SURFEL_INDEX_HPP
+#define SURFEL_INDEX_HPP
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * @brief Spatial index backends available in SurfelMapper
+ */
+enum SpatialIndexType {
+	SPATIAL_INDEX_OCTREE = 0, /**< @brief PCL octree (SurfelOctree) */
+	SPATIAL_INDEX_VOXEL_HASH = 1 /**< @brief open-addressing hash of voxel blocks (SurfelVoxelHash) */
+} ;
+
+/**
+ * @brief Statistics of the spatial index (available in constant time)
+ */
+typedef struct {
+	size_t leaf_count ; /**< @brief number of leaves */
+	size_t branch_count ; /**< @brief number of inner nodes (0 for flat indices) */
+	unsigned int leaf_depth ; /**< @brief depth of leaves below the root (all leaves are kept at the same depth) */
+} SurfelIndexStats ;
+
+/**
+ * @brief Leaf of the spatial index with a contiguous range of surfel indices (used for serialization of the index)
+ */
+typedef struct {
+	int32_t key[3] ; /**< @brief backend-specific integer coordinates of the leaf */
+	uint32_t first ; /**< @brief first surfel index of the leaf */
+	uint32_t count ; /**< @brief number of surfels in the leaf */
+} SurfelLeafRange ;
+
+/**
+* @brief Interface of the spatial index organizing surfel positions
+*
+* The index partitions surfels into leaves (voxels). Every leaf keeps a vector of indices of its surfels in the
+* positions cloud of the surfel store. Pointers to leaf index vectors stay valid until the index is cleared, so
+* the mapper may modify leaf vectors in place (e.g. remove indices of removed surfels).
+*/
+class SurfelIndex {
+public:
+	/**
+	 * @brief A destructor
+	 */
+	virtual ~SurfelIndex() {}
+
+	/**
+	 * @brief Gets the name of the backend
+	 *
+	 * @return backend name
+	 */
+	virtual const char *getName() const = 0 ;
+
+	/**
+	 * @brief Gets statistics of the index
+	 *
+	 * @param stats output statistics
+	 */
+	virtual void getIndexStats(SurfelIndexStats &stats) const = 0 ;
+
+	/**
+	 * @brief Sets the cloud of surfel positions indexed by the leaves
+	 *
+	 * @param positions surfel positions
+	 */
+	virtual void setSurfelPositions(const pcl::PointCloud<pcl::PointXYZ>::Ptr &positions) = 0 ;
+
+	/**
+	 * @brief Removes all leaves
+	 */
+	virtual void clear() = 0 ;
+
+	/**
+	 * @brief Adds a batch of surfels already present in the positions cloud
+	 *
+	 * @param indices indices of the surfels (their positions must be finite)
+	 */
+	virtual void addPointsFromIndicesBulk(const std::vector<int> &indices) = 0 ;
+
+	/**
+	 * @brief Collects leaves intersecting the view frustum
+	 *
+	 * @param frustum view frustum planes
+	 * @param frustum_min minimum corner of the bounding box of the frustum
+	 * @param frustum_max maximum corner of the bounding box of the frustum
+	 * @param leaves index vectors of the collected leaves
+	 * @param nodes_visited number of index nodes examined
+	 */
+	virtual void collectFrustumLeaves(double frustum[24], const Eigen::Vector3f &frustum_min, const Eigen::Vector3f &frustum_max, 
+			std::vector<std::vector<int>*> &leaves, unsigned int &nodes_visited) = 0 ;
+
+	/**
+	 * @brief Collects all leaves
+	 *
+	 * @param leaves index vectors of the leaves
+	 */
+	virtual void collectAllLeaves(std::vector<std::vector<int>*> &leaves) = 0 ;
+
+	/**
+	 * @brief Collects all leaves together with their keys
+	 *
+	 * @param leaves index vectors of the leaves
+	 * @param keys keys of the leaves (three coordinates per leaf)
+	 */
+	virtual void collectAllLeaves(std::vector<std::vector<int>*> &leaves, std::vector<int32_t> &keys) = 0 ;
+
+	/**
+	 * @brief Gets the layout of the leaf grid needed to interpret leaf keys
+	 *
+	 * @param layout output layout (the bounding box for the octree: min x, y, z, max x, y, z, unused for the voxel hash)
+	 */
+	virtual void getLayout(double layout[6]) const = 0 ;
+
+	/**
+	 * @brief Creates leaves directly from serialized leaf ranges (without computing keys of surfels)
+	 *
+	 * The index is expected to be empty, the surfel positions must be already set.
+	 *
+	 * @param layout layout of the leaf grid (as returned by getLayout())
+	 * @param ranges leaf ranges
+	 * @param nranges number of leaf ranges
+	 * @return true if the leaves were created, false if the layout cannot be reproduced (the index is left empty)
+	 */
+	virtual bool loadLeaves(const double layout[6], const SurfelLeafRange *ranges, size_t nranges) = 0 ;
+
+	/**
+	 * @brief Gets indices of surfels inside the box
+	 *
+	 * @param min_pt minimum corner of the box
+	 * @param max_pt maximum corner of the box
+	 * @param k_indices indices of surfels are appended here
+	 */
+	virtual void searchBox(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<int> &k_indices) = 0 ;
+} ;
+
+#endif
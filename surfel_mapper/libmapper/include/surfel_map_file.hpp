@@ -0,0 +1,138 @@
+/**
+ *  @file surfel_map_file.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef SURFEL_MAP_FILE_HPP
+#define SURFEL_MAP_FILE_HPP
+
+#include "surfel_store.hpp"
+#include "surfel_index.hpp"
+#include "surfel_map_snapshot.hpp"
+#include <string>
+#include <stdint.h>
+
+#define SURFEL_MAP_FILE_VERSION 1 /**< Version of the native map file layout */
+
+/**
+ * @brief Sections of the native map file
+ */
+enum SurfelMapSection {
+	MAP_SECTION_POSITIONS = 0, /**< @brief surfel positions (pcl::PointXYZ records) */
+	MAP_SECTION_NORMAL_X, /**< @brief x-components of normals (float) */
+	MAP_SECTION_NORMAL_Y, /**< @brief y-components of normals (float) */
+	MAP_SECTION_NORMAL_Z, /**< @brief z-components of normals (float) */
+	MAP_SECTION_RGBA, /**< @brief colors (uint32) */
+	MAP_SECTION_RADIUS, /**< @brief radii (float) */
+	MAP_SECTION_CONFIDENCE, /**< @brief confidences (uint32) */
+	MAP_SECTION_COUNT, /**< @brief observation counts (uint32) */
+	MAP_SECTION_LEAVES, /**< @brief leaves of the spatial index (SurfelLeafRange records) */
+	MAP_SECTION_NUM /**< @brief number of sections */
+} ;
+
+/**
+ * @brief Header of the native map file
+ */
+typedef struct {
+	char magic[8] ; /**< @brief file signature ("SURFMAP") */
+	uint32_t version ; /**< @brief layout version (SURFEL_MAP_FILE_VERSION) */
+	int32_t index_type ; /**< @brief spatial index backend the leaves come from (see SpatialIndexType) */
+	uint64_t surfel_count ; /**< @brief number of surfels */
+	uint64_t leaf_count ; /**< @brief number of leaves */
+	double resolution ; /**< @brief leaf size of the spatial index */
+	double layout[6] ; /**< @brief layout of the leaf grid (see SurfelIndex::getLayout()) */
+	uint64_t offsets[MAP_SECTION_NUM] ; /**< @brief file offsets of sections (aligned to 64 bytes) */
+} SurfelMapFileHeader ;
+
+/**
+* @brief Native map file (surfel arrays together with the serialized spatial index)
+*
+* Surfels are stored leaf by leaf in the same structure-of-arrays layout as in SurfelStore, so every leaf
+* of the spatial index covers a contiguous range of surfels and is stored as its key and the range only.
+* The file is read through a read-only memory mapping: the arrays are used directly as the source of a bulk
+* copy into the store and the leaves are recreated without computing keys of individual surfels.
+*/
+class SurfelMapFile {
+protected:
+	int fd ; /**< @brief descriptor of the mapped file (-1 - no file) */
+	const uint8_t *data ; /**< @brief mapped file contents */
+	size_t size ; /**< @brief size of the mapping */
+
+public:
+	/**
+	 * @brief Constructs an object with no file mapped
+	 */
+	SurfelMapFile() ;
+
+	/**
+	 * @brief Destroys the object (the file is unmapped)
+	 */
+	~SurfelMapFile() ;
+
+	/**
+	 * @brief Saves live surfels and leaves of the index (removed surfels are skipped)
+	 *
+	 * Surfels are streamed leaf by leaf directly from the store, no copy of the map is made.
+	 *
+	 * @param file_name output file name
+	 * @param store surfel store
+	 * @param index spatial index of the store
+	 * @param index_type type of the spatial index (see SpatialIndexType)
+	 * @param resolution leaf size of the spatial index
+	 * @param nsaved output number of saved surfels
+	 * @return true if the file was written successfully
+	 */
+	static bool save(const std::string &file_name, const SurfelStore &store, SurfelIndex &index, int index_type, double resolution, size_t &nsaved) ;
+
+	/**
+	 * @brief Saves surfels and leaves of the map snapshot
+	 *
+	 * @param file_name output file name
+	 * @param snapshot map snapshot
+	 * @param nsaved output number of saved surfels
+	 * @return true if the file was written successfully
+	 */
+	static bool save(const std::string &file_name, const SurfelMapSnapshot &snapshot, size_t &nsaved) ;
+
+	/**
+	 * @brief Maps the file and validates its header and sections
+	 *
+	 * @param file_name input file name
+	 * @return true if the file is a valid native map file
+	 */
+	bool open(const std::string &file_name) ;
+
+	/**
+	 * @brief Unmaps the file
+	 */
+	void close() ;
+
+	/**
+	 * @brief Gets the file header
+	 *
+	 * @return header (valid while the file is open)
+	 */
+	const SurfelMapFileHeader &getHeader() const ;
+
+	/**
+	 * @brief Gets the contents of the section
+	 *
+	 * @param section section
+	 * @return pointer to the section (valid while the file is open)
+	 */
+	const void *getSection(SurfelMapSection section) const ;
+
+	/**
+	 * @brief Copies surfels of the file into the store (the store is resized)
+	 *
+	 * @param store surfel store
+	 */
+	void loadStore(SurfelStore &store) const ;
+} ;
+
+#endif
@@ -0,0 +1,63 @@
+/**
+ *  @file surfel_map_snapshot.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef SURFEL_MAP_SNAPSHOT_HPP
+#define SURFEL_MAP_SNAPSHOT_HPP
+
+#include "surfel_store.hpp"
+#include "surfel_index.hpp"
+#include <string>
+#include <vector>
+
+/**
+* @brief Read-only copy of the map at a given epoch
+*
+* The snapshot owns copies of the surfel arrays and of the leaf structure of the spatial index (live surfels only),
+* so it can be exported on any thread while the mapper keeps integrating frames. Leaves are flattened: slots of
+* all leaves are kept in a single array in the order of leaves, every leaf is described by its key and range.
+*/
+class SurfelMapSnapshot {
+public:
+	SurfelStore surfels ; /**< @brief copy of the surfel store */
+	std::vector<int> leaf_slots ; /**< @brief slots of live surfels ordered by leaves */
+	std::vector<SurfelLeafRange> leaves ; /**< @brief leaves (ranges refer to leaf_slots) */
+	int index_type ; /**< @brief spatial index backend of the map (see SpatialIndexType) */
+	double resolution ; /**< @brief leaf size of the spatial index */
+	double layout[6] ; /**< @brief layout of the leaf grid (see SurfelIndex::getLayout()) */
+	uint32_t epoch ; /**< @brief map epoch of the snapshot */
+
+	/**
+	 * @brief Copies the map
+	 *
+	 * @param store surfel store of the map
+	 * @param index spatial index of the map
+	 * @param index_type spatial index backend (see SpatialIndexType)
+	 * @param resolution leaf size of the spatial index
+	 */
+	SurfelMapSnapshot(const SurfelStore &store, SurfelIndex &index, int index_type, double resolution) ;
+
+	/**
+	 * @brief Gets number of live surfels in the snapshot
+	 *
+	 * @return number of surfels
+	 */
+	size_t getLiveCount() const ;
+
+	/**
+	 * @brief Saves the snapshot (the format is selected by the file name extension, see SurfelMapWriter::getFormatFromFileName())
+	 *
+	 * @param file_name output file name
+	 * @param nsaved output number of saved surfels
+	 * @return true if the map was saved successfully
+	 */
+	bool save(const std::string &file_name, size_t &nsaved) const ;
+} ;
+
+#endif
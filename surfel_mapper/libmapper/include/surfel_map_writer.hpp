@@ -0,0 +1,109 @@
+/**
+ *  @file surfel_map_writer.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef SURFEL_MAP_WRITER_HPP
+#define SURFEL_MAP_WRITER_HPP
+
+#include "surfel_store.hpp"
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief File format of the saved map
+ */
+enum MapFileFormat {
+	MAP_FORMAT_PCD = 0, /**< @brief binary PCD (fields as in PointCustomSurfel) */
+	MAP_FORMAT_PLY = 1, /**< @brief binary little-endian PLY (vertex properties in the PackedSurfel layout) */
+	MAP_FORMAT_SURFEL_MAP = 2 /**< @brief native map file with the serialized spatial index (see SurfelMapFile), not handled by SurfelMapWriter */
+} ;
+
+/**
+* @brief Streaming writer of surfel maps
+*
+* Surfels are packed from the surfel store into a fixed-size buffer of PackedSurfel records which is
+* written out whenever it fills up, so no copy of the map is built. Both formats store the records as they
+* are (binary, little-endian). The number of surfels is not known until the end of the stream, the header
+* is written with a space-padded placeholder and rewritten by close().
+*/
+class SurfelMapWriter {
+protected:
+	std::ofstream file ; /**< @brief output file */
+	MapFileFormat format ; /**< @brief output file format */
+	std::vector<PackedSurfel> buffer ; /**< @brief write buffer */
+	size_t buffered ; /**< @brief number of records in the write buffer */
+	size_t written ; /**< @brief number of surfels written so far (including buffered ones) */
+
+	/**
+	 * @brief Writes the file header
+	 *
+	 * @param npoints number of surfels (padded to a fixed width)
+	 */
+	void writeHeader(size_t npoints) ;
+
+	/**
+	 * @brief Writes buffered records to the file
+	 */
+	void flush() ;
+
+public:
+	/**
+	 * @brief Constructs the writer
+	 *
+	 * @param buffer_size number of records in the write buffer
+	 */
+	SurfelMapWriter(size_t buffer_size = 65536) ;
+
+	/**
+	 * @brief Destroys the writer (the file is closed if still open)
+	 */
+	~SurfelMapWriter() ;
+
+	/**
+	 * @brief Gets the file format matching the file name extension
+	 *
+	 * @param file_name file name
+	 * @return MAP_FORMAT_PLY for the .ply extension, MAP_FORMAT_SURFEL_MAP for the .smap extension, MAP_FORMAT_PCD otherwise
+	 */
+	static MapFileFormat getFormatFromFileName(const std::string &file_name) ;
+
+	/**
+	 * @brief Creates the file and writes the header
+	 *
+	 * @param file_name file name
+	 * @param format file format
+	 * @return true if the file was created
+	 */
+	bool open(const std::string &file_name, MapFileFormat format) ;
+
+	/**
+	 * @brief Appends surfels from the store (removed surfels are skipped)
+	 *
+	 * @param store surfel store
+	 * @param slots slots of surfels to append
+	 */
+	void write(const SurfelStore &store, const std::vector<int> &slots) ;
+
+	/**
+	 * @brief Flushes the buffer, completes the header and closes the file
+	 *
+	 * @return true if all data were written successfully
+	 */
+	bool close() ;
+
+	/**
+	 * @brief Gets number of surfels written so far
+	 *
+	 * @return number of surfels
+	 */
+	size_t getWrittenCount() const ;
+} ;
+
+#endif
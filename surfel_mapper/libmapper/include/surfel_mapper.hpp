@@ -12,12 +12,24 @@
 #define SURFEL_MAPPER_HPP
 
 #include "point_custom_surfel.hpp"
+#include "surfel_store.hpp"
+#include "surfel_index.hpp"
+#include "surfel_preview.hpp"
+#include "surfel_map_snapshot.hpp"
 #include <pcl/common/common_headers.h>
 #include <pcl/octree/octree.h>
 #include "logger.hpp"
+#include "thread_pool.hpp"
+#include "projection_kernels.hpp"
+#include "normal_estimation.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
-#define CLOUD_WIDTH 640 /**< Default cloud width */
-#define CLOUD_HEIGHT 480 /**< Default cloud height */
+#define CLOUD_WIDTH 640 /**< Default cloud width (initial size of per-frame buffers) */
+#define CLOUD_HEIGHT 480 /**< Default cloud height (initial size of per-frame buffers) */
+#define INDEX_MAP_CANDIDATES 4 /**< Maximum number of surfels kept for a single pixel of the surfel index map */
 
 /**
  * @brief Camera intrinsic parameters
@@ -27,20 +39,164 @@ typedef struct {
 	double beta ; /**< @brief y-focal length (fy) */
 	double cx ; /**< @brief x coordinate of the camera optical center*/
 	double cy ; /**< @brief y coordinate of the camera optical center*/
+	int width ; /**< @brief image width the parameters refer to (0 - the same as the width of input frames)*/
+	int height ; /**< @brief image height the parameters refer to (0 - the same as the height of input frames)*/
 } CameraParams ;
 
+/**
+ * @brief Behaviour of the ingestion pipeline when its input queue is full
+ */
+enum QueuePolicy {
+	QUEUE_BLOCK = 0, /**< @brief the caller waits until a place in the queue is released */
+	QUEUE_DROP_OLDEST = 1, /**< @brief the oldest queued frame is dropped */
+	QUEUE_DROP_NEWEST = 2, /**< @brief the incoming frame is dropped */
+	QUEUE_COALESCE = 3 /**< @brief the most recently queued frame is replaced by the incoming one */
+} ;
+
+/**
+ * @brief Map statistics maintained incrementally (retrieved in constant time)
+ */
+typedef struct {
+	size_t live_surfels ; /**< @brief number of surfels in the map */
+	size_t tombstones ; /**< @brief number of removed surfels still occupying slots of the store */
+	size_t slots ; /**< @brief number of slots of the store (live surfels and tombstones) */
+	size_t store_bytes ; /**< @brief memory occupied by the slots of the store */
+	size_t index_leaves ; /**< @brief number of leaves of the spatial index */
+	size_t index_branches ; /**< @brief number of inner nodes of the spatial index */
+	unsigned int index_leaf_depth ; /**< @brief depth of leaves of the spatial index */
+} MapStats ;
+
+/**
+ * @brief Amount of console output of the mapper
+ */
+enum Verbosity {
+	VERBOSITY_QUIET = 0, /**< @brief nothing is printed */
+	VERBOSITY_INFO = 1, /**< @brief settings and infrequent map operations (compaction, snapshots, loading) */
+	VERBOSITY_FRAME = 2 /**< @brief additionally a report for every integrated frame and preview refresh */
+} ;
+
+/**
+ * @brief Timings and counters of a single frame integration
+ */
+typedef struct {
+	double normal_computation_time ; /**< @brief time of the normal computation (s) */
+	double frame_preprocessing_time ; /**< @brief time of the frame preprocessing - normal filtering, transformation and scope filtering (s) */
+	double preview_wait_time ; /**< @brief time spent waiting for the preview worker (s) */
+	double surfel_update_time ; /**< @brief time of the surfel update (s, 0 if the update is turned off) */
+	double surfel_addition_time ; /**< @brief time of the surfel addition (s) */
+	size_t store_size ; /**< @brief number of slots of the store (surfels including removed ones) */
+	size_t live_surfels_before ; /**< @brief number of surfels in the map before integration */
+	size_t live_surfels_after ; /**< @brief number of surfels in the map after integration */
+	unsigned int ncorrect_scans ; /**< @brief number of scans with a valid reading */
+	unsigned int ncorrect_scans_and_normals ; /**< @brief number of scans with a valid reading and normal */
+	unsigned int ntotal_scans ; /**< @brief number of add-able scans (inside bounds and frontal-oriented) */
+	unsigned int nscans_covered ; /**< @brief number of scans covered by existing surfels */
+	unsigned int nsurfels_inside_frustum ; /**< @brief number of surfels from index leaves inside the frustum */
+	unsigned int nsurfels_projected_on_sensor ; /**< @brief number of surfels projected onto the sensor plane */
+	unsigned int index_nodes_visited ; /**< @brief number of spatial index nodes visited during update */
+	unsigned int nsurfels_updated ; /**< @brief number of surfels updated with a matching scan */
+	unsigned int nscans_too_far ; /**< @brief number of scans too far for surfel update */
+	unsigned int nscans_too_close ; /**< @brief number of scans too close for surfel update */
+	unsigned int nsurfels_invalid_reading ; /**< @brief number of surfels without a matching reading (NaN, outside frame) */
+	unsigned int nsurfels_removed ; /**< @brief number of surfels removed during update */
+	unsigned int nsurfels_added ; /**< @brief number of surfels added */
+	unsigned int nsurfels_added_to_free_slots ; /**< @brief number of added surfels stored in slots of removed ones */
+	size_t free_slots ; /**< @brief number of free slots left in the store */
+	size_t reclaimed_bytes ; /**< @brief bytes reclaimed by map compaction since the previous frame */
+	size_t index_leaves ; /**< @brief number of leaves of the spatial index */
+} FrameStats ;
+
+/**
+ * @brief Strided view of an RGBD frame stored in an external buffer (e.g. data of a PointCloud2 message)
+ *
+ * Point (j, i) of the frame starts at data + i * row_step + j * point_step. Coordinates are 32-bit floats, the color
+ * is a packed 32-bit value (as in pcl::PointXYZRGB).
+ */
+struct CloudView {
+	const uint8_t *data ; /**< @brief first byte of the frame */
+	uint32_t width ; /**< @brief frame width */
+	uint32_t height ; /**< @brief frame height */
+	uint32_t point_step ; /**< @brief bytes between consecutive points of a row */
+	uint32_t row_step ; /**< @brief bytes between consecutive rows */
+	uint32_t x_offset ; /**< @brief offset of the x-coordinate within the point */
+	uint32_t y_offset ; /**< @brief offset of the y-coordinate within the point */
+	uint32_t z_offset ; /**< @brief offset of the z-coordinate within the point */
+	int rgb_offset ; /**< @brief offset of the packed color within the point (negative - no color) */
+	bool is_dense ; /**< @brief true if the frame contains no invalid points */
+	Eigen::Vector4f sensor_origin ; /**< @brief sensor position in the world frame */
+	Eigen::Quaternionf sensor_orientation ; /**< @brief sensor orientation in the world frame */
+	boost::shared_ptr<const void> owner ; /**< @brief owner of the buffer, kept alive as long as the view is queued */
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+} ;
+
+/**
+ * @brief View of a registered depth and color image pair stored in external buffers
+ *
+ * Points are back-projected by the mapper using its camera parameters (rescaled to the image resolution). 
+ * Both images have the same resolution, row strides are given in bytes.
+ */
+struct DepthImageView {
+	const uint8_t *depth ; /**< @brief first byte of the depth image */
+	uint32_t depth_step ; /**< @brief bytes between consecutive rows of the depth image */
+	bool depth_float ; /**< @brief true - depths are 32-bit floats in meters, false - depths are 16-bit unsigned integers */
+	float depth_scale ; /**< @brief meters per unit of an integer depth (e.g. 0.001 for millimeters) */
+	const uint8_t *rgb ; /**< @brief first byte of the color image (NULL - no color) */
+	uint32_t rgb_step ; /**< @brief bytes between consecutive rows of the color image */
+	uint32_t rgb_channels ; /**< @brief number of 8-bit channels of the color image (3 or 4) */
+	bool rgb_bgr ; /**< @brief true - channels are ordered blue, green, red, false - red, green, blue */
+	uint32_t width ; /**< @brief image width */
+	uint32_t height ; /**< @brief image height */
+	Eigen::Vector4f sensor_origin ; /**< @brief sensor position in the world frame */
+	Eigen::Quaternionf sensor_orientation ; /**< @brief sensor orientation in the world frame */
+	boost::shared_ptr<const void> depth_owner ; /**< @brief owner of the depth buffer, kept alive as long as the view is queued */
+	boost::shared_ptr<const void> rgb_owner ; /**< @brief owner of the color buffer, kept alive as long as the view is queued */
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+} ;
+
 /**
 * @brief This is the main class rempresenting surfel map  
 *
 * This class enables to create surfel maps basing on the data from RGBD sensor. Input is formed by RGBD frames
 * with sensor orientation specified. The frames are sequentially integrated into the surfel map. The output
-* is either the full surfel cloud or downsampled preview cloud. The class use octree coupled with frustum
-* for efficient map update.
+* is either the full surfel cloud or downsampled preview cloud. The class use a spatial index (octree or voxel hash) 
+* coupled with frustum for efficient map update.
 */
 class SurfelMapper {
 	protected:
 		//Logger
+		/**
+		 * @brief Fields logged for every integrated frame
+		 */
+		enum LogFieldId {
+			LOG_NORMAL_COMPUTATION_TIME = 0,
+			LOG_FRAME_PREPROCESSING_TIME,
+			LOG_PREVIEW_WAIT_TIME,
+			LOG_SURFEL_UPDATE_TIME,
+			LOG_SURFEL_ADDITION_TIME,
+			LOG_CLOUD_SCENE_WIDTH,
+			LOG_CLOUD_SCENE_ACTUAL_SIZE,
+			LOG_NTOTAL_SCANS,
+			LOG_NSCANS_COVERED,
+			LOG_NSURFELS_INSIDE_FRUSTUM,
+			LOG_NSURFELS_PROJECTED_ON_SENSOR,
+			LOG_OCTREE_NODES_VISITED,
+			LOG_SURFELS_UPDATED,
+			LOG_SCANS_TOO_FAR,
+			LOG_SCANS_TOO_CLOSE,
+			LOG_SURFELS_REMOVED_ON_UPDATE,
+			LOG_SURFELS_ADDED,
+			LOG_CLOUD_SCENE_ACTUAL_SIZE_AFTER,
+			LOG_SURFELS_ADDED_TO_FREE_SLOTS,
+			LOG_FREE_SLOTS,
+			LOG_RECLAIMED_BYTES,
+			LOG_INDEX_LEAVES,
+			LOG_FIELD_COUNT
+		} ;
+
 		Logger logger /**< @brief logger object*/ ;
+		LogField log_fields[LOG_FIELD_COUNT] ; /**< @brief logger handles of the fields (indexed by LogFieldId) */
 
 		//Parameters
 		double DMAX  = 0.005f ; /**< @brief distance threshold for surfel update*/ 
@@ -55,6 +211,14 @@ class SurfelMapper {
 		int SCENE_SIZE = 3e7 ; /**< @brief preallocated size of scene*/
 		bool LOGGING = true ; /**< @brief logging turned on or off*/
 		bool USE_UPDATE = true ; /**< @brief use surfel update or no*/
+		bool USE_INDEX_MAP = false ; /**< @brief associate surfels with scans through a rendered surfel index map (instead of per-surfel depth lookups)*/
+		int NUM_THREADS = 1 ; /**< @brief number of threads used for the surfel update (0 - use hardware concurrency)*/
+		double COMPACTION_RATIO = 0.0 ; /**< @brief fraction of removed surfels in the store that triggers idle map compaction (0 - compaction turned off)*/
+		int NORMAL_ESTIMATION = NORMAL_ESTIMATION_PCL ; /**< @brief normal estimation backend (see NormalEstimationMethod)*/
+		int SPATIAL_INDEX = SPATIAL_INDEX_OCTREE ; /**< @brief spatial index backend (see SpatialIndexType), OCTREE_RESOLUTION is used as its leaf size*/
+		int PIPELINE_DEPTH = 0 ; /**< @brief number of frames queued between ingestion stages (0 - frames are integrated synchronously)*/
+		int QUEUE_POLICY = QUEUE_BLOCK ; /**< @brief behaviour when PIPELINE_DEPTH frames are already waiting (see QueuePolicy)*/
+		int VERBOSITY = VERBOSITY_INFO ; /**< @brief amount of console output (see Verbosity)*/
 		/**
 		 * Default camera parameters
 		 */
@@ -62,22 +226,161 @@ class SurfelMapper {
 			481.2, /**< alpha*/
 			480.0, /**< beta*/
 			319.5, /**< cx*/
-			239.5  /**< cy*/
+			239.5, /**< cy*/
+			0, /**< width*/
+			0  /**< height*/
 		};
+		CameraParams frame_camera_params ; /**< @brief Camera parameters rescaled to the resolution of the current frame */
+
+		SurfelStore surfels ; /**< @brief The main scene surfels (hot positions and cold attributes in separate arrays) */
+		pcl::PointCloud<PointCustomSurfel>::Ptr cloudScene ; /**< @brief Scene cloud view assembled from the surfel store on demand */ 
+		bool cloud_scene_valid ; /**< @brief Is the scene cloud view up to date with the surfel store */
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudSceneDownsampled ; /**< @brief Downsampled scene cloud (front buffer - published snapshot, never modified) */
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudPreviewBack ; /**< @brief Downsampled scene cloud refreshed by the preview worker (back buffer) */
+		boost::shared_ptr<SurfelPreview> preview ; /**< @brief Preview voxels of the downsampled scene cloud (recomputed when marked dirty) */
+
+		std::thread preview_thread ; /**< @brief Background worker refreshing the downsampled scene cloud */
+		std::mutex preview_mutex ; /**< @brief Mutex guarding the preview worker state and the front buffer pointer */
+		std::condition_variable preview_cond ; /**< @brief Signals preview requests and completion of the refresh */
+		bool preview_pending ; /**< @brief Refresh requested but not started yet */
+		bool preview_busy ; /**< @brief Refresh requested or in progress */
+		bool preview_stop ; /**< @brief Termination flag of the preview worker */
 
-		pcl::PointCloud<PointCustomSurfel>::Ptr cloudScene ; /**< @brief The main scene cloud */ 
-		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudSceneDownsampled ; /**< @brief Downsampled scene cloud */
+		boost::shared_ptr<SurfelIndex> spatial_index ; /**< @brief Spatial index organizing surfel positions */
+		std::vector<int> inserted_slots ; /**< @brief Slots of surfels added in the current frame (inserted into the spatial index in bulk) */
+		size_t reclaimed_bytes ; /**< @brief Bytes reclaimed by map compaction since the last logged frame */
+
+		boost::shared_ptr<ThreadPool> thread_pool ; /**< @brief Worker threads used for the surfel update */
+		uint32_t frame_width ; /**< @brief Width of the per-frame buffers */
+		uint32_t frame_height ; /**< @brief Height of the per-frame buffers */
+		std::vector<char> scan_covered ; /**< @brief Scan-array of the current frame (row-major, non-zero - scan covered by a surfel) */
+		std::vector<char> thread_scan_covered ; /**< @brief Per-thread scan-arrays merged after the parallel surfel update (cleared by the merge) */
+
+		/**
+		 * @brief A frame prepared for integration (buffers are reused between frames)
+		 */
+		typedef struct {
+			pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr cloud_normals ; /**< @brief frame with normals in the world frame */
+			pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr cloud_normals_trans ; /**< @brief frame with normals in the camera frame */
+			std::vector<int> valid_pixels ; /**< @brief row-major indices of scans valid for the surfel update and addition */
+			unsigned int ncorrect_scans ; /**< @brief number of scans with a valid reading */
+			unsigned int ncorrect_scans_and_normals ; /**< @brief number of scans with a valid reading and normal */
+			double normal_computation_time ; /**< @brief time of the normal computation (s) */
+			double frame_preprocessing_time ; /**< @brief time of the frame preprocessing (s) */
+		} PreparedFrame ;
 
-		pcl::octree::OctreePointCloudSearch<PointCustomSurfel> octree ; /**< @brief Octree organizing surfels in the cloud */
+		boost::shared_ptr<PreparedFrame> sync_frame ; /**< @brief Frame buffers used by synchronous integration */
 
+		std::thread preparation_thread ; /**< @brief Pipeline stage preparing frames (normals, transformation, filtering) */
+		std::thread integration_thread ; /**< @brief Pipeline stage integrating prepared frames into the map */
+		std::mutex pipeline_mutex ; /**< @brief Mutex guarding the pipeline queues */
+		std::condition_variable pipeline_cond ; /**< @brief Signals changes of the pipeline queues */
 		/**
-		 * @brief Performs affine transformation on the input point 
+		 * @brief A frame waiting for preparation (exactly one of the views is set)
+		 */
+		typedef struct {
+			boost::shared_ptr<const CloudView> cloud ; /**< @brief frame given as a cloud in the world frame */
+			boost::shared_ptr<const DepthImageView> depth_image ; /**< @brief frame given as depth and color images */
+		} InputFrame ;
+
+		std::deque<InputFrame> input_queue ; /**< @brief Frames waiting for preparation (at most PIPELINE_DEPTH) */
+		std::vector<float> ray_x ; /**< @brief x-slopes of back-projection rays for image columns (z = 1) */
+		std::vector<float> ray_y ; /**< @brief y-slopes of back-projection rays for image rows (z = 1) */
+		std::deque<boost::shared_ptr<PreparedFrame> > prepared_queue ; /**< @brief Frames waiting for integration */
+		std::vector<boost::shared_ptr<PreparedFrame> > free_frames ; /**< @brief Frame buffers available for preparation */
+		size_t frames_in_flight ; /**< @brief Frames enqueued but not integrated yet */
+		size_t frames_dropped ; /**< @brief Frames dropped from the input queue according to QUEUE_POLICY */
+		FrameStats last_frame_stats ; /**< @brief Statistics of the most recently integrated frame (guarded by pipeline_mutex) */
+		bool pipeline_stop ; /**< @brief Termination flag of the pipeline stages */
+
+		/**
+		 * @brief Image coordinates and depths of a batch of surfels projected onto the sensor
+		 */
+		typedef struct {
+			std::vector<float> u ; /**< @brief image x-coordinates */
+			std::vector<float> v ; /**< @brief image y-coordinates */
+			std::vector<float> z ; /**< @brief depths in the camera frame */
+		} ProjectionBuffer ;
+
+		std::vector<ProjectionBuffer> thread_projection_buffers ; /**< @brief Per-thread buffers for projected surfels */
+
+		/**
+		 * @brief Transforms and projects surfels of a leaf into the buffer
+		 *
+		 * @param pointIndices index vector of the leaf
+		 * @param projection kernel parameters
+		 * @param buffer output buffer
+		 */
+		void projectLeafSurfels(const std::vector<int> &pointIndices, const ProjectionParams &projection, ProjectionBuffer &buffer) ;
+
+		/**
+		 * @brief Counters gathered during the surfel update step
+		 */
+		typedef struct {
+			unsigned int nsurfels_updated ; /**< @brief number of surfels updated with a matching scan */
+			unsigned int surfels_inside_octree_frustum ; /**< @brief number of surfels from octree leaves inside the frustum */
+			unsigned int surfels_projected_on_sensor ; /**< @brief number of surfels projected onto the sensor plane */
+			unsigned int nscan_too_close ; /**< @brief number of scans too close for surfel update */
+			unsigned int nscan_too_far ; /**< @brief number of scans too far for surfel update */
+			unsigned int nsurfels_invalid_reading ; /**< @brief number of surfels without a matching reading (NaN, outside frame) */
+			unsigned int nsurfels_removed ; /**< @brief number of surfels removed during update */
+		} UpdateCounters ;
+
+		/**
+		 * @brief Accumulates update counters
+		 *
+		 * @param counters accumulated counters
+		 * @param counters_add counters to add
+		 */
+		static void addCounters(UpdateCounters &counters, const UpdateCounters &counters_add) ;
+
+		/**
+		 * @brief A surfel rendered into a pixel of the surfel index map
+		 */
+		typedef struct {
+			float z ; /**< @brief depth of the surfel in the camera frame */
+			int surfel_index ; /**< @brief index of the surfel in the scene cloud */
+			int leaf_position ; /**< @brief position of the surfel index in the leaf index vector */
+			std::vector<int> *leaf_indices ; /**< @brief index vector of the octree leaf holding the surfel */
+		} IndexMapCandidate ;
+
+		/**
+		 * @brief A single pixel of the rendered surfel index map
+		 */
+		typedef struct {
+			int count ; /**< @brief number of candidates */
+			IndexMapCandidate candidates[INDEX_MAP_CANDIDATES] ; /**< @brief closest surfels rendered into the pixel sorted by depth */
+		} IndexMapPixel ;
+
+		std::vector<IndexMapPixel> index_map ; /**< @brief Rendered surfel index map of the current frame (row-major) */
+
+		/**
+		 * @brief Adjusts per-frame buffers and camera parameters to the size of the incoming frame
+		 *
+		 * Buffers are reallocated only when the frame size changes, otherwise they are reused. If the camera parameters
+		 * refer to a different resolution they are rescaled (e.g. for decimated frames).
 		 *
-		 * @param point_in input point
-		 * @param point_out output point
-		 * @param transform transformation matrix
+		 * @param width frame width
+		 * @param height frame height
 		 */
-		static inline void transformPointAffine(PointCustomSurfel &point_in, PointCustomSurfel &point_out, Eigen::Matrix4d transform) ;
+		void prepareFrameBuffers(uint32_t width, uint32_t height) ;
+
+		/**
+		 * @brief Rescales camera parameters to the given frame resolution
+		 *
+		 * @param width frame width
+		 * @param height frame height
+		 * @param params output camera parameters
+		 */
+		void getFrameCameraParams(uint32_t width, uint32_t height, CameraParams &params) const ;
+
+		/**
+		 * @brief Computes parameters of the batch transform-and-project kernel
+		 *
+		 * @param viewMatrix world to camera transformation
+		 * @param projection output kernel parameters
+		 */
+		void computeProjectionParams(const Eigen::Matrix4d &viewMatrix, ProjectionParams &projection) ;
 
 		/**@brief A modified PCL transformPointCloud function aimed at non-rigid homogenous transformations
 		 *
@@ -113,43 +416,330 @@ class SurfelMapper {
 		/**
 		 * @brief Marks position in a scan-array as used
 		 *
-		 * @param scan_covered scan-array
+		 * @param scan_covered scan-array (row-major)
+		 * @param width scan-array width
 		 * @param u - image x-coordinate
 		 * @param v - image y-coordinate
 		 */
-		static void markScanAsCovered(char scan_covered[CLOUD_HEIGHT][CLOUD_WIDTH], float u, float v) ;
+		static void markScanAsCovered(char *scan_covered, uint32_t width, float u, float v) ;
 
 		/**
-		 * @brief Skip all child voxels of the octree node
+		 * @brief Updates the surfel with a matching scan reading (running average of position, normal and color)
 		 *
-		 * This is a corrected version of skipChildVoxels from the pcl::OctreeDepthFirstIterator. The latter actually skips all siblings and children, this version skips only children. 
+		 * @param idx index of the surfel to update
+		 * @param point_scan scan point in the world frame
+		 * @param point_scan_trans scan point in the camera frame
+		 * @param zTor depth to radius conversion factor
+		 */
+		void fuseSurfel(size_t idx, const pcl::PointXYZRGBNormal &point_scan, const pcl::PointXYZRGBNormal &point_scan_trans, double zTor) ;
+
+		/**
+		 * @brief Creates the spatial index selected by SPATIAL_INDEX and the preview grid
+		 */
+		void createSpatialIndex() ;
+
+		/**
+		 * @brief Records the preview voxel of the surfel as changed
+		 *
+		 * Voxels are only recorded (they are marked dirty afterwards), so the method may be called concurrently from many threads.
+		 *
+		 * @param idx surfel index
+		 * @param dirty_voxels the voxel is appended here (unless it is the last recorded voxel)
+		 */
+		void recordPreviewChange(size_t idx, std::vector<int> &dirty_voxels) const ;
+
+		/**
+		 * @brief Records the preview change of the fused surfel
+		 *
+		 * The voxel the surfel was in before the fusion is recorded as changed. If the fusion moved the surfel out of this voxel, 
+		 * the surfel is recorded for insertion into its new voxel. The method may be called concurrently from many threads.
+		 *
+		 * @param idx surfel index
+		 * @param voxel preview voxel of the surfel before the fusion (-1 - no voxel)
+		 * @param dirty_voxels the voxel is appended here (unless it is the last recorded voxel)
+		 * @param moved_surfels the surfel is appended here if it left the voxel
+		 */
+		void recordPreviewUpdate(size_t idx, int voxel, std::vector<int> &dirty_voxels, std::vector<int> &moved_surfels) const ;
+
+		/**
+		 * @brief Computes the axis-aligned bounding box of the view frustum in the world frame
+		 *
+		 * @param viewMatrix world to camera transformation
+		 * @param frustum_min minimum corner of the bounding box
+		 * @param frustum_max maximum corner of the bounding box
+		 */
+		void computeFrustumBounds(const Eigen::Matrix4d &viewMatrix, Eigen::Vector3f &frustum_min, Eigen::Vector3f &frustum_max) ;
+
+		/**
+		 * @brief Collects spatial index leaves intersecting the view frustum
+		 *
+		 * If frustum culling is turned off all leaves are collected.
+		 *
+		 * @param frustum view frustum planes
+		 * @param viewMatrix world to camera transformation
+		 * @param leaves index vectors of the collected leaves
+		 * @param nodes_visited number of index nodes visited during traversal
+		 */
+		void collectFrustumLeaves(double frustum[24], const Eigen::Matrix4d &viewMatrix, std::vector<std::vector<int>*> &leaves, unsigned int &nodes_visited) ;
+
+		/**
+		 * @brief Associates surfels of a single leaf with the scan by projecting each surfel into the depth image and updates them
+		 *
+		 * Removed surfels are erased from the leaf index vector.
+		 *
+		 * @param pointIndices index vector of the leaf
+		 * @param projection transform-and-project kernel parameters
+		 * @param cloud_normals scan cloud in the world frame
+		 * @param cloud_normals_trans scan cloud in the camera frame
+		 * @param scan_covered scan-array (row-major, frame_width wide)
+		 * @param buffer buffer for projected surfels
+		 * @param removed_slots slots of removed surfels are appended here
+		 * @param updated_slots slots of updated surfels are appended here (for the change log of the store)
+		 * @param dirty_voxels preview voxels of updated and removed surfels are appended here
+		 * @param moved_surfels updated surfels which left their preview voxels are appended here
+		 * @param counters update counters
+		 */
+		void updateLeafSurfels(std::vector<int> &pointIndices, const ProjectionParams &projection, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud_normals, 
+				pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud_normals_trans, char *scan_covered, ProjectionBuffer &buffer, 
+				std::vector<int> &removed_slots, std::vector<int> &updated_slots, std::vector<int> &dirty_voxels, std::vector<int> &moved_surfels, 
+				UpdateCounters &counters) ;
+
+		/**
+		 * @brief Updates surfels of the given leaves using all threads of the pool
+		 *
+		 * Leaves are distributed dynamically between threads. Every thread marks covered scans in its own scan-array and counts in its own
+		 * counters, both are merged after all leaves are processed (scan-arrays in row bands by threads of the pool). Slots of removed 
+		 * surfels are put on the free-list of the store.
+		 *
+		 * @param leaves index vectors of the leaves inside the frustum
+		 * @param projection transform-and-project kernel parameters
+		 * @param cloud_normals scan cloud in the world frame
+		 * @param cloud_normals_trans scan cloud in the camera frame
+		 * @param scan_covered scan-array (row-major, frame_width wide)
+		 * @param counters update counters
+		 */
+		void updateSurfelsParallel(std::vector<std::vector<int>*> &leaves, const ProjectionParams &projection, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud_normals, 
+				pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud_normals_trans, char *scan_covered, UpdateCounters &counters) ;
+
+		/**
+		 * @brief Associates surfels with the scan in image space and updates them
+		 *
+		 * Surfels from the given leaves are splatted into a surfel index map keeping up to INDEX_MAP_CANDIDATES closest surfels for each 
+		 * pixel. Association and update is then performed per pixel (rows are distributed between threads of the pool), every candidate 
+		 * of the pixel is handled as in the traversal update, so its cost depends on the frame size rather than on the number of surfels.
+		 * Surfels beyond the closest INDEX_MAP_CANDIDATES of a pixel are left untouched.
+		 * Removed surfels are erased from the leaf index vectors and their slots are put on the free-list of the store.
+		 *
+		 * @param leaves index vectors of the leaves inside the frustum
+		 * @param projection transform-and-project kernel parameters
+		 * @param cloud_normals scan cloud in the world frame
+		 * @param cloud_normals_trans scan cloud in the camera frame
+		 * @param scan_covered scan-array (row-major, frame_width wide)
+		 * @param counters update counters
+		 */
+		void updateSurfelsByIndexMap(std::vector<std::vector<int>*> &leaves, const ProjectionParams &projection, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud_normals, 
+				pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud_normals_trans, char *scan_covered, UpdateCounters &counters) ;
+
+		/**
+		 * @brief Adds a new surfel to the surfel store
+		 *
+		 * A slot of a previously removed surfel is reused if available, otherwise the surfel is appended to the store.
+		 * The slot is queued in inserted_slots, the octree is updated for all queued surfels at once by insertQueuedSurfels().
+		 *
+		 * @param surfel surfel to add
+		 * @return true if a slot was reused
+		 */
+		bool insertSurfel(const PointCustomSurfel &surfel) ;
+
+		/**
+		 * @brief Inserts surfels queued by insertSurfel() into the spatial index (in bulk)
+		 */
+		void insertQueuedSurfels() ;
+
+		/**
+		 * @brief Computes normals of the frame with the selected backend
+		 *
+		 * @param cloud_normals frame (normals are computed in place)
+		 */
+		void estimateNormals(pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud_normals) ;
+
+		/**
+		 * @brief Prepares the frame for the surfel update and addition
+		 *
+		 * In a single pass over cloud_normals (the frame with computed normals): points with incorrect normals are invalidated, the frame 
+		 * is transformed into the camera coordinate system (cloud_normals_trans) and points outside reliable sensor scope or seen at too 
+		 * large angle are invalidated in the camera frame. Indices of the remaining pixels are stored in valid_pixels.
+		 *
+		 * @param viewMatrix world to camera transformation
+		 * @param frame prepared frame (scan counters are set as well)
+		 */
+		void preprocessFrame(const Eigen::Matrix4d &viewMatrix, PreparedFrame &frame) ;
+
+		/**
+		 * @brief Computes the world to camera transformation from the sensor pose of a frame
+		 *
+		 * @param sensor_origin sensor position in the world frame
+		 * @param sensor_orientation sensor orientation in the world frame
+		 * @param viewMatrix output world to camera transformation
+		 */
+		static void computeViewMatrix(const Eigen::Vector4f &sensor_origin, const Eigen::Quaternionf &sensor_orientation, Eigen::Matrix4d &viewMatrix) ;
+
+		/**
+		 * @brief Allocates buffers of a prepared frame
+		 *
+		 * @return new frame
+		 */
+		static boost::shared_ptr<PreparedFrame> createFrame() ;
+
+		/**
+		 * @brief Creates a view of a PCL cloud (the view shares the cloud)
 		 *
-		 * @param it iterator pointing at the octree node
-		 * @param it_end end iterator of the octree
+		 * @param cloud input RGBD cloud
+		 * @return view of the cloud
 		 */
-		static void skipChildVoxelsCorrect(pcl::octree::OctreePointCloud<pcl::PointXYZRGB>::DepthFirstIterator &it, const pcl::octree::OctreePointCloud<pcl::PointXYZRGB>::DepthFirstIterator &it_end) ;
+		static boost::shared_ptr<CloudView> createCloudView(const pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud) ;
 
 		/**
-		 * @brief Compute an average color for the voxel
+		 * @brief Copies coordinates and colors of the viewed frame into a cloud (other fields of the points are left intact)
 		 *
-		 * @param it iterator pointing at the octree node associated with the voxel
-		 * @param it_end end iterator of the octree
-		 * @param point this routine fill the color of this point
+		 * @param view input frame
+		 * @param cloud output cloud (buffer memory is reused)
 		 */
-		void computeVoxelColor(pcl::octree::OctreePointCloud<pcl::PointXYZRGB>::DepthFirstIterator &it, const pcl::octree::OctreePointCloud<pcl::PointXYZRGB>::DepthFirstIterator &it_end, pcl::PointXYZRGB &point) ;
+		static void copyCloudView(const CloudView &view, pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud) ;
 
 		/**
-		 * @brief Filters cloud point by a distance from the sensor 
+		 * @brief Runs the first ingestion stage: computes normals, transforms and filters the frame
+		 *
+		 * The stage does not access the map, so it may be run concurrently with integration of the previous frame.
 		 *
-		 * @param cloud input/output cloud 
+		 * @param view input RGBD frame
+		 * @param frame output prepared frame
 		 */
-		void filterCloudByDistance(pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud) ;
+		void prepareFrame(const CloudView &view, PreparedFrame &frame) ;
+
+		/**
+		 * @brief Rebuilds back-projection ray tables if the image resolution has changed
+		 *
+		 * The pinhole model is separable, so rays are tabulated per column and per row.
+		 *
+		 * @param width image width
+		 * @param height image height
+		 */
+		void updateRayTables(uint32_t width, uint32_t height) ;
+
+		/**
+		 * @brief Back-projects depth and color images into a cloud in the world frame
+		 *
+		 * Pixels with zero or invalid depth are set to NaN. Normals of the points are left intact.
+		 *
+		 * @param image input images
+		 * @param cloud output cloud (buffer memory is reused)
+		 */
+		void backProjectDepthImage(const DepthImageView &image, pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud) ;
+
+		/**
+		 * @brief Runs the first ingestion stage for a frame given as depth and color images
+		 *
+		 * @param image input images
+		 * @param frame output prepared frame
+		 */
+		void prepareFrame(const DepthImageView &image, PreparedFrame &frame) ;
+
+		/**
+		 * @brief Computes normals of the loaded frame and preprocesses it (common part of prepareFrame())
+		 *
+		 * @param viewMatrix world to camera transformation
+		 * @param frame prepared frame with the cloud loaded
+		 */
+		void finishFrame(const Eigen::Matrix4d &viewMatrix, PreparedFrame &frame) ;
+
+		/**
+		 * @brief Puts a frame into the input queue of the pipeline, a full queue is handled according to QUEUE_POLICY
+		 *
+		 * @param input frame to enqueue
+		 * @return false if the frame was dropped, true otherwise
+		 */
+		bool enqueueFrame(const InputFrame &input) ;
+
+		/**
+		 * @brief Runs the second ingestion stage: updates the map with the prepared frame and adds new surfels
+		 *
+		 * @param frame prepared frame
+		 * @param stats output timings and counters of the integration
+		 */
+		void integrateFrame(PreparedFrame &frame, FrameStats &stats) ;
+
+		/**
+		 * @brief Writes statistics of the integrated frame to the log
+		 *
+		 * @param stats frame statistics
+		 */
+		void logFrameStats(const FrameStats &stats) ;
+
+		/**
+		 * @brief Prints statistics of the integrated frame
+		 *
+		 * @param stats frame statistics
+		 */
+		void printFrameStats(const FrameStats &stats) ;
+
+		/**
+		 * @brief Main loop of the preparation stage of the pipeline
+		 */
+		void preparationLoop() ;
+
+		/**
+		 * @brief Main loop of the integration stage of the pipeline
+		 */
+		void integrationLoop() ;
+
+		/**
+		 * @brief Starts the pipeline stages (if PIPELINE_DEPTH is positive)
+		 */
+		void startPipeline() ;
+
+		/**
+		 * @brief Stops the pipeline stages, frames not integrated yet are dropped
+		 */
+		void stopPipeline() ;
+
+		/**
+		 * @brief Waits until all enqueued frames are integrated
+		 *
+		 * Must be called before the map is accessed from outside of the integration stage.
+		 */
+		void waitForPipeline() ;
 
 		/**
 		 * @brief Computes downsampled version of the cloud 
+		 *
+		 * Only preview voxels marked dirty since the previous call are recomputed (in the back buffer), the refreshed
+		 * cloud is then published as a new front buffer. The method is run by the preview worker.
 		 */
 		void downsampleSceneCloud() ;
 
+		/**
+		 * @brief Main loop of the preview worker
+		 */
+		void previewLoop() ;
+
+		/**
+		 * @brief Starts the preview worker
+		 */
+		void startPreviewWorker() ;
+
+		/**
+		 * @brief Requests refresh of the downsampled cloud by the preview worker
+		 */
+		void requestPreview() ;
+
+		/**
+		 * @brief Waits until the preview worker finishes the requested refresh
+		 *
+		 * Must be called before the surfel store or preview voxels are modified.
+		 */
+		void waitForPreview() ;
+
 		/**
 		 * @brief Prints surfel mapper settings 
 		 */
@@ -169,7 +759,7 @@ class SurfelMapper {
 		 * @param DMAX distance threshold for surfel update
 		 * @param MIN_KINECT_DIST reliable minimum sensor reading distance
 		 * @param MAX_KINECT_DIST reliable maximum sensor reading distance
-		 * @param OCTREE_RESOLUTION resolution of underlying octree
+		 * @param OCTREE_RESOLUTION resolution of underlying octree (leaf size of the spatial index)
 		 * @param PREVIEW_RESOLUTION resolution of output preview map
 		 * @param PREVIEW_COLOR_SAMPLES_IN_VOXEL number of samples in voxel used for constructing preview point (affects preview efficiency)
 		 * @param CONFIDENCE_THRESHOLD1 confidence threshold used for establishing reliable surfels
@@ -178,11 +768,20 @@ class SurfelMapper {
 		 * @param SCENE_SIZE preallocated size of scene
 		 * @param LOGGING logging turned on or off
 		 * @param USE_UPDATE use surfel update or no
+		 * @param USE_INDEX_MAP associate surfels with scans through a rendered surfel index map
+		 * @param NUM_THREADS number of threads used for the surfel update (0 - use hardware concurrency)
+		 * @param COMPACTION_RATIO fraction of removed surfels in the store that triggers idle map compaction (0 - compaction turned off)
+		 * @param NORMAL_ESTIMATION normal estimation backend (see NormalEstimationMethod)
+		 * @param SPATIAL_INDEX spatial index backend (see SpatialIndexType)
+		 * @param PIPELINE_DEPTH number of frames queued between ingestion stages (0 - frames are integrated synchronously)
+		 * @param QUEUE_POLICY behaviour when PIPELINE_DEPTH frames are already waiting (see QueuePolicy)
+		 * @param VERBOSITY amount of console output (see Verbosity)
 		 * @param camera_params use this specific set of camera parameters for projection
 		 */
 		SurfelMapper(double DMAX, double MIN_KINECT_DIST, double MAX_KINECT_DIST, double OCTREE_RESOLUTION, 
 		  	     double PREVIEW_RESOLUTION, int PREVIEW_COLOR_SAMPLES_IN_VOXEL, int CONFIDENCE_THRESHOLD1, double MIN_SCAN_ZNORMAL, 
-			     bool USE_FRUSTUM, int SCENE_SIZE, bool LOGGING, bool USE_UPDATE, CameraParams &camera_params) ;
+			     bool USE_FRUSTUM, int SCENE_SIZE, bool LOGGING, bool USE_UPDATE, bool USE_INDEX_MAP, int NUM_THREADS, 
+			     double COMPACTION_RATIO, int NORMAL_ESTIMATION, int SPATIAL_INDEX, int PIPELINE_DEPTH, int QUEUE_POLICY, int VERBOSITY, CameraParams &camera_params) ;
 	
 		/**
 		 * @brief A parametric constructor
@@ -215,13 +814,95 @@ class SurfelMapper {
 		 * Add new point cloud to scene. Input cloud is expected to provide sensor orientation and be transformed to the world frame according to the orientation
 		 *
 		 * @param cloud input RGBD cloud 
+		 * @return timings and counters of the integration
+		 */
+		FrameStats addPointCloudToScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud) ;
+
+		/**
+		 * @brief Enqueues new point cloud for integration into the scene
+		 *
+		 * Normals of the cloud are computed and the cloud is preprocessed while previously enqueued clouds are integrated into the map, 
+		 * the map is updated with the clouds in the order of enqueuing. If PIPELINE_DEPTH clouds are already waiting, the call blocks or 
+		 * a cloud is dropped according to QUEUE_POLICY. The cloud must not be modified afterwards. If PIPELINE_DEPTH is 0 the cloud is 
+		 * integrated synchronously (as by addPointCloudToScene()). Other methods accessing the map wait until all enqueued clouds are integrated.
+		 *
+		 * @param cloud input RGBD cloud (as in addPointCloudToScene())
+		 * @return false if the cloud was dropped, true otherwise
+		 */
+		bool enqueuePointCloud(const pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud) ;
+
+		/**
+		 * @brief Add new frame to scene directly from an external buffer
+		 *
+		 * Same as addPointCloudToScene(), but the frame is read in place (no intermediate PCL cloud is built).
+		 *
+		 * @param view input RGBD frame (coordinates in the world frame, sensor pose set)
+		 * @return timings and counters of the integration
+		 */
+		FrameStats addCloudViewToScene(const CloudView &view) ;
+
+		/**
+		 * @brief Enqueues new frame stored in an external buffer for integration into the scene
+		 *
+		 * Same as enqueuePointCloud(), the buffer is kept alive by the owner of the view until the frame is prepared.
+		 *
+		 * @param view input RGBD frame (coordinates in the world frame, sensor pose set)
+		 * @return false if the frame was dropped, true otherwise
 		 */
-		void addPointCloudToScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud) ;
+		bool enqueueCloudView(const boost::shared_ptr<const CloudView> &view) ;
+
+		/**
+		 * @brief Add new frame given as a registered depth and color image pair to scene 
+		 *
+		 * The images are back-projected with the camera parameters of the mapper (rescaled to the image resolution if needed),
+		 * so the producer does not need to build and transform a cloud.
+		 *
+		 * @param image input images with the sensor pose set
+		 * @return timings and counters of the integration
+		 */
+		FrameStats addDepthImageToScene(const DepthImageView &image) ;
+
+		/**
+		 * @brief Enqueues new frame given as a registered depth and color image pair for integration into the scene
+		 *
+		 * Same as enqueuePointCloud(), the buffers are kept alive by the owners of the view until the frame is prepared.
+		 *
+		 * @param image input images with the sensor pose set
+		 * @return false if the frame was dropped, true otherwise
+		 */
+		bool enqueueDepthImage(const boost::shared_ptr<const DepthImageView> &image) ;
+
+		/**
+		 * @brief Waits until all enqueued clouds are integrated into the scene
+		 */
+		void flushPipeline() ;
+
+		/**
+		 * @brief Checks whether there are no enqueued clouds waiting for integration
+		 *
+		 * @return true if all enqueued clouds are integrated
+		 */
+		bool isPipelineIdle() ;
+
+		/**
+		 * @brief Gets number of enqueued frames dropped according to QUEUE_POLICY (including frames replaced by coalescing)
+		 *
+		 * @return number of dropped frames
+		 */
+		size_t getDroppedFrameCount() ;
+
+		/**
+		 * @brief Gets statistics of the most recently integrated frame (synchronously or by the pipeline)
+		 *
+		 * @return frame statistics (zeroed if no frame was integrated yet)
+		 */
+		FrameStats getLastFrameStats() ;
 
 		/**
 		 * @brief Retrieves scene cloud 
 		 *
-		 * Retrieves scene cloud
+		 * Retrieves scene cloud. Surfels are stored internally in separate per-field arrays, the cloud is assembled from them
+		 * when the map has changed since the previous call. Point indices of the cloud are the same as indices in the map. 
 		 *
 		 * @return the current surfel point cloud 
 		 */
@@ -230,21 +911,36 @@ class SurfelMapper {
 		/**
 		 * @brief Retrieves downsample scene cloud 
 		 *
-		 * Retrieves downsampled scene cloud
+		 * Retrieves downsampled scene cloud. The cloud is refreshed in the background after every frame, the returned
+		 * snapshot is never modified afterwards (a refreshed cloud is published as a new object).
 		 *
 		 * @return the scene cloud downsampled according to the parameters specified 
 		 */
-		pcl::PointCloud<pcl::PointXYZRGB>::Ptr &getCloudSceneDownsampled() ;
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr getCloudSceneDownsampled() ;
+
+		/**
+		 * @brief Waits until the downsampled cloud reflects all integrated frames
+		 */
+		void flushPreview() ;
 
 		/**
 		 * @brief Retrieves current number of surfels in the scene cloud 
 		 *
-		 * Retrieves current number of surfels in the scene cloud 
+		 * Retrieves current number of surfels in the scene cloud (the count is maintained incrementally)
 		 *
 		 * @return number of points in the scene cloud 
 		 */
 		size_t getPointCount() ;
 
+		/**
+		 * @brief Retrieves map statistics
+		 *
+		 * All statistics are maintained incrementally, so the call does not traverse the map.
+		 *
+		 * @return current map statistics
+		 */
+		MapStats getMapStats() ;
+
 		/**
 		 * @brief Resets map
 		 *
@@ -252,6 +948,24 @@ class SurfelMapper {
 		 */
 		void resetMap() ;
 
+		/**
+		 * @brief Checks whether the map should be compacted
+		 *
+		 * @return true if the fraction of removed surfels still occupying the store exceeds COMPACTION_RATIO
+		 */
+		bool needsCompaction() ;
+
+		/**
+		 * @brief Compacts the map
+		 *
+		 * Removed surfels are dropped from the store, the remaining surfels are renumbered and leaf indices of the spatial index are updated accordingly. 
+		 * The operation is intended to be run when no frames are pending (it invalidates indices retrieved earlier). The reclaimed memory 
+		 * is reported in the log row of the next frame.
+		 *
+		 * @return number of reclaimed bytes
+		 */
+		size_t compactMap() ;
+
 		/**
 		 * @brief Gets indices for the points from the bounding box 
 		 *
@@ -273,6 +987,82 @@ class SurfelMapper {
 		 * @param k_indices selected indices are stored in this argument
 		 */
 		void getAllIndices(std::vector<int> &k_indices) ;
+
+		/**
+		 * @brief Serializes surfels within the bounding box as consecutive PackedSurfel records
+		 *
+		 * Surfels are copied directly from the surfel store (no intermediate scene cloud is assembled). Buffer is intended to be
+		 * the data of a PointCloud2 message with the PackedSurfel layout.
+		 *
+		 * @param min_pt lower bounding box corner
+		 * @param max_pt upper bounding box corner
+		 * @param data output buffer (resized to the packed surfels)
+		 * @return number of packed surfels
+		 */
+		size_t getPackedSurfels(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<uint8_t> &data) ;
+
+		/**
+		 * @brief Gets the current map epoch
+		 *
+		 * Each integrated frame opens a new epoch, surfels added, updated or removed by the frame are stamped with it.
+		 *
+		 * @return current epoch
+		 */
+		uint32_t getMapEpoch() ;
+
+		/**
+		 * @brief Gets surfels changed since the given epoch
+		 *
+		 * Surfels are identified by their slots. A mirror of the map applies the delta by overwriting the changed slots and
+		 * dropping the removed ones. Compaction and reset renumber slots, a delta spanning them is a full resynchronization:
+		 * all live surfels are returned and the mirror has to be cleared first.
+		 *
+		 * @param since_epoch epoch of the mirror (0 - empty mirror)
+		 * @param epoch output current epoch (to be passed as since_epoch of the next delta)
+		 * @param slots output slots of changed surfels
+		 * @param data output changed surfels as consecutive PackedSurfel records (in the order of slots)
+		 * @param removed_slots output slots of removed surfels
+		 * @return true for an incremental delta, false for a full resynchronization
+		 */
+		bool getMapDelta(uint32_t since_epoch, uint32_t &epoch, std::vector<int> &slots, std::vector<uint8_t> &data, std::vector<int> &removed_slots) ;
+
+		/**
+		 * @brief Takes a consistent read-only snapshot of the map
+		 *
+		 * Frames already enqueued are integrated first. The surfel arrays and the leaf structure of the spatial index are copied
+		 * in bulk, afterwards the snapshot is independent of the mapper and can be exported on another thread while new frames
+		 * are integrated.
+		 *
+		 * @return map snapshot
+		 */
+		boost::shared_ptr<const SurfelMapSnapshot> takeSnapshot() ;
+
+		/**
+		 * @brief Saves live surfels with all attributes to a binary PCD or PLY file
+		 *
+		 * Surfels are streamed leaf by leaf of the spatial index through a fixed-size write buffer, no copy of the map is made.
+		 * Integration is blocked until the file is written, to save the map in the background use a snapshot (see takeSnapshot()).
+		 * The format is selected by the file name extension (see SurfelMapWriter::getFormatFromFileName()). The native map file
+		 * (.smap) also keeps leaves of the spatial index and can be loaded back with loadMap().
+		 *
+		 * @param file_name output file name
+		 * @param nsaved output number of saved surfels
+		 * @return true if the map was saved successfully
+		 */
+		bool saveMap(const std::string &file_name, size_t &nsaved) ;
+
+		/**
+		 * @brief Replaces the map with the one stored in a native map file (saved by saveMap() with the .smap extension)
+		 *
+		 * The file is memory-mapped and surfel arrays are bulk-copied into the surfel store. Leaves of the spatial index are
+		 * recreated directly from the file if it was saved with the same index backend and resolution, otherwise surfels are
+		 * inserted into the index in bulk. The current map is kept if the file cannot be read.
+		 *
+		 * @param file_name input file name
+		 * @param nloaded output number of loaded surfels
+		 * @return true if the map was loaded successfully
+		 */
+		bool loadMap(const std::string &file_name, size_t &nloaded) ;
 } ;
 
 #endif
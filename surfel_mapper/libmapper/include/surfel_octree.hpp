@@ -0,0 +1,82 @@
+/**
+ *  @file surfel_octree.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef SURFEL_OCTREE_HPP
+#define SURFEL_OCTREE_HPP
+
+#include "surfel_index.hpp"
+#include <pcl/point_types.h>
+#include <pcl/octree/octree.h>
+#include <vector>
+
+/**
+* @brief Octree organizing surfel positions with support for bulk insertion
+*
+* Extends the PCL search octree with insertion of a batch of points already present in the input cloud.
+* The bounding box is adapted once for the whole batch, points are grouped by their leaf keys and every
+* group is appended to its leaf container after a single descent from the root. Frustum culling is done
+* hierarchically during the depth-first traversal of the tree.
+*/
+class SurfelOctree : public pcl::octree::OctreePointCloudSearch<pcl::PointXYZ>, public SurfelIndex {
+protected:
+	/**
+	 * @brief Point index together with the key of its leaf
+	 */
+	typedef struct {
+		pcl::octree::OctreeKey key ; /**< @brief leaf key */
+		int index ; /**< @brief point index in the input cloud */
+	} KeyedIndex ;
+
+	std::vector<KeyedIndex> keyed_indices ; /**< @brief Buffer for keys of the inserted batch (reused between batches) */
+
+	/**
+	 * @brief Orders keyed indices by leaf key (and by point index within a leaf)
+	 */
+	static bool compareKeyedIndices(const KeyedIndex &a, const KeyedIndex &b) ;
+
+	/**
+	 * @brief Skip all child voxels of the octree node
+	 *
+	 * This is a corrected version of skipChildVoxels from the pcl::OctreeDepthFirstIterator. The latter actually skips all siblings and children, this version skips only children. 
+	 *
+	 * @param it iterator pointing at the octree node
+	 * @param it_end end iterator of the octree
+	 */
+	static void skipChildVoxelsCorrect(DepthFirstIterator &it, const DepthFirstIterator &it_end) ;
+
+public:
+	/**
+	 * @brief Constructs an empty octree
+	 *
+	 * @param resolution octree resolution (leaf voxel size)
+	 */
+	SurfelOctree(const double resolution) ;
+
+	/**
+	 * @brief Adds a batch of points from the input cloud to the octree
+	 *
+	 * @param indices indices of finite points of the input cloud not yet present in the octree
+	 */
+	void addPointsFromIndicesBulk(const std::vector<int> &indices) ;
+
+	const char *getName() const ;
+	void getIndexStats(SurfelIndexStats &stats) const ;
+	void setSurfelPositions(const pcl::PointCloud<pcl::PointXYZ>::Ptr &positions) ;
+	void clear() ;
+	void collectFrustumLeaves(double frustum[24], const Eigen::Vector3f &frustum_min, const Eigen::Vector3f &frustum_max, 
+			std::vector<std::vector<int>*> &leaves, unsigned int &nodes_visited) ;
+	void collectAllLeaves(std::vector<std::vector<int>*> &leaves) ;
+	void collectAllLeaves(std::vector<std::vector<int>*> &leaves, std::vector<int32_t> &keys) ;
+	void getLayout(double layout[6]) const ;
+	bool loadLeaves(const double layout[6], const SurfelLeafRange *ranges, size_t nranges) ;
+	void searchBox(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<int> &k_indices) ;
+} ;
+
+#endif
@@ -0,0 +1,113 @@
+/**
+ *  @file surfel_preview.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef SURFEL_PREVIEW_HPP
+#define SURFEL_PREVIEW_HPP
+
+#include "surfel_voxel_hash.hpp"
+#include <vector>
+
+/**
+* @brief Incrementally maintained downsampled preview of the surfel map
+*
+* Surfels are grouped in preview voxels of a world-anchored grid (voxel blocks of the underlying voxel hash),
+* every non-empty voxel is represented by a single point of the preview cloud. Voxels are marked dirty when 
+* their surfels are added, updated or removed and only dirty voxels are recomputed by refresh(), points of 
+* the remaining voxels stay in place.
+*
+* A surfel moved to another voxel by an update is inserted into its new voxel and both voxels are marked dirty.
+* Surfel indices of a voxel are not updated when a surfel is removed (its slot may be reused by a surfel from 
+* another voxel), such stale indices and duplicates of slots reused in the same voxel are dropped when the 
+* voxel is recomputed.
+*/
+class SurfelPreview : public SurfelVoxelHash {
+protected:
+	std::vector<int> block_points ; /**< @brief index of the preview point of every block (-1 - no point) */
+	std::vector<int> point_blocks ; /**< @brief block of every preview point */
+	std::vector<char> block_dirty ; /**< @brief is the block marked dirty */
+	std::vector<int> dirty_blocks ; /**< @brief blocks to be recomputed */
+
+	/**
+	 * @brief Checks whether the surfel still belongs to the block
+	 */
+	bool belongsToBlock(const Block &block, int idx) const ;
+
+	/**
+	 * @brief Removes the preview point of the block (the last point is moved into its place)
+	 */
+	void removeBlockPoint(int b, pcl::PointCloud<pcl::PointXYZRGB> &preview) ;
+
+public:
+	/**
+	 * @brief Constructs an empty preview
+	 *
+	 * @param resolution preview voxel size
+	 */
+	SurfelPreview(const double resolution) ;
+
+	/**
+	 * @brief Gets the preview voxel of the surfel position
+	 *
+	 * The method does not modify the preview, so it may be called concurrently from many threads.
+	 *
+	 * @param position surfel position
+	 * @return index of the voxel or -1 if there is no such voxel
+	 */
+	int getVoxelIndex(const pcl::PointXYZ &position) const ;
+
+	/**
+	 * @brief Checks whether the position lies in the voxel
+	 *
+	 * The method does not modify the preview, so it may be called concurrently from many threads.
+	 *
+	 * @param voxel index of the voxel (-1 - no voxel)
+	 * @param position surfel position
+	 * @return true if the position lies in the voxel
+	 */
+	bool isInVoxel(int voxel, const pcl::PointXYZ &position) const ;
+
+	/**
+	 * @brief Marks voxels dirty
+	 *
+	 * @param voxels indices of voxels (duplicates and -1 are allowed)
+	 */
+	void markVoxelsDirty(const std::vector<int> &voxels) ;
+
+	/**
+	 * @brief Gets number of voxels waiting for recomputation
+	 *
+	 * @return number of dirty voxels
+	 */
+	size_t getDirtyCount() const ;
+
+	/**
+	 * @brief Adds surfels to the preview and marks their voxels dirty
+	 *
+	 * @param indices indices of the surfels
+	 */
+	void addPointsFromIndicesBulk(const std::vector<int> &indices) ;
+
+	/**
+	 * @brief Removes all voxels (the preview cloud has to be cleared separately)
+	 */
+	void clear() ;
+
+	/**
+	 * @brief Recomputes points of dirty voxels in the preview cloud
+	 *
+	 * @param color_samples number of surfels of the voxel used for computing the voxel color
+	 * @param rgba surfel colors
+	 * @param preview preview cloud (holding points from the previous calls)
+	 * @return number of recomputed voxels
+	 */
+	size_t refresh(int color_samples, const std::vector<uint32_t> &rgba, pcl::PointCloud<pcl::PointXYZRGB> &preview) ;
+} ;
+
+#endif
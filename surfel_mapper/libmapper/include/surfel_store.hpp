@@ -0,0 +1,270 @@
+/**
+ *  @file surfel_store.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef SURFEL_STORE_HPP
+#define SURFEL_STORE_HPP
+
+#include "point_custom_surfel.hpp"
+#include <pcl/point_cloud.h>
+#include <vector>
+#include <stdint.h>
+
+/**
+* @brief Packed surfel record used for map transmission (all PointCustomSurfel fields without padding, 40 bytes)
+*/
+typedef struct {
+	float x ; /**< @brief x-coordinate of the surfel */
+	float y ; /**< @brief y-coordinate of the surfel */
+	float z ; /**< @brief z-coordinate of the surfel */
+	float normal_x ; /**< @brief x-component of the surfel normal */
+	float normal_y ; /**< @brief y-component of the surfel normal */
+	float normal_z ; /**< @brief z-component of the surfel normal */
+	uint32_t rgba ; /**< @brief surfel color (packed as in PointCustomSurfel) */
+	float radius ; /**< @brief surfel radius */
+	uint32_t confidence ; /**< @brief surfel confidence */
+	uint32_t count ; /**< @brief surfel observation count */
+} PackedSurfel ;
+
+/**
+* @brief Surfel storage with hot and cold fields kept in separate arrays
+*
+* Surfel positions (the only data needed for association) are kept in a contiguous point cloud
+* which is also the input cloud of the spatial index. Remaining (cold) attributes are kept in
+* separate per-field arrays indexed in the same way as positions. Removed surfels stay in the
+* store with NaN positions (tombstones), so indices of the remaining surfels do not change. Slots
+* of removed surfels are kept on a free-list and reused by subsequent insertions, the store can
+* also be compacted to get rid of tombstones altogether.
+*
+* Every slot is stamped with the epoch of its last addition, update or removal, so changes since
+* a given epoch can be extracted. Compaction and clearing renumber slots, they open a new epoch after
+* which earlier changes can no longer be tracked (resync epoch). Modified slots are also kept in a change
+* log (each slot once), so recent changes are extracted without scanning the whole store. The log is 
+* restarted when it grows large, older changes are then found by scanning the epochs.
+*/
+class SurfelStore {
+public:
+	pcl::PointCloud<pcl::PointXYZ>::Ptr positions ; /**< @brief surfel positions (hot data) */
+	std::vector<float> normal_x ; /**< @brief x-components of surfel normals */
+	std::vector<float> normal_y ; /**< @brief y-components of surfel normals */
+	std::vector<float> normal_z ; /**< @brief z-components of surfel normals */
+	std::vector<uint32_t> rgba ; /**< @brief surfel colors (packed as in PointCustomSurfel) */
+	std::vector<float> radius ; /**< @brief surfel radii */
+	std::vector<uint32_t> confidence ; /**< @brief surfel confidences */
+	std::vector<uint32_t> count ; /**< @brief surfel observation counts */
+	std::vector<uint32_t> epoch ; /**< @brief epochs of the last modification of slots */
+	std::vector<int> free_slots ; /**< @brief slots of removed surfels available for reuse */
+	size_t live_count ; /**< @brief number of live (not removed) surfels, maintained on insertion and slot release */
+	uint32_t current_epoch ; /**< @brief epoch stamped on modified slots */
+	uint32_t resync_epoch ; /**< @brief epoch of the last slot renumbering (compaction or clearing) */
+	std::vector<int> change_log ; /**< @brief slots modified after log_epoch (each slot once) */
+	std::vector<char> logged ; /**< @brief is the slot in the change log */
+	uint32_t log_epoch ; /**< @brief all slots modified after this epoch are in the change log */
+
+	/**
+	 * @brief Adds the slot to the change log (unless it is already there)
+	 *
+	 * @param idx slot index
+	 */
+	void logSlot(size_t idx) ;
+
+	/**
+	 * @brief Empties the change log, it holds changes after the current epoch from now on
+	 */
+	void restartChangeLog() ;
+
+	/**
+	 * @brief Constructs an empty store
+	 */
+	SurfelStore() ;
+
+	/**
+	 * @brief Preallocates memory for the given number of surfels
+	 *
+	 * @param n number of surfels
+	 */
+	void reserve(size_t n) ;
+
+	/**
+	 * @brief Removes all surfels
+	 */
+	void clear() ;
+
+	/**
+	 * @brief Resizes the store to the given number of live surfels (to be filled in place, e.g. by a bulk load)
+	 *
+	 * The free-list is emptied and all slots are stamped with a new resync epoch.
+	 *
+	 * @param n number of surfels
+	 */
+	void resize(size_t n) ;
+
+	/**
+	 * @brief Gets number of slots in the store (including removed surfels)
+	 *
+	 * @return number of slots
+	 */
+	size_t size() const ;
+
+	/**
+	 * @brief Gets number of removed surfels still occupying slots of the store
+	 *
+	 * @return number of tombstones
+	 */
+	size_t getTombstoneCount() const ;
+
+	/**
+	 * @brief Gets number of live surfels
+	 *
+	 * Surfels invalidated but not yet released with releaseSlots() are still counted as live.
+	 *
+	 * @return number of live surfels
+	 */
+	size_t getLiveCount() const ;
+
+	/**
+	 * @brief Gets memory occupied by a single slot of the store
+	 *
+	 * @return number of bytes per surfel
+	 */
+	static size_t getBytesPerSurfel() ;
+
+	/**
+	 * @brief Appends cold attributes of a surfel
+	 *
+	 * The position of the surfel is expected to be already appended to the positions cloud (by the spatial index).
+	 *
+	 * @param surfel surfel to append
+	 */
+	void appendAttributes(const PointCustomSurfel &surfel) ;
+
+	/**
+	 * @brief Appends a surfel (both position and attributes)
+	 *
+	 * @param surfel surfel to append
+	 * @return slot of the appended surfel
+	 */
+	size_t append(const PointCustomSurfel &surfel) ;
+
+	/**
+	 * @brief Overwrites the surfel at the given slot (both position and attributes)
+	 *
+	 * @param idx slot index
+	 * @param surfel new surfel data
+	 */
+	void setSurfel(size_t idx, const PointCustomSurfel &surfel) ;
+
+	/**
+	 * @brief Gathers all fields of the surfel into a single point
+	 *
+	 * @param idx slot index
+	 * @param surfel output surfel
+	 */
+	void getSurfel(size_t idx, PointCustomSurfel &surfel) const ;
+
+	/**
+	 * @brief Marks the surfel as removed (NaN position)
+	 *
+	 * @param idx slot index
+	 */
+	void invalidate(size_t idx) ;
+
+	/**
+	 * @brief Puts slots of removed surfels on the free-list and adds them to the change log
+	 *
+	 * @param slots slots of surfels already marked as removed
+	 */
+	void releaseSlots(const std::vector<int> &slots) ;
+
+	/**
+	 * @brief Takes a free slot from the free-list
+	 *
+	 * The taken slot is counted as live, it is expected to be filled with setSurfel().
+	 *
+	 * @param idx taken slot
+	 * @return true if a free slot was available, false otherwise
+	 */
+	bool acquireSlot(int &idx) ;
+
+	/**
+	 * @brief Removes tombstones by moving live surfels towards the beginning of the store
+	 *
+	 * The relative order of live surfels is preserved. The free-list is emptied.
+	 *
+	 * @param remap for each old slot its new index (-1 for removed surfels)
+	 * @return number of reclaimed slots
+	 */
+	size_t compact(std::vector<int> &remap) ;
+
+	/**
+	 * @brief Converts the store into an (unorganized) surfel point cloud
+	 *
+	 * Point i of the output cloud corresponds to slot i of the store.
+	 *
+	 * @param cloud output cloud
+	 */
+	void toPointCloud(pcl::PointCloud<PointCustomSurfel> &cloud) const ;
+
+	/**
+	 * @brief Packs the given surfels into consecutive records (removed surfels are skipped)
+	 *
+	 * @param slots slot indices of surfels to pack
+	 * @param packed output records (at least slots.size() records)
+	 * @return number of packed surfels
+	 */
+	size_t pack(const std::vector<int> &slots, PackedSurfel *packed) const ;
+
+	/**
+	 * @brief Packs the given surfels into consecutive records (removed surfels are skipped)
+	 *
+	 * @param slots slot indices of surfels to pack
+	 * @param nslots number of slot indices
+	 * @param packed output records (at least nslots records)
+	 * @return number of packed surfels
+	 */
+	size_t pack(const int *slots, size_t nslots, PackedSurfel *packed) const ;
+
+	/**
+	 * @brief Opens a new epoch (subsequent modifications are stamped with it)
+	 *
+	 * @return the new epoch
+	 */
+	uint32_t beginEpoch() ;
+
+	/**
+	 * @brief Stamps the slot with the current epoch (to be called after modifying surfel attributes in place)
+	 *
+	 * The method may be called concurrently from many threads, so the slot has to be added to the change log 
+	 * with logChanges() afterwards.
+	 *
+	 * @param idx slot index
+	 */
+	void touch(size_t idx) ;
+
+	/**
+	 * @brief Adds slots modified in place (stamped with touch()) to the change log
+	 *
+	 * @param slots slot indices
+	 */
+	void logChanges(const std::vector<int> &slots) ;
+
+	/**
+	 * @brief Gets slots modified after the given epoch
+	 *
+	 * If slots were renumbered after the given epoch, the changes cannot be tracked and all live slots are reported as changed.
+	 *
+	 * @param since_epoch epoch already known to the caller
+	 * @param changed output slots of live surfels added or updated after since_epoch
+	 * @param removed output slots of surfels removed after since_epoch (and not reused)
+	 * @return true if the changes were tracked, false if all live slots are returned (full resynchronization)
+	 */
+	bool getChangedSlots(uint32_t since_epoch, std::vector<int> &changed, std::vector<int> &removed) const ;
+} ;
+
+#endif
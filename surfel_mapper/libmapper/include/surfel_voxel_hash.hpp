@@ -0,0 +1,134 @@
+/**
+ *  @file surfel_voxel_hash.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef SURFEL_VOXEL_HASH_HPP
+#define SURFEL_VOXEL_HASH_HPP
+
+#include "surfel_index.hpp"
+#include <deque>
+#include <vector>
+
+/**
+* @brief Sparse voxel grid organizing surfel positions
+*
+* Surfels are kept in voxel blocks of a fixed size addressed by integer block coordinates. Blocks are
+* located through a flat open-addressing (linear probing) hash table, so a surfel is inserted in O(1) time
+* regardless of the extent of the map. Ranges of blocks (for frustum culling and box search) are enumerated 
+* either by probing every cell of the range or by scanning the list of blocks, whichever is cheaper. 
+* Blocks are never removed (until the index is cleared), which keeps pointers to their index vectors valid.
+*/
+class SurfelVoxelHash : public SurfelIndex {
+protected:
+	/**
+	 * @brief Voxel block with indices of its surfels
+	 */
+	typedef struct {
+		int x ; /**< @brief x block coordinate */
+		int y ; /**< @brief y block coordinate */
+		int z ; /**< @brief z block coordinate */
+		std::vector<int> indices ; /**< @brief indices of surfels in the block */
+	} Block ;
+
+	/**
+	 * @brief Slot of the hash table
+	 */
+	typedef struct {
+		int x ; /**< @brief x block coordinate */
+		int y ; /**< @brief y block coordinate */
+		int z ; /**< @brief z block coordinate */
+		int block ; /**< @brief index of the block in blocks (-1 - empty slot) */
+	} Entry ;
+
+	double resolution ; /**< @brief block size */
+	pcl::PointCloud<pcl::PointXYZ>::Ptr positions ; /**< @brief indexed surfel positions */
+	std::vector<Entry> table ; /**< @brief hash table (capacity is a power of two) */
+	std::deque<Block> blocks ; /**< @brief voxel blocks (deque keeps addresses of blocks stable on growth) */
+
+	/**
+	 * @brief Hashes block coordinates
+	 */
+	static size_t hashCoords(int x, int y, int z) ;
+
+	/**
+	 * @brief Computes coordinates of the block containing the point
+	 */
+	void getBlockCoords(const pcl::PointXYZ &point, int &x, int &y, int &z) const ;
+
+	/**
+	 * @brief Computes coordinates of the block containing the point
+	 */
+	void getBlockCoords(const Eigen::Vector3f &point, int &x, int &y, int &z) const ;
+
+	/**
+	 * @brief Computes bounds of the block
+	 */
+	void getBlockBounds(const Block &block, Eigen::Vector3f &min_bb, Eigen::Vector3f &max_bb) const ;
+
+	/**
+	 * @brief Finds the block with the given coordinates
+	 *
+	 * @return index of the block or -1 if there is no such block
+	 */
+	int findBlock(int x, int y, int z) const ;
+
+	/**
+	 * @brief Finds the block with the given coordinates, creates the block if it does not exist
+	 *
+	 * @return index of the block
+	 */
+	int getOrCreateBlock(int x, int y, int z) ;
+
+	/**
+	 * @brief Rebuilds the hash table with the new capacity
+	 *
+	 * @param capacity new capacity (power of two)
+	 */
+	void rehash(size_t capacity) ;
+
+	/**
+	 * @brief Collects blocks overlapping the box
+	 *
+	 * @param min_pt minimum corner of the box
+	 * @param max_pt maximum corner of the box
+	 * @param block_indices indices of collected blocks
+	 * @param nprobes number of examined cells or blocks
+	 */
+	void collectBlocksInRange(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<int> &block_indices, unsigned int &nprobes) const ;
+
+public:
+	/**
+	 * @brief Constructs an empty index
+	 *
+	 * @param resolution block size
+	 */
+	SurfelVoxelHash(const double resolution) ;
+
+	/**
+	 * @brief Gets number of voxel blocks
+	 *
+	 * @return number of blocks
+	 */
+	size_t getBlockCount() const ;
+
+	const char *getName() const ;
+	void getIndexStats(SurfelIndexStats &stats) const ;
+	void setSurfelPositions(const pcl::PointCloud<pcl::PointXYZ>::Ptr &positions) ;
+	void clear() ;
+	void addPointsFromIndicesBulk(const std::vector<int> &indices) ;
+	void collectFrustumLeaves(double frustum[24], const Eigen::Vector3f &frustum_min, const Eigen::Vector3f &frustum_max, 
+			std::vector<std::vector<int>*> &leaves, unsigned int &nodes_visited) ;
+	void collectAllLeaves(std::vector<std::vector<int>*> &leaves) ;
+	void collectAllLeaves(std::vector<std::vector<int>*> &leaves, std::vector<int32_t> &keys) ;
+	void getLayout(double layout[6]) const ;
+	bool loadLeaves(const double layout[6], const SurfelLeafRange *ranges, size_t nranges) ;
+	void searchBox(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<int> &k_indices) ;
+} ;
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ *  @file thread_pool.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+/**
+* @brief A simple pool of persistent worker threads
+*
+* The pool executes data-parallel loops. Items of the loop are distributed dynamically - every thread
+* (including the calling one) grabs the next unprocessed item from a shared counter, so threads that
+* finished their items early take over the remaining work of the slower ones.
+*/
+class ThreadPool {
+public:
+	/**
+	 * @brief Task executed for a single item of the loop. Arguments: thread id (0 - calling thread), item index.
+	 */
+	typedef std::function<void(unsigned int, size_t)> Task ;
+
+protected:
+	std::vector<std::thread> workers ; /**< @brief worker threads (the calling thread is not included) */
+	std::mutex mutex ; /**< @brief mutex guarding the task state */
+	std::mutex call_mutex ; /**< @brief mutex serializing concurrent parallelFor calls */
+	std::condition_variable start_cond ; /**< @brief signals availability of a new task */
+	std::condition_variable done_cond ; /**< @brief signals completion of the task by all workers */
+	const Task *current_task ; /**< @brief task being currently executed */
+	size_t task_size ; /**< @brief number of items of the current task */
+	std::atomic<size_t> next_item ; /**< @brief next item to be processed */
+	size_t generation ; /**< @brief task counter used to wake up workers */
+	size_t pending ; /**< @brief number of workers still working on the current task */
+	bool stop ; /**< @brief termination flag */
+
+	/**
+	 * @brief Main loop of the worker thread
+	 *
+	 * @param thread_id identifier of the thread
+	 */
+	void workerLoop(unsigned int thread_id) ;
+
+	/**
+	 * @brief Processes items of the current task until none is left
+	 *
+	 * @param thread_id identifier of the thread
+	 */
+	void runItems(unsigned int thread_id) ;
+
+public:
+	/**
+	 * @brief Constructs the pool
+	 *
+	 * @param nthreads total number of threads used by parallelFor (including the calling thread), 0 - use hardware concurrency
+	 */
+	ThreadPool(unsigned int nthreads) ;
+
+	/**
+	 * @brief Stops and joins all worker threads
+	 */
+	~ThreadPool() ;
+
+	/**
+	 * @brief Gets the total number of threads (including the calling thread)
+	 *
+	 * @return number of threads
+	 */
+	unsigned int getThreadCount() const ;
+
+	/**
+	 * @brief Executes task for all items from the range [0, nitems) and waits for completion
+	 *
+	 * @param nitems number of items
+	 * @param task task to execute for every item
+	 */
+	void parallelFor(size_t nitems, const Task &task) ;
+} ;
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ *  @file trajectory_buffer.hpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#ifndef TRAJECTORY_BUFFER_HPP
+#define TRAJECTORY_BUFFER_HPP
+
+#include <Eigen/Geometry>
+#include <Eigen/StdDeque>
+#include <deque>
+#include <stdint.h>
+
+/**
+ * @brief Result of the pose lookup
+ */
+enum PoseLookupResult {
+	POSE_AVAILABLE = 0, /**< @brief pose found (interpolated) */
+	POSE_PENDING = 1, /**< @brief time stamp is newer than the last pose, the pose may become available later */
+	POSE_UNAVAILABLE = 2 /**< @brief time stamp is older than the first pose (e.g. the pose was evicted) */
+} ;
+
+/**
+* @brief Time-indexed buffer of sensor poses
+*
+* Poses are appended in the order of increasing time stamps and kept in a double-ended queue used as a ring buffer
+* (new poses are pushed at the back, old ones are evicted from the front). Time stamps are integer nanoseconds,
+* so lookups compare them exactly. A lookup bisects the buffer and interpolates between the bracketing poses
+* (linearly for positions, spherically for orientations).
+*/
+class TrajectoryBuffer {
+protected:
+	/**
+	 * @brief A single pose of the trajectory
+	 */
+	typedef struct {
+		int64_t stamp ; /**< @brief time stamp (ns) */
+		Eigen::Vector3d position ; /**< @brief sensor position */
+		Eigen::Quaterniond orientation ; /**< @brief sensor orientation */
+	} TimedPose ;
+
+	std::deque<TimedPose, Eigen::aligned_allocator<TimedPose> > poses ; /**< @brief poses ordered by time stamps */
+	int64_t tolerance ; /**< @brief time stamps closer than the tolerance to the ends of the buffer are clamped (ns) */
+
+	/**
+	 * @brief Finds the last pose with the time stamp not greater than the given one
+	 *
+	 * @param stamp time stamp (ns)
+	 * @return index of the pose (-1 if all poses are newer)
+	 */
+	int findPoseBefore(int64_t stamp) const ;
+
+public:
+	/**
+	 * @brief Constructs an empty buffer
+	 *
+	 * @param tolerance time stamps closer than the tolerance to the ends of the buffer are clamped to the end poses (ns)
+	 */
+	TrajectoryBuffer(int64_t tolerance = 1000000) ;
+
+	/**
+	 * @brief Appends a pose
+	 *
+	 * @param stamp time stamp (ns)
+	 * @param position sensor position
+	 * @param orientation sensor orientation
+	 * @return true if the pose was appended, false if its time stamp is not newer than the last one
+	 */
+	bool addPose(int64_t stamp, const Eigen::Vector3d &position, const Eigen::Quaterniond &orientation) ;
+
+	/**
+	 * @brief Gets the interpolated pose at the given time
+	 *
+	 * @param stamp time stamp (ns)
+	 * @param origin output sensor position (homogenous)
+	 * @param orientation output sensor orientation
+	 * @return lookup result, the outputs are set only for POSE_AVAILABLE
+	 */
+	PoseLookupResult getPose(int64_t stamp, Eigen::Vector4f &origin, Eigen::Quaternionf &orientation) const ;
+
+	/**
+	 * @brief Removes poses not needed for lookups at the given or later time stamps
+	 *
+	 * The last pose not newer than the time stamp is kept for interpolation.
+	 *
+	 * @param stamp time stamp (ns)
+	 * @return number of removed poses
+	 */
+	size_t evictBefore(int64_t stamp) ;
+
+	/**
+	 * @brief Gets the time stamp of the last pose
+	 *
+	 * @return time stamp (ns), the minimum int64_t value if the buffer is empty
+	 */
+	int64_t getLastStamp() const ;
+
+	/**
+	 * @brief Gets number of poses in the buffer
+	 *
+	 * @return number of poses
+	 */
+	size_t size() const ;
+
+	/**
+	 * @brief Removes all poses
+	 */
+	void clear() ;
+} ;
+
+#endif
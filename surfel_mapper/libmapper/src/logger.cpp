@@ -1,19 +1,227 @@
 /**
  *  @file logger.cpp
  *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
- * 
+ *
  *  @section LICENSE
  *
  *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
  *  Security and Defence Systems Division <http://www.piap.pl>
  */
 
-#include "logger_impl.hpp"
+#include "logger.hpp"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <cmath>
+#include <stdint.h>
+
+#define SEPARATOR ";" /**< Default log file separator */
+#define NA_VALUE "n/a" /**< Default notation for not applicable fields */
+#define BINARY_LOG_MAGIC "SMLOG01" /**< Magic string of the binary log (with the terminating zero - 8 bytes) */
+#define WRITE_PERIOD_MS 1000 /**< Maximum time rows stay in the ring buffer (ms) */
+
+Logger::Logger():Logger(std::string("log.csv"))
+{}
+
+Logger::Logger(const std::string &fileName, size_t ring_capacity)
+{
+	this->fileName = fileName ;
+	this->ring_capacity = std::max<size_t>(ring_capacity, 1) ;
+	size_t len = fileName.size() ;
+	format = (len >= 4 && fileName.compare(len - 4, 4, ".bin") == 0) ? LOG_FORMAT_BINARY : LOG_FORMAT_CSV ;
+	loggingOn = false ;
+	ring_head = ring_count = 0 ;
+	pushed_rows = written_rows = dropped_rows = 0 ;
+	flush_requested = stop = started = false ;
+}
+
+Logger::~Logger()
+{
+	if (started) {
+		{
+			std::unique_lock<std::mutex> lock(mutex) ;
+			stop = true ;
+		}
+		write_cond.notify_one() ;
+		writer.join() ;
+		if (dropped_rows > 0)
+			std::cerr << "Logger: dropped rows [" << dropped_rows << "]" << std::endl ;
+	}
+}
+
+LogField Logger::addField(const std::string &field)
+{
+	LogField handle = getField(field) ;
+	if (handle >= 0)
+		return handle ;
+	if (started) {
+		std::cerr << "Logger: field [" << field << "] cannot be added after the log file is initialized" << std::endl ;
+		return -1 ;
+	}
+
+	fields.push_back(field) ;
+	row.push_back(std::numeric_limits<double>::quiet_NaN()) ;
+	return fields.size() - 1 ;
+}
+
+LogField Logger::getField(const std::string &field) const
+{
+	for (size_t i = 0; i < fields.size() ; i++)
+		if (fields[i].compare(field) == 0)
+			return i ;
+	return -1 ;
+}
+
+void Logger::nextRow()
+{
+	if (!loggingOn || !started)
+		return ;
+
+	bool wake = false ;
+	{
+		std::unique_lock<std::mutex> lock(mutex) ;
+		if (ring_count < ring_capacity) {
+			size_t slot = (ring_head + ring_count) % ring_capacity ;
+			std::copy(row.begin(), row.end(), ring.begin() + slot * fields.size()) ;
+			ring_count++ ;
+			pushed_rows++ ;
+			//Wake up the writer once the ring is half full, otherwise it writes periodically
+			wake = (ring_count == ring_capacity / 2 + 1) ;
+		} else
+			dropped_rows++ ;
+	}
+	if (wake)
+		write_cond.notify_one() ;
+
+	std::fill(row.begin(), row.end(), std::numeric_limits<double>::quiet_NaN()) ;
+}
+
+void Logger::initFile()
+{
+	if (!loggingOn || started)
+		return ;
+
+	bool header = true ;
+	if (format == LOG_FORMAT_CSV) {
+		//Append to the existing file, the header is written only to a new one
+		std::ifstream existing(fileName.c_str()) ;
+		header = !existing.is_open() ;
+		file.open(fileName.c_str(), std::ios::out | std::ios::app) ;
+	} else
+		file.open(fileName.c_str(), std::ios::out | std::ios::trunc | std::ios::binary) ;
+
+	if (!file.is_open()) {
+		std::cerr << "Logger: cannot open log file [" << fileName << "]" << std::endl ;
+		return ;
+	}
+	file.precision(15) ;
+	if (header)
+		writeHeader() ;
+
+	ring.resize(ring_capacity * fields.size()) ;
+	stop = false ;
+	started = true ;
+	writer = std::thread(&Logger::writerLoop, this) ;
+}
+
+void Logger::writeHeader()
+{
+	if (format == LOG_FORMAT_CSV) {
+		for (size_t i = 0; i < fields.size() ; i++)
+			file << fields[i] << SEPARATOR ;
+		file << std::endl ;
+	} else {
+		uint32_t nfields = fields.size() ;
+		file.write(BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC)) ;
+		file.write((const char*)&nfields, sizeof(nfields)) ;
+		for (size_t i = 0; i < fields.size() ; i++) {
+			uint32_t len = fields[i].size() ;
+			file.write((const char*)&len, sizeof(len)) ;
+			file.write(fields[i].data(), len) ;
+		}
+		file.flush() ;
+	}
+}
+
+void Logger::writeRows(const double *rows, size_t nrows)
+{
+	size_t nfields = fields.size() ;
+	if (format == LOG_FORMAT_BINARY) {
+		file.write((const char*)rows, nrows * nfields * sizeof(double)) ;
+	} else {
+		for (size_t r = 0; r < nrows ; r++) {
+			const double *values = rows + r * nfields ;
+			for (size_t i = 0; i < nfields ; i++) {
+				if (std::isnan(values[i]))
+					file << NA_VALUE << SEPARATOR ;
+				else
+					file << values[i] << SEPARATOR ;
+			}
+			file << '\n' ;
+		}
+	}
+	file.flush() ;
+}
+
+void Logger::writerLoop()
+{
+	size_t nfields = fields.size() ;
+	std::vector<double> rows ;
+	bool last = false ;
+
+	while (!last) {
+		size_t nrows ;
+		{
+			std::unique_lock<std::mutex> lock(mutex) ;
+			write_cond.wait_for(lock, std::chrono::milliseconds(WRITE_PERIOD_MS), [this] {
+				return stop || flush_requested || ring_count > ring_capacity / 2 ;
+			}) ;
+			flush_requested = false ;
+			last = stop ;
+
+			//Take the rows out of the ring, so that the file is written without holding the lock
+			nrows = ring_count ;
+			rows.resize(nrows * nfields) ;
+			for (size_t r = 0; r < nrows ; r++) {
+				size_t slot = (ring_head + r) % ring_capacity ;
+				std::copy(ring.begin() + slot * nfields, ring.begin() + (slot + 1) * nfields, rows.begin() + r * nfields) ;
+			}
+			ring_head = (ring_head + nrows) % ring_capacity ;
+			ring_count = 0 ;
+		}
+
+		if (nrows > 0)
+			writeRows(rows.data(), nrows) ;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex) ;
+			written_rows += nrows ;
+		}
+		written_cond.notify_all() ;
+	}
+	file.close() ;
+}
+
+void Logger::flush()
+{
+	if (!started)
+		return ;
+
+	std::unique_lock<std::mutex> lock(mutex) ;
+	size_t target = pushed_rows ;
+	flush_requested = true ;
+	write_cond.notify_one() ;
+	written_cond.wait(lock, [this, target] { return written_rows >= target ; }) ;
+}
+
+size_t Logger::getDroppedRows()
+{
+	std::unique_lock<std::mutex> lock(mutex) ;
+	return dropped_rows ;
+}
 
-//Instantiate necessary functions
-template void Logger::log<int>(const std::string &field, const int value) ; 
-template void Logger::log<unsigned long>(const std::string &field, const unsigned long value) ; 
-template void Logger::log<unsigned int>(const std::string &field, const unsigned int value) ; 
-template void Logger::log<float>(const std::string &field, const float value) ; 
-template void Logger::log<double>(const std::string &field, const double value) ; 
-template void Logger::log<std::string>(const std::string &field, const std::string value) ; 
+void Logger::turnLoggingOn(bool loggingOn)
+{
+	this->loggingOn = loggingOn ;
+}
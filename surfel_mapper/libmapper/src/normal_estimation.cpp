@@ -0,0 +1,110 @@
+/**
+ *  @file normal_estimation.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "normal_estimation.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+/**
+ * @brief Number of rows processed by a thread at once
+ */
+#define NORMAL_ESTIMATION_BAND_HEIGHT 16
+
+/**
+ * @brief Marks the normal of the point as invalid
+ *
+ * @param point point to modify
+ */
+static inline void invalidateNormal(pcl::PointXYZRGBNormal &point)
+{
+	point.normal_x = point.normal_y = point.normal_z = point.curvature = std::numeric_limits<float>::quiet_NaN () ;
+}
+
+/**
+ * @brief Estimates normals for a single row of an organized cloud
+ *
+ * @param cloud input/output cloud
+ * @param i row index
+ * @param radius distance (in pixels) between the pixel and its neighbours
+ * @param max_depth_change_factor depth discontinuity threshold relative to the depth of the pixel
+ * @param viewpoint sensor origin
+ */
+static void estimateRowNormals(pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud, int i, int radius, float max_depth_change_factor, const float viewpoint[3])
+{
+	const int width = cloud.width ;
+	const int height = cloud.height ;
+	pcl::PointXYZRGBNormal *row = &cloud.points[i * width] ;
+
+	//Rows without vertical neighbours
+	if (i < radius || i >= height - radius) {
+		for (int j = 0; j < width ; j++)
+			invalidateNormal(row[j]) ;
+		return ;
+	}
+
+	const pcl::PointXYZRGBNormal *row_up = row - radius * width ;
+	const pcl::PointXYZRGBNormal *row_down = row + radius * width ;
+	const float change_factor = max_depth_change_factor * radius ;
+	for (int j = 0; j < width ; j++) {
+		pcl::PointXYZRGBNormal &center = row[j] ;
+		if (j < radius || j >= width - radius) {
+			invalidateNormal(center) ;
+			continue ;
+		}
+		const pcl::PointXYZRGBNormal &left = row[j - radius] ;
+		const pcl::PointXYZRGBNormal &right = row[j + radius] ;
+		const pcl::PointXYZRGBNormal &up = row_up[j] ;
+		const pcl::PointXYZRGBNormal &down = row_down[j] ;
+
+		//Depth discontinuity check (comparisons with NaN fail, so missing readings are rejected as well)
+		float max_change = change_factor * center.z ;
+		bool continuous = fabsf(left.z - center.z) <= max_change && fabsf(right.z - center.z) <= max_change &&
+				fabsf(up.z - center.z) <= max_change && fabsf(down.z - center.z) <= max_change ;
+		if (!continuous) {
+			invalidateNormal(center) ;
+			continue ;
+		}
+
+		//Cross product of horizontal and vertical differences
+		float dxx = right.x - left.x, dxy = right.y - left.y, dxz = right.z - left.z ;
+		float dyx = down.x - up.x, dyy = down.y - up.y, dyz = down.z - up.z ;
+		float nx = dxy * dyz - dxz * dyy ;
+		float ny = dxz * dyx - dxx * dyz ;
+		float nz = dxx * dyy - dxy * dyx ;
+		float norm = std::sqrt(nx * nx + ny * ny + nz * nz) ;
+		if (!(norm > 0.0f)) {
+			invalidateNormal(center) ;
+			continue ;
+		}
+
+		//Orient the normal towards the viewpoint
+		float vx = viewpoint[0] - center.x, vy = viewpoint[1] - center.y, vz = viewpoint[2] - center.z ;
+		float scale = (nx * vx + ny * vy + nz * vz < 0.0f ? -1.0f : 1.0f) / norm ;
+		center.normal_x = nx * scale ;
+		center.normal_y = ny * scale ;
+		center.normal_z = nz * scale ;
+		center.curvature = 0.0f ;
+	}
+}
+
+void estimateNormalsCrossProduct(pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud, int radius, float max_depth_change_factor, ThreadPool &pool)
+{
+	const float viewpoint[3] = { cloud.sensor_origin_[0], cloud.sensor_origin_[1], cloud.sensor_origin_[2] } ;
+	const int height = cloud.height ;
+	size_t nbands = (height + NORMAL_ESTIMATION_BAND_HEIGHT - 1) / NORMAL_ESTIMATION_BAND_HEIGHT ;
+
+	//Rows only read coordinates of their neighbours and write their own normals, so bands are independent
+	pool.parallelFor(nbands, [&](unsigned int thread_id, size_t b) {
+		int row_end = std::min<int>((b + 1) * NORMAL_ESTIMATION_BAND_HEIGHT, height) ;
+		for (int i = b * NORMAL_ESTIMATION_BAND_HEIGHT; i < row_end ; i++)
+			estimateRowNormals(cloud, i, radius, max_depth_change_factor, viewpoint) ;
+	}) ;
+}
@@ -0,0 +1,162 @@
+/**
+ *  @file projection_kernels.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "projection_kernels.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROJECTION_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Signature shared by all kernel implementations
+ */
+typedef void (*TransformProjectFunc)(const float *, const float *, const float *, size_t, const int *, size_t,
+		const ProjectionParams &, float *, float *, float *) ;
+
+void transformProjectBatchScalar(const float *x, const float *y, const float *z, size_t stride, const int *indices, size_t n,
+		const ProjectionParams &params, float *u, float *v, float *zc)
+{
+	const float *m = params.m ;
+	for (size_t k = 0; k < n ; k++) {
+		size_t offset = static_cast<size_t>(indices[k]) * stride ;
+		float px = x[offset] ;
+		float py = y[offset] ;
+		float pz = z[offset] ;
+		float xt = m[0] * px + m[1] * py + m[2] * pz + m[3] ;
+		float yt = m[4] * px + m[5] * py + m[6] * pz + m[7] ;
+		float zt = m[8] * px + m[9] * py + m[10] * pz + m[11] ;
+		u[k] = params.alpha * (xt / zt) + params.cx ;
+		v[k] = params.beta * (yt / zt) + params.cy ;
+		zc[k] = zt ;
+	}
+}
+
+#ifdef PROJECTION_KERNELS_X86
+
+/**
+ * @brief SSE version of transformProjectBatch (gathers are done with scalar loads)
+ */
+static void transformProjectBatchSSE(const float *x, const float *y, const float *z, size_t stride, const int *indices, size_t n,
+		const ProjectionParams &params, float *u, float *v, float *zc)
+{
+	const float *m = params.m ;
+	const __m128 m0 = _mm_set1_ps(m[0]), m1 = _mm_set1_ps(m[1]), m2 = _mm_set1_ps(m[2]), m3 = _mm_set1_ps(m[3]) ;
+	const __m128 m4 = _mm_set1_ps(m[4]), m5 = _mm_set1_ps(m[5]), m6 = _mm_set1_ps(m[6]), m7 = _mm_set1_ps(m[7]) ;
+	const __m128 m8 = _mm_set1_ps(m[8]), m9 = _mm_set1_ps(m[9]), m10 = _mm_set1_ps(m[10]), m11 = _mm_set1_ps(m[11]) ;
+	const __m128 alpha = _mm_set1_ps(params.alpha), beta = _mm_set1_ps(params.beta) ;
+	const __m128 cx = _mm_set1_ps(params.cx), cy = _mm_set1_ps(params.cy) ;
+
+	size_t k = 0 ;
+	for (; k + 4 <= n ; k += 4) {
+		size_t o0 = static_cast<size_t>(indices[k]) * stride ;
+		size_t o1 = static_cast<size_t>(indices[k + 1]) * stride ;
+		size_t o2 = static_cast<size_t>(indices[k + 2]) * stride ;
+		size_t o3 = static_cast<size_t>(indices[k + 3]) * stride ;
+		__m128 px = _mm_set_ps(x[o3], x[o2], x[o1], x[o0]) ;
+		__m128 py = _mm_set_ps(y[o3], y[o2], y[o1], y[o0]) ;
+		__m128 pz = _mm_set_ps(z[o3], z[o2], z[o1], z[o0]) ;
+
+		__m128 xt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, px), _mm_mul_ps(m1, py)), _mm_add_ps(_mm_mul_ps(m2, pz), m3)) ;
+		__m128 yt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m4, px), _mm_mul_ps(m5, py)), _mm_add_ps(_mm_mul_ps(m6, pz), m7)) ;
+		__m128 zt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m8, px), _mm_mul_ps(m9, py)), _mm_add_ps(_mm_mul_ps(m10, pz), m11)) ;
+
+		_mm_storeu_ps(u + k, _mm_add_ps(_mm_mul_ps(alpha, _mm_div_ps(xt, zt)), cx)) ;
+		_mm_storeu_ps(v + k, _mm_add_ps(_mm_mul_ps(beta, _mm_div_ps(yt, zt)), cy)) ;
+		_mm_storeu_ps(zc + k, zt) ;
+	}
+	transformProjectBatchScalar(x, y, z, stride, indices + k, n - k, params, u + k, v + k, zc + k) ;
+}
+
+/**
+ * @brief AVX2 version of transformProjectBatch (uses hardware gathers)
+ */
+__attribute__((target("avx2,fma"))) static void transformProjectBatchAVX2(const float *x, const float *y, const float *z, size_t stride,
+		const int *indices, size_t n, const ProjectionParams &params, float *u, float *v, float *zc)
+{
+	const float *m = params.m ;
+	const __m256 m0 = _mm256_set1_ps(m[0]), m1 = _mm256_set1_ps(m[1]), m2 = _mm256_set1_ps(m[2]), m3 = _mm256_set1_ps(m[3]) ;
+	const __m256 m4 = _mm256_set1_ps(m[4]), m5 = _mm256_set1_ps(m[5]), m6 = _mm256_set1_ps(m[6]), m7 = _mm256_set1_ps(m[7]) ;
+	const __m256 m8 = _mm256_set1_ps(m[8]), m9 = _mm256_set1_ps(m[9]), m10 = _mm256_set1_ps(m[10]), m11 = _mm256_set1_ps(m[11]) ;
+	const __m256 alpha = _mm256_set1_ps(params.alpha), beta = _mm256_set1_ps(params.beta) ;
+	const __m256 cx = _mm256_set1_ps(params.cx), cy = _mm256_set1_ps(params.cy) ;
+	const __m256i vstride = _mm256_set1_epi32(static_cast<int>(stride)) ;
+
+	size_t k = 0 ;
+	for (; k + 8 <= n ; k += 8) {
+		//Offsets (in floats) of the coordinates - they fit in int32 for any realistic scene size
+		__m256i offsets = _mm256_mullo_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(indices + k)), vstride) ;
+		__m256 px = _mm256_i32gather_ps(x, offsets, 4) ;
+		__m256 py = _mm256_i32gather_ps(y, offsets, 4) ;
+		__m256 pz = _mm256_i32gather_ps(z, offsets, 4) ;
+
+		__m256 xt = _mm256_fmadd_ps(m0, px, _mm256_fmadd_ps(m1, py, _mm256_fmadd_ps(m2, pz, m3))) ;
+		__m256 yt = _mm256_fmadd_ps(m4, px, _mm256_fmadd_ps(m5, py, _mm256_fmadd_ps(m6, pz, m7))) ;
+		__m256 zt = _mm256_fmadd_ps(m8, px, _mm256_fmadd_ps(m9, py, _mm256_fmadd_ps(m10, pz, m11))) ;
+
+		_mm256_storeu_ps(u + k, _mm256_fmadd_ps(alpha, _mm256_div_ps(xt, zt), cx)) ;
+		_mm256_storeu_ps(v + k, _mm256_fmadd_ps(beta, _mm256_div_ps(yt, zt), cy)) ;
+		_mm256_storeu_ps(zc + k, zt) ;
+	}
+	transformProjectBatchScalar(x, y, z, stride, indices + k, n - k, params, u + k, v + k, zc + k) ;
+}
+
+#endif
+
+/**
+ * @brief Kernel implementation selected for the current CPU
+ */
+typedef struct {
+	TransformProjectFunc func ; /**< @brief kernel function */
+	const char *name ; /**< @brief kernel name */
+} ProjectionKernel ;
+
+/**
+ * @brief Selects the best kernel implementation supported by the CPU
+ *
+ * @return selected kernel
+ */
+static ProjectionKernel selectProjectionKernel()
+{
+	ProjectionKernel kernel = { transformProjectBatchScalar, "scalar" } ;
+#ifdef PROJECTION_KERNELS_X86
+	__builtin_cpu_init() ;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		kernel.func = transformProjectBatchAVX2 ;
+		kernel.name = "avx2" ;
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernel.func = transformProjectBatchSSE ;
+		kernel.name = "sse" ;
+	}
+#endif
+	return kernel ;
+}
+
+/**
+ * @brief Gets the kernel selected for the current CPU (the selection is made once)
+ *
+ * @return selected kernel
+ */
+static const ProjectionKernel &getProjectionKernel()
+{
+	static const ProjectionKernel kernel = selectProjectionKernel() ;
+	return kernel ;
+}
+
+void transformProjectBatch(const float *x, const float *y, const float *z, size_t stride, const int *indices, size_t n,
+		const ProjectionParams &params, float *u, float *v, float *zc)
+{
+	getProjectionKernel().func(x, y, z, stride, indices, n, params, u, v, zc) ;
+}
+
+const char *getProjectionKernelName()
+{
+	return getProjectionKernel().name ;
+}
@@ -0,0 +1,267 @@
+/**
+ *  @file surfel_map_file.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "surfel_map_file.hpp"
+#include <fstream>
+#include <cstring>
+#include <climits>
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAP_SECTION_ALIGNMENT 64 /**< Alignment of sections in the file */
+#define MAP_WRITE_BUFFER_SIZE (1 << 20) /**< Size of the write buffer (bytes) */
+
+static const char SURFEL_MAP_MAGIC[8] = "SURFMAP" ;
+
+/**
+ * @brief Sizes of section elements
+ */
+static const size_t section_element_size[MAP_SECTION_NUM] = {
+	sizeof(pcl::PointXYZ), sizeof(float), sizeof(float), sizeof(float), sizeof(uint32_t),
+	sizeof(float), sizeof(uint32_t), sizeof(uint32_t), sizeof(SurfelLeafRange)
+} ;
+
+/**
+ * @brief Buffered output of a section of the native map file
+ */
+class SectionWriter {
+	std::ofstream &file ; /**< @brief output file */
+	std::vector<char> buffer ; /**< @brief write buffer */
+	size_t buffered ; /**< @brief number of buffered bytes */
+public:
+	SectionWriter(std::ofstream &file): file(file), buffer(MAP_WRITE_BUFFER_SIZE), buffered(0) {}
+
+	void write(const void *element, size_t element_size) {
+		if (buffered + element_size > buffer.size())
+			flush() ;
+		memcpy(&buffer[buffered], element, element_size) ;
+		buffered += element_size ;
+	}
+
+	void flush() {
+		file.write(&buffer[0], buffered) ;
+		buffered = 0 ;
+	}
+
+	//Pads the file up to the alignment of the next section
+	void align() {
+		flush() ;
+		static const char zeros[MAP_SECTION_ALIGNMENT] = {0} ;
+		size_t pos = file.tellp() ;
+		if (pos % MAP_SECTION_ALIGNMENT)
+			file.write(zeros, MAP_SECTION_ALIGNMENT - pos % MAP_SECTION_ALIGNMENT) ;
+	}
+} ;
+
+/**
+ * @brief Writes a section with a field of live surfels in the order of leaves
+ */
+template <typename VectorT> static void writeField(SectionWriter &writer, const std::vector<const std::vector<int>*> &leaves, const SurfelStore &store, const VectorT &field)
+{
+	for (size_t l = 0; l < leaves.size() ; l++) {
+		const std::vector<int> &pointIndices = *leaves[l] ;
+		for (size_t i = 0; i < pointIndices.size() ; i++)
+			if (!std::isnan(store.positions->points[pointIndices[i]].x))
+				writer.write(&field[pointIndices[i]], sizeof(field[0])) ;
+	}
+	writer.align() ;
+}
+
+/**
+ * @brief Writes the native map file
+ *
+ * @param file_name output file name
+ * @param store surfel store
+ * @param leaves slot lists written one after another (removed surfels are skipped)
+ * @param ranges leaf ranges of live surfels in the order of writing
+ * @param nsurfels number of live surfels in the slot lists
+ * @param index_type type of the spatial index (see SpatialIndexType)
+ * @param resolution leaf size of the spatial index
+ * @param layout layout of the leaf grid (see SurfelIndex::getLayout())
+ * @param nsaved output number of saved surfels
+ * @return true if the file was written successfully
+ */
+static bool writeMapFile(const std::string &file_name, const SurfelStore &store, const std::vector<const std::vector<int>*> &leaves, 
+			 const std::vector<SurfelLeafRange> &ranges, uint64_t nsurfels, int index_type, double resolution, const double *layout, size_t &nsaved)
+{
+	nsaved = 0 ;
+	std::ofstream file(file_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc) ;
+	if (!file.is_open())
+		return false ;
+
+	SurfelMapFileHeader header ;
+	memset(&header, 0, sizeof(header)) ;
+	memcpy(header.magic, SURFEL_MAP_MAGIC, sizeof(header.magic)) ;
+	header.version = SURFEL_MAP_FILE_VERSION ;
+	header.index_type = index_type ;
+	header.surfel_count = nsurfels ;
+	header.leaf_count = ranges.size() ;
+	header.resolution = resolution ;
+	memcpy(header.layout, layout, sizeof(header.layout)) ;
+	uint64_t offset = (sizeof(header) + MAP_SECTION_ALIGNMENT - 1) / MAP_SECTION_ALIGNMENT * MAP_SECTION_ALIGNMENT ;
+	for (int s = 0; s < MAP_SECTION_NUM ; s++) {
+		header.offsets[s] = offset ;
+		uint64_t nelements = s == MAP_SECTION_LEAVES ? header.leaf_count : nsurfels ;
+		offset += (nelements * section_element_size[s] + MAP_SECTION_ALIGNMENT - 1) / MAP_SECTION_ALIGNMENT * MAP_SECTION_ALIGNMENT ;
+	}
+
+	SectionWriter writer(file) ;
+	writer.write(&header, sizeof(header)) ;
+	writer.align() ;
+	writeField(writer, leaves, store, store.positions->points) ;
+	writeField(writer, leaves, store, store.normal_x) ;
+	writeField(writer, leaves, store, store.normal_y) ;
+	writeField(writer, leaves, store, store.normal_z) ;
+	writeField(writer, leaves, store, store.rgba) ;
+	writeField(writer, leaves, store, store.radius) ;
+	writeField(writer, leaves, store, store.confidence) ;
+	writeField(writer, leaves, store, store.count) ;
+	for (size_t l = 0; l < ranges.size() ; l++)
+		writer.write(&ranges[l], sizeof(SurfelLeafRange)) ;
+	writer.align() ;
+
+	//Errors of the final writes are reported only when the stream is flushed and closed
+	writer.flush() ;
+	file.close() ;
+	if (file.fail())
+		return false ;
+	nsaved = nsurfels ;
+	return true ;
+}
+
+SurfelMapFile::SurfelMapFile(): fd(-1), data(NULL), size(0)
+{}
+
+SurfelMapFile::~SurfelMapFile()
+{
+	close() ;
+}
+
+bool SurfelMapFile::save(const std::string &file_name, const SurfelStore &store, SurfelIndex &index, int index_type, double resolution, size_t &nsaved)
+{
+	//Surfels are streamed directly from the leaves, live surfels of every leaf form a contiguous range in the file
+	std::vector<std::vector<int>*> index_leaves ;
+	std::vector<int32_t> keys ;
+	index.collectAllLeaves(index_leaves, keys) ;
+	std::vector<const std::vector<int>*> leaves(index_leaves.begin(), index_leaves.end()) ;
+	std::vector<SurfelLeafRange> ranges ;
+	ranges.reserve(leaves.size()) ;
+	uint64_t nsurfels = 0 ;
+	for (size_t l = 0; l < leaves.size() ; l++) {
+		const std::vector<int> &pointIndices = *leaves[l] ;
+		SurfelLeafRange range ;
+		range.key[0] = keys[3 * l] ;
+		range.key[1] = keys[3 * l + 1] ;
+		range.key[2] = keys[3 * l + 2] ;
+		range.first = nsurfels ;
+		range.count = 0 ;
+		for (size_t i = 0; i < pointIndices.size() ; i++)
+			if (!std::isnan(store.positions->points[pointIndices[i]].x))
+				range.count++ ;
+		if (range.count == 0)
+			continue ;
+		nsurfels += range.count ;
+		ranges.push_back(range) ;
+	}
+
+	double layout[6] ;
+	index.getLayout(layout) ;
+	return writeMapFile(file_name, store, leaves, ranges, nsurfels, index_type, resolution, layout, nsaved) ;
+}
+
+bool SurfelMapFile::save(const std::string &file_name, const SurfelMapSnapshot &snapshot, size_t &nsaved)
+{
+	//Slots of the snapshot are already ordered by leaves, so its leaf ranges are also ranges of surfels in the file
+	std::vector<const std::vector<int>*> leaves(1, &snapshot.leaf_slots) ;
+	return writeMapFile(file_name, snapshot.surfels, leaves, snapshot.leaves, snapshot.leaf_slots.size(), snapshot.index_type, 
+			    snapshot.resolution, snapshot.layout, nsaved) ;
+}
+
+bool SurfelMapFile::open(const std::string &file_name)
+{
+	close() ;
+	fd = ::open(file_name.c_str(), O_RDONLY) ;
+	if (fd < 0)
+		return false ;
+	struct stat st ;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SurfelMapFileHeader)) {
+		close() ;
+		return false ;
+	}
+	size = st.st_size ;
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) ;
+	if (mapping == MAP_FAILED) {
+		data = NULL ;
+		close() ;
+		return false ;
+	}
+	data = static_cast<const uint8_t*>(mapping) ;
+
+	//Validate the header and bounds of all sections
+	const SurfelMapFileHeader &header = getHeader() ;
+	bool valid = memcmp(header.magic, SURFEL_MAP_MAGIC, sizeof(header.magic)) == 0 && header.version == SURFEL_MAP_FILE_VERSION &&
+		header.surfel_count <= uint64_t(INT_MAX) ;
+	for (int s = 0; s < MAP_SECTION_NUM && valid ; s++) {
+		uint64_t nelements = s == MAP_SECTION_LEAVES ? header.leaf_count : header.surfel_count ;
+		valid = header.offsets[s] % MAP_SECTION_ALIGNMENT == 0 && header.offsets[s] <= size && 
+			nelements <= (size - header.offsets[s]) / section_element_size[s] ;
+	}
+	const SurfelLeafRange *ranges = static_cast<const SurfelLeafRange*>(getSection(MAP_SECTION_LEAVES)) ;
+	for (uint64_t l = 0; l < header.leaf_count && valid ; l++)
+		valid = uint64_t(ranges[l].first) + ranges[l].count <= header.surfel_count ;
+	if (!valid) {
+		close() ;
+		return false ;
+	}
+
+	//Sections are read sequentially
+	madvise(mapping, size, MADV_SEQUENTIAL) ;
+	return true ;
+}
+
+void SurfelMapFile::close()
+{
+	if (data)
+		munmap(const_cast<uint8_t*>(data), size) ;
+	if (fd >= 0)
+		::close(fd) ;
+	data = NULL ;
+	size = 0 ;
+	fd = -1 ;
+}
+
+const SurfelMapFileHeader &SurfelMapFile::getHeader() const
+{
+	return *reinterpret_cast<const SurfelMapFileHeader*>(data) ;
+}
+
+const void *SurfelMapFile::getSection(SurfelMapSection section) const
+{
+	return data + getHeader().offsets[section] ;
+}
+
+void SurfelMapFile::loadStore(SurfelStore &store) const
+{
+	size_t n = getHeader().surfel_count ;
+	store.resize(n) ;
+	if (n == 0)
+		return ;
+	memcpy(&store.positions->points[0], getSection(MAP_SECTION_POSITIONS), n * sizeof(pcl::PointXYZ)) ;
+	memcpy(&store.normal_x[0], getSection(MAP_SECTION_NORMAL_X), n * sizeof(float)) ;
+	memcpy(&store.normal_y[0], getSection(MAP_SECTION_NORMAL_Y), n * sizeof(float)) ;
+	memcpy(&store.normal_z[0], getSection(MAP_SECTION_NORMAL_Z), n * sizeof(float)) ;
+	memcpy(&store.rgba[0], getSection(MAP_SECTION_RGBA), n * sizeof(uint32_t)) ;
+	memcpy(&store.radius[0], getSection(MAP_SECTION_RADIUS), n * sizeof(float)) ;
+	memcpy(&store.confidence[0], getSection(MAP_SECTION_CONFIDENCE), n * sizeof(uint32_t)) ;
+	memcpy(&store.count[0], getSection(MAP_SECTION_COUNT), n * sizeof(uint32_t)) ;
+}
@@ -0,0 +1,63 @@
+/**
+ *  @file surfel_map_snapshot.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "surfel_map_snapshot.hpp"
+#include "surfel_map_writer.hpp"
+#include "surfel_map_file.hpp"
+#include <cmath>
+
+SurfelMapSnapshot::SurfelMapSnapshot(const SurfelStore &store, SurfelIndex &index, int index_type, double resolution): 
+	surfels(store), index_type(index_type), resolution(resolution), epoch(store.current_epoch)
+{
+	//Attribute arrays are copied by the store copy, positions are shared by the pointer and have to be copied explicitly
+	surfels.positions.reset(new pcl::PointCloud<pcl::PointXYZ>(*store.positions)) ;
+
+	std::vector<std::vector<int>*> index_leaves ;
+	std::vector<int32_t> keys ;
+	index.collectAllLeaves(index_leaves, keys) ;
+	index.getLayout(layout) ;
+
+	leaf_slots.reserve(store.getLiveCount()) ;
+	leaves.reserve(index_leaves.size()) ;
+	for (size_t l = 0; l < index_leaves.size() ; l++) {
+		const std::vector<int> &pointIndices = *index_leaves[l] ;
+		SurfelLeafRange range ;
+		range.key[0] = keys[3 * l] ;
+		range.key[1] = keys[3 * l + 1] ;
+		range.key[2] = keys[3 * l + 2] ;
+		range.first = leaf_slots.size() ;
+		for (size_t i = 0; i < pointIndices.size() ; i++)
+			if (!std::isnan(store.positions->points[pointIndices[i]].x))
+				leaf_slots.push_back(pointIndices[i]) ;
+		range.count = leaf_slots.size() - range.first ;
+		if (range.count > 0)
+			leaves.push_back(range) ;
+	}
+}
+
+size_t SurfelMapSnapshot::getLiveCount() const
+{
+	return leaf_slots.size() ;
+}
+
+bool SurfelMapSnapshot::save(const std::string &file_name, size_t &nsaved) const
+{
+	nsaved = 0 ;
+	MapFileFormat format = SurfelMapWriter::getFormatFromFileName(file_name) ;
+	if (format == MAP_FORMAT_SURFEL_MAP)
+		return SurfelMapFile::save(file_name, *this, nsaved) ;
+
+	SurfelMapWriter writer ;
+	if (!writer.open(file_name, format))
+		return false ;
+	writer.write(surfels, leaf_slots) ;
+	nsaved = writer.getWrittenCount() ;
+	return writer.close() ;
+}
@@ -0,0 +1,127 @@
+/**
+ *  @file surfel_map_writer.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "surfel_map_writer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+SurfelMapWriter::SurfelMapWriter(size_t buffer_size): format(MAP_FORMAT_PCD), buffer(std::max<size_t>(buffer_size, 1)), buffered(0), written(0)
+{}
+
+SurfelMapWriter::~SurfelMapWriter()
+{
+	if (file.is_open())
+		close() ;
+}
+
+MapFileFormat SurfelMapWriter::getFormatFromFileName(const std::string &file_name)
+{
+	size_t dot = file_name.find_last_of('.') ;
+	if (dot == std::string::npos)
+		return MAP_FORMAT_PCD ;
+	std::string extension = file_name.substr(dot + 1) ;
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower) ;
+	if (extension == "ply")
+		return MAP_FORMAT_PLY ;
+	if (extension == "smap")
+		return MAP_FORMAT_SURFEL_MAP ;
+	return MAP_FORMAT_PCD ;
+}
+
+void SurfelMapWriter::writeHeader(size_t npoints)
+{
+	//The count is padded, so that the rewritten header has the same length
+	char count[32] ;
+	snprintf(count, sizeof(count), "%-20lu", (unsigned long) npoints) ;
+
+	if (format == MAP_FORMAT_PLY) {
+		//Color bytes follow the memory layout of the packed rgba field (b - lowest byte)
+		file << "ply\n"
+			"format binary_little_endian 1.0\n"
+			"element vertex " << count << "\n"
+			"property float x\n"
+			"property float y\n"
+			"property float z\n"
+			"property float nx\n"
+			"property float ny\n"
+			"property float nz\n"
+			"property uchar blue\n"
+			"property uchar green\n"
+			"property uchar red\n"
+			"property uchar alpha\n"
+			"property float radius\n"
+			"property uint confidence\n"
+			"property uint count\n"
+			"end_header\n" ;
+	} else {
+		file << "# .PCD v0.7 - Point Cloud Data file format\n"
+			"VERSION 0.7\n"
+			"FIELDS x y z normal_x normal_y normal_z rgba radius confidence count\n"
+			"SIZE 4 4 4 4 4 4 4 4 4 4\n"
+			"TYPE F F F F F F U F U U\n"
+			"COUNT 1 1 1 1 1 1 1 1 1 1\n"
+			"WIDTH " << count << "\n"
+			"HEIGHT 1\n"
+			"VIEWPOINT 0 0 0 1 0 0 0\n"
+			"POINTS " << count << "\n"
+			"DATA binary\n" ;
+	}
+}
+
+bool SurfelMapWriter::open(const std::string &file_name, MapFileFormat format)
+{
+	this->format = format ;
+	buffered = 0 ;
+	written = 0 ;
+	file.open(file_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc) ;
+	if (!file.is_open())
+		return false ;
+	writeHeader(0) ;
+	return file.good() ;
+}
+
+void SurfelMapWriter::flush()
+{
+	if (buffered == 0)
+		return ;
+	file.write(reinterpret_cast<const char*>(&buffer[0]), buffered * sizeof(PackedSurfel)) ;
+	buffered = 0 ;
+}
+
+void SurfelMapWriter::write(const SurfelStore &store, const std::vector<int> &slots)
+{
+	//Slots are packed in chunks fitting into the free part of the buffer
+	size_t pos = 0 ;
+	while (pos < slots.size()) {
+		size_t nslots = std::min(slots.size() - pos, buffer.size() - buffered) ;
+		size_t npacked = store.pack(&slots[pos], nslots, &buffer[buffered]) ;
+		buffered += npacked ;
+		written += npacked ;
+		pos += nslots ;
+		if (buffered == buffer.size())
+			flush() ;
+	}
+}
+
+bool SurfelMapWriter::close()
+{
+	flush() ;
+	file.seekp(0) ;
+	writeHeader(written) ;
+	bool ok = file.good() ;
+	file.close() ;
+	return ok ;
+}
+
+size_t SurfelMapWriter::getWrittenCount() const
+{
+	return written ;
+}
@@ -11,10 +11,16 @@
 #include "surfel_mapper.hpp"
 #include <pcl/common/transforms.h>
 #include <pcl/visualization/common/common.h>
+#include "surfel_octree.hpp"
+#include "surfel_voxel_hash.hpp"
+#include "surfel_map_writer.hpp"
+#include "surfel_map_file.hpp"
 #include <pcl/octree/octree_impl.h>
 #include <pcl/common/io.h>
 #include <pcl/features/integral_image_normal.h>
 #include "logger.hpp"
+#include <cstring>
+#include <sstream>
 
 //#define DMAX 0.005f
 //#define MIN_KINECT_DIST 0.8 
@@ -28,12 +34,30 @@
 
 extern Logger logger ; /**< Logger object */
 
-inline void SurfelMapper::transformPointAffine(PointCustomSurfel &point_in, PointCustomSurfel &point_out, Eigen::Matrix4d transform)
+void SurfelMapper::computeProjectionParams(const Eigen::Matrix4d &viewMatrix, ProjectionParams &projection)
 {
-	point_out = point_in ;
-	point_out.x = static_cast<float> (transform (0, 0) * point_in.x + transform (0, 1) * point_in.y + transform (0, 2) * point_in.z + transform (0, 3));
-	point_out.y = static_cast<float> (transform (1, 0) * point_in.x + transform (1, 1) * point_in.y + transform (1, 2) * point_in.z + transform (1, 3));
-	point_out.z = static_cast<float> (transform (2, 0) * point_in.x + transform (2, 1) * point_in.y + transform (2, 2) * point_in.z + transform (2, 3));
+	for (int r = 0; r < 3 ; r++)
+		for (int c = 0; c < 4 ; c++)
+			projection.m[r * 4 + c] = static_cast<float>(viewMatrix(r, c)) ;
+	projection.alpha = frame_camera_params.alpha ;
+	projection.beta = frame_camera_params.beta ;
+	projection.cx = frame_camera_params.cx ;
+	projection.cy = frame_camera_params.cy ;
+}
+
+void SurfelMapper::projectLeafSurfels(const std::vector<int> &pointIndices, const ProjectionParams &projection, ProjectionBuffer &buffer)
+{
+	size_t n = pointIndices.size() ;
+	if (buffer.u.size() < n) {
+		buffer.u.resize(n) ;
+		buffer.v.resize(n) ;
+		buffer.z.resize(n) ;
+	}
+	if (n > 0) {
+		const size_t stride = sizeof(pcl::PointXYZ) / sizeof(float) ;
+		const pcl::PointXYZ &first = surfels.positions->points[0] ;
+		transformProjectBatch(&first.x, &first.y, &first.z, stride, &pointIndices[0], n, projection, &buffer.u[0], &buffer.v[0], &buffer.z[0]) ;
+	}
 }
 
 template <typename PointT, typename Scalar> void SurfelMapper::transformPointCloudNonRigid (const pcl::PointCloud<PointT> &cloud_in, 
@@ -108,7 +132,7 @@ void SurfelMapper::getPointAtPosition(pcl::PointCloud<pcl::PointXYZRGBNormal>::P
 	}
 }
 
-void SurfelMapper::markScanAsCovered(char scan_covered[CLOUD_HEIGHT][CLOUD_WIDTH], float u, float v) 
+void SurfelMapper::markScanAsCovered(char *scan_covered, uint32_t width, float u, float v) 
 {
 	//Here we assume that the covering surfel is approximately the size of single scan pixel 
 	//TODO: In some cases surfel ahead of the scan and scan was invalidated, the surfel may be larger and cover multiple can pixels - it might be worthwhile to take it into account 
@@ -118,128 +142,753 @@ void SurfelMapper::markScanAsCovered(char scan_covered[CLOUD_HEIGHT][CLOUD_WIDTH
 	uint32_t j = static_cast<int>(u + 0.5) ;
 
 	//Since the function is called, the range of i, j should be correct...
-	scan_covered[i][j] = 1 ;
-}
-
-void SurfelMapper::skipChildVoxelsCorrect(pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator &it, const pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator &it_end)
-{
-	unsigned int current_depth = it.getCurrentOctreeDepth() ;
-	it++ ;	
-	if (it != it_end && it.getCurrentOctreeDepth() > current_depth)
-		it.skipChildVoxels() ; //Actually we skip siblings of the child here
-}
-
-void SurfelMapper::computeVoxelColor(pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator &it, const pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator &it_end, pcl::PointXYZRGB &point)
-{
-	//Select a few pixels from the current voxel and compute an average	
-	unsigned int current_depth = it.getCurrentOctreeDepth() ;
-	unsigned long rs, gs, bs ;
-	rs = gs = bs = 0 ;
-	unsigned long count  = 0;
-	bool first_it = true ; //We must take into account also the starting node - it might be a leaf!
-	while(it != it_end && (it.getCurrentOctreeDepth() > current_depth || first_it)) {
-		first_it = false ;
-		if (it.isLeafNode()) {
-			//Examine points in the voxel	
-			pcl::octree::OctreeContainerPointIndices& container = it.getLeafContainer();
-			std::vector<int> pointIndices ; 
-			container.getPointIndices (pointIndices);
-			unsigned int step = pointIndices.size() / PREVIEW_COLOR_SAMPLES_IN_VOXEL;
-			if (step < 1) step = 1 ;
-			//Now select every "step" - point
-			for (unsigned int i = 0; i < pointIndices.size() ; i += step) {
-				PointCustomSurfel p = cloudScene->points[pointIndices[i]] ;
-				rs += p.r ;
-				gs += p.g ;
-				bs += p.b ;
-				count++ ;
+	scan_covered[i * width + j] = 1 ;
+}
+
+void SurfelMapper::addCounters(UpdateCounters &counters, const UpdateCounters &counters_add)
+{
+	counters.nsurfels_updated += counters_add.nsurfels_updated ;
+	counters.surfels_inside_octree_frustum += counters_add.surfels_inside_octree_frustum ;
+	counters.surfels_projected_on_sensor += counters_add.surfels_projected_on_sensor ;
+	counters.nscan_too_close += counters_add.nscan_too_close ;
+	counters.nscan_too_far += counters_add.nscan_too_far ;
+	counters.nsurfels_invalid_reading += counters_add.nsurfels_invalid_reading ;
+	counters.nsurfels_removed += counters_add.nsurfels_removed ;
+}
+
+void SurfelMapper::fuseSurfel(size_t idx, const pcl::PointXYZRGBNormal &pointInterpolated, const pcl::PointXYZRGBNormal &pointInterpolatedTrans, double zTor)
+{
+	uint32_t count = surfels.count[idx] ;
+
+	//Computing running average
+	pcl::PointXYZ &position = surfels.positions->points[idx] ;
+	position.x = (position.x * count + pointInterpolated.x) / (count + 1) ;
+	position.y = (position.y * count + pointInterpolated.y) / (count + 1) ;
+	position.z = (position.z * count + pointInterpolated.z) / (count + 1) ;
+
+	surfels.normal_x[idx] = (surfels.normal_x[idx] * count + pointInterpolated.normal_x) / (count + 1) ;
+	surfels.normal_y[idx] = (surfels.normal_y[idx] * count + pointInterpolated.normal_y) / (count + 1) ;
+	surfels.normal_z[idx] = (surfels.normal_z[idx] * count + pointInterpolated.normal_z) / (count + 1) ;
+
+	//Colors are packed as in PointCustomSurfel (b - lowest byte, a - highest byte)
+	uint32_t rgba = surfels.rgba[idx] ;
+	uint32_t r = ((((rgba >> 16) & 0xff) * count + pointInterpolated.r) / (count + 1)) & 0xff ;
+	uint32_t g = ((((rgba >> 8) & 0xff) * count + pointInterpolated.g) / (count + 1)) & 0xff ;
+	uint32_t b = (((rgba & 0xff) * count + pointInterpolated.b) / (count + 1)) & 0xff ;
+	surfels.rgba[idx] = (rgba & 0xff000000) | (r << 16) | (g << 8) | b ;
+
+	surfels.count[idx]++ ;
+	surfels.confidence[idx]++ ;
+
+	float scanR = -pointInterpolatedTrans.z / pointInterpolatedTrans.normal_z * zTor  ;
+	surfels.radius[idx] = std::min<float>(surfels.radius[idx], scanR) ; //Update radius only when the new one is smaller
+	surfels.touch(idx) ;
+
+	//We do not update colors now (in original solution (Weise) - they take color from the most perpendicular view)
+	//TODO: possibly handle color update...
+}
+
+/**
+ * Simple predicate testing negativeness of the number
+ *
+ * @param i input number
+ * @return true if the number is negative, false otherwise
+ */
+bool IsNegative (int i) { return i < 0 ; }
+
+void SurfelMapper::createSpatialIndex()
+{
+	if (SPATIAL_INDEX == SPATIAL_INDEX_VOXEL_HASH)
+		spatial_index.reset(new SurfelVoxelHash(this->OCTREE_RESOLUTION)) ;
+	else
+		spatial_index.reset(new SurfelOctree(this->OCTREE_RESOLUTION)) ;
+	spatial_index->setSurfelPositions(surfels.positions) ;
+
+	preview.reset(new SurfelPreview(this->PREVIEW_RESOLUTION)) ;
+	preview->setSurfelPositions(surfels.positions) ;
+}
+
+void SurfelMapper::recordPreviewChange(size_t idx, std::vector<int> &dirty_voxels) const
+{
+	//Surfels of a leaf are usually in the same preview voxel, so repeated voxels are skipped
+	int voxel = preview->getVoxelIndex(surfels.positions->points[idx]) ;
+	if (voxel >= 0 && (dirty_voxels.empty() || dirty_voxels.back() != voxel))
+		dirty_voxels.push_back(voxel) ;
+}
+
+void SurfelMapper::recordPreviewUpdate(size_t idx, int voxel, std::vector<int> &dirty_voxels, std::vector<int> &moved_surfels) const
+{
+	if (voxel >= 0 && (dirty_voxels.empty() || dirty_voxels.back() != voxel))
+		dirty_voxels.push_back(voxel) ;
+	//Fusion may move the surfel to a neighbouring voxel, it is inserted there after the update
+	if (!preview->isInVoxel(voxel, surfels.positions->points[idx]))
+		moved_surfels.push_back(idx) ;
+}
+
+void SurfelMapper::computeFrustumBounds(const Eigen::Matrix4d &viewMatrix, Eigen::Vector3f &frustum_min, Eigen::Vector3f &frustum_max)
+{
+	//Corners of the frustum (image corners at the near and far plane) transformed to the world frame
+	Eigen::Matrix4d cameraToWorld = viewMatrix.inverse() ;
+	double depths[2] = {MIN_KINECT_DIST - DMAX, MAX_KINECT_DIST + DMAX} ;
+	double us[2] = {0.0, double(frame_width)} ;
+	double vs[2] = {0.0, double(frame_height)} ;
+	frustum_min.setConstant(std::numeric_limits<float>::max()) ;
+	frustum_max.setConstant(-std::numeric_limits<float>::max()) ;
+	for (int d = 0; d < 2 ; d++)
+		for (int i = 0; i < 2 ; i++)
+			for (int j = 0; j < 2 ; j++) {
+				Eigen::Vector4d corner((us[i] - frame_camera_params.cx) * depths[d] / frame_camera_params.alpha, 
+						       (vs[j] - frame_camera_params.cy) * depths[d] / frame_camera_params.beta, depths[d], 1.0) ;
+				Eigen::Vector3f corner_world = (cameraToWorld * corner).topRows<3>().cast<float>() ;
+				frustum_min = frustum_min.cwiseMin(corner_world) ;
+				frustum_max = frustum_max.cwiseMax(corner_world) ;
 			}
+}
+
+void SurfelMapper::collectFrustumLeaves(double frustum[24], const Eigen::Matrix4d &viewMatrix, std::vector<std::vector<int>*> &leaves, unsigned int &nodes_visited)
+{
+	if (!USE_FRUSTUM) {
+		//If we don't want frustum culling - accept everything
+		spatial_index->collectAllLeaves(leaves) ;
+		return ;
+	}
+	Eigen::Vector3f frustum_min, frustum_max ;
+	computeFrustumBounds(viewMatrix, frustum_min, frustum_max) ;
+	spatial_index->collectFrustumLeaves(frustum, frustum_min, frustum_max, leaves, nodes_visited) ;
+}
+
+void SurfelMapper::updateLeafSurfels(std::vector<int> &pointIndices, const ProjectionParams &projection, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloudNormals, 
+		pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloudNormalsTrans, char *scan_covered, ProjectionBuffer &buffer, 
+		std::vector<int> &removed_slots, std::vector<int> &updated_slots, std::vector<int> &dirty_voxels, std::vector<int> &moved_surfels, UpdateCounters &counters)
+{
+	double zTor = 1.0/(sqrt(2.0) * (frame_camera_params.alpha + frame_camera_params.beta) / 2.0) ;
+
+	//Transform and project all surfels of the leaf in one batch
+	projectLeafSurfels(pointIndices, projection, buffer) ;
+
+	bool removed = false ;
+	for (size_t i = 0; i < pointIndices.size() ; i++)  {
+		counters.surfels_inside_octree_frustum++ ;
+		float zsurfel = buffer.z[i] ;
+		if (zsurfel <= MAX_KINECT_DIST + DMAX && zsurfel >= MIN_KINECT_DIST - DMAX) { //In frustum cullling we remove surfels too close or too far, should we be consistent in that? 
+			float u = buffer.u[i] ;
+			float v = buffer.v[i] ;
+
+			float zscan = getZAtPosition(cloudNormalsTrans, u, v) ;
+			if (std::isnan(zscan) || zscan >= 0.0f) //in both cases we hit image plane
+				counters.surfels_projected_on_sensor++ ;
+			if (!std::isnan(zscan) && zscan >= 0.0f) {
+				if (fabs(zscan - zsurfel) <= DMAX) { 
+					//We have a surfel-scan match, we may update the surfel here... 
+					pcl::PointXYZRGBNormal pointInterpolated, pointInterpolatedTrans ; 
+					getPointAtPosition(cloudNormals, cloudNormalsTrans, u, v, pointInterpolated, pointInterpolatedTrans) ;
+					int voxel = preview->getVoxelIndex(surfels.positions->points[pointIndices[i]]) ;
+					fuseSurfel(pointIndices[i], pointInterpolated, pointInterpolatedTrans, zTor) ;
+					recordPreviewUpdate(pointIndices[i], voxel, dirty_voxels, moved_surfels) ;
+					updated_slots.push_back(pointIndices[i]) ;
+
+					markScanAsCovered(scan_covered, frame_width, u, v) ; 
+					counters.nsurfels_updated++ ;
+				} else if (zscan - zsurfel > DMAX) {
+					//The observed point is behing the surfel, we may either remove the observation or the surfel (depending e.g. on the confidence)
+					if (surfels.confidence[pointIndices[i]] < CONFIDENCE_THRESHOLD1) {
+						recordPreviewChange(pointIndices[i], dirty_voxels) ;
+						//NaN surfel in the store (we do not remove it in order to maintain the structure of indices
+						surfels.invalidate(pointIndices[i]) ;
+						removed_slots.push_back(pointIndices[i]) ;
+						//remove surfel from Octree
+						pointIndices[i] = -1 ; //Mark as invalid (designed for future removal)
+						removed = true ;
+						counters.nsurfels_removed++ ;
+					} else {
+						markScanAsCovered(scan_covered, frame_width, u, v) ;
+					}
+					counters.nscan_too_far++ ;
+				} else
+					counters.nscan_too_close++ ;
+			} else counters.nsurfels_invalid_reading++ ;
 		}
-		it++ ;
 	}
-	if (count > 0) {
-		point.r = rs / count ;
-		point.g = gs / count ;
-		point.b = bs / count ;
+	//The actual removal of marked (negative) indices
+	if (removed) {
+		std::vector<int>::iterator end_valid = remove_if(pointIndices.begin(), pointIndices.end(), IsNegative);
+		pointIndices.erase(end_valid, pointIndices.end());
 	}
 }
 
-void SurfelMapper::filterCloudByDistance(pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud)
+void SurfelMapper::updateSurfelsParallel(std::vector<std::vector<int>*> &leaves, const ProjectionParams &projection, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloudNormals, 
+		pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloudNormalsTrans, char *scan_covered, UpdateCounters &counters)
 {
-	//int pointsUpdated = 0 ;
-	//Manually NaNing points outside effective Kinect scope and those with too large angle of view
-	//TODO: There are some points (about 0.1%) that have positive normals after cloud transformation - investigate why?
-	for (uint32_t i = 0; i < cloud->height ; i++) //For cloud scene it will be 1 (unorganized cloud) 
-		for (uint32_t j = 0; j < cloud->width ; j++) {
-			float zscan = (*cloud)(j, i).z ;	
-			float znormalscan = (*cloud)(j, i).normal_z ;
-			if (!std::isnan(zscan) && !std::isnan(znormalscan) && (zscan > MAX_KINECT_DIST || zscan < MIN_KINECT_DIST || znormalscan > -MIN_SCAN_ZNORMAL)) {
-				pcl::PointXYZRGBNormal &point = (*cloud)(j, i) ;	
-				point.x = point.y = point.z = std::numeric_limits<float>::quiet_NaN () ;
+	unsigned int nthreads = thread_pool->getThreadCount() ;
+	const size_t array_size = frame_height * frame_width ;
+	std::vector<UpdateCounters> thread_counters(nthreads, UpdateCounters()) ;
+	std::vector<std::vector<int> > thread_removed_slots(nthreads) ;
+	std::vector<std::vector<int> > thread_updated_slots(nthreads) ;
+	std::vector<std::vector<int> > thread_dirty_voxels(nthreads) ;
+	std::vector<std::vector<int> > thread_moved_surfels(nthreads) ;
+
+	//Each surfel belongs to exactly one leaf, so leaves may be updated independently
+	thread_pool->parallelFor(leaves.size(), [&](unsigned int thread_id, size_t l) {
+		char *thread_covered = &thread_scan_covered[thread_id * array_size] ;
+		UpdateCounters leaf_counters = UpdateCounters() ; //Local counters - avoid false sharing between threads
+		updateLeafSurfels(*leaves[l], projection, cloudNormals, cloudNormalsTrans, thread_covered, thread_projection_buffers[thread_id], 
+				thread_removed_slots[thread_id], thread_updated_slots[thread_id], thread_dirty_voxels[thread_id], thread_moved_surfels[thread_id], leaf_counters) ;
+		addCounters(thread_counters[thread_id], leaf_counters) ;
+	}) ;
+
+	//Merge per-thread scan-arrays in row bands, merged rows are cleared for the next frame
+	thread_pool->parallelFor(frame_height, [&](unsigned int, size_t i) {
+		char *row_covered = scan_covered + i * frame_width ;
+		for (unsigned int t = 0; t < nthreads ; t++) {
+			char *thread_row_covered = &thread_scan_covered[t * array_size + i * frame_width] ;
+			for (uint32_t j = 0; j < frame_width ; j++)
+				row_covered[j] |= thread_row_covered[j] ;
+			memset(thread_row_covered, 0, frame_width) ;
+		}
+	}) ;
+
+	//Merge remaining per-thread results
+	for (unsigned int t = 0; t < nthreads ; t++) {
+		addCounters(counters, thread_counters[t]) ;
+		surfels.releaseSlots(thread_removed_slots[t]) ;
+		surfels.logChanges(thread_updated_slots[t]) ;
+		preview->markVoxelsDirty(thread_dirty_voxels[t]) ;
+		preview->addPointsFromIndicesBulk(thread_moved_surfels[t]) ;
+	}
+}
+
+void SurfelMapper::updateSurfelsByIndexMap(std::vector<std::vector<int>*> &leaves, const ProjectionParams &projection, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloudNormals, 
+		pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloudNormalsTrans, char *scan_covered, UpdateCounters &counters)
+{
+	double zTor = 1.0/(sqrt(2.0) * (frame_camera_params.alpha + frame_camera_params.beta) / 2.0) ;
+
+	uint32_t height = frame_height ;
+	uint32_t width = frame_width ;
+
+	//Clean-up the index map
+	for (size_t k = 0; k < index_map.size() ; k++)
+		index_map[k].count = 0 ;
+
+	//Splat surfels into the index map keeping a few closest ones (sorted by depth) for every pixel
+	ProjectionBuffer &buffer = thread_projection_buffers[0] ;
+	for (size_t l = 0; l < leaves.size() ; l++) {
+		std::vector<int> &pointIndices = *leaves[l] ;
+		projectLeafSurfels(pointIndices, projection, buffer) ;
+		for (size_t k = 0; k < pointIndices.size() ; k++) {
+			counters.surfels_inside_octree_frustum++ ;
+			float zsurfel = buffer.z[k] ;
+			if (zsurfel <= MAX_KINECT_DIST + DMAX && zsurfel >= MIN_KINECT_DIST - DMAX) {
+				float u = buffer.u[k] ;
+				float v = buffer.v[k] ;
+				if (u <= -0.5 || v <= -0.5 || u >= width - 0.5 || v >= height - 0.5) {
+					//Counted as in the traversal update (no reading outside the frame)
+					counters.nsurfels_invalid_reading++ ;
+					continue ;
+				}
+				counters.surfels_projected_on_sensor++ ;
+
+				//Nearest-neighbor pixel, consistent with getZAtPosition
+				uint32_t i = static_cast<int>(v + 0.5) ;
+				uint32_t j = static_cast<int>(u + 0.5) ;
+				IndexMapPixel &pixel = index_map[i * width + j] ;
+				if (pixel.count == INDEX_MAP_CANDIDATES && zsurfel >= pixel.candidates[INDEX_MAP_CANDIDATES - 1].z)
+					continue ;
+				//Insertion into the sorted list, the farthest candidate is dropped from a full list
+				int c = std::min(pixel.count, INDEX_MAP_CANDIDATES - 1) ;
+				for (; c > 0 && pixel.candidates[c - 1].z > zsurfel ; c--)
+					pixel.candidates[c] = pixel.candidates[c - 1] ;
+				IndexMapCandidate &candidate = pixel.candidates[c] ;
+				candidate.z = zsurfel ;
+				candidate.surfel_index = pointIndices[k] ;
+				candidate.leaf_position = k ;
+				candidate.leaf_indices = &pointIndices ;
+				if (pixel.count < INDEX_MAP_CANDIDATES)
+					pixel.count++ ;
+			}
+		}
+	}
+
+	//Associate pixels with the rendered surfels. Every surfel is rendered into at most one pixel, so rows may be processed independently
+	unsigned int nthreads = thread_pool->getThreadCount() ;
+	std::vector<UpdateCounters> thread_counters(nthreads, UpdateCounters()) ;
+	std::vector<std::vector<std::vector<int>*> > thread_modified_leaves(nthreads) ;
+	std::vector<std::vector<int> > thread_removed_slots(nthreads) ;
+	std::vector<std::vector<int> > thread_updated_slots(nthreads) ;
+	std::vector<std::vector<int> > thread_dirty_voxels(nthreads) ;
+	std::vector<std::vector<int> > thread_moved_surfels(nthreads) ;
+	thread_pool->parallelFor(height, [&](unsigned int thread_id, size_t i) {
+		UpdateCounters row_counters = UpdateCounters() ;
+		for (uint32_t j = 0; j < width ; j++) {
+			IndexMapPixel &pixel = index_map[i * width + j] ;
+			if (pixel.count == 0)
+				continue ;
+			const pcl::PointXYZRGBNormal &pointInterpolatedTrans = (*cloudNormalsTrans)(j, i) ;
+			float zscan = pointInterpolatedTrans.z ;
+			if (std::isnan(zscan)) {
+				row_counters.nsurfels_invalid_reading += pixel.count ;
+				continue ;
+			}
+			//Candidates are handled front to back, so a removed surfel does not hide a matching one behind it
+			for (int c = 0; c < pixel.count ; c++) {
+				IndexMapCandidate &candidate = pixel.candidates[c] ;
+				if (fabs(zscan - candidate.z) <= DMAX) {
+					//We have a surfel-scan match
+					int voxel = preview->getVoxelIndex(surfels.positions->points[candidate.surfel_index]) ;
+					fuseSurfel(candidate.surfel_index, (*cloudNormals)(j, i), pointInterpolatedTrans, zTor) ;
+					recordPreviewUpdate(candidate.surfel_index, voxel, thread_dirty_voxels[thread_id], thread_moved_surfels[thread_id]) ;
+					thread_updated_slots[thread_id].push_back(candidate.surfel_index) ;
+					scan_covered[i * width + j] = 1 ;
+					row_counters.nsurfels_updated++ ;
+				} else if (zscan - candidate.z > DMAX) {
+					//The observed point is behind the surfel
+					if (surfels.confidence[candidate.surfel_index] < CONFIDENCE_THRESHOLD1) {
+						recordPreviewChange(candidate.surfel_index, thread_dirty_voxels[thread_id]) ;
+						surfels.invalidate(candidate.surfel_index) ;
+						thread_removed_slots[thread_id].push_back(candidate.surfel_index) ;
+						(*candidate.leaf_indices)[candidate.leaf_position] = -1 ; //Mark as invalid (designed for future removal)
+						thread_modified_leaves[thread_id].push_back(candidate.leaf_indices) ;
+						row_counters.nsurfels_removed++ ;
+					} else {
+						scan_covered[i * width + j] = 1 ;
+					}
+					row_counters.nscan_too_far++ ;
+				} else {
+					//The scan is in front of the surfel, the remaining candidates are even farther
+					row_counters.nscan_too_close += pixel.count - c ;
+					break ;
+				}
 			}
 		}
+		addCounters(thread_counters[thread_id], row_counters) ;
+	}) ;
+
+	std::vector<std::vector<int>*> modified_leaves ;
+	for (unsigned int t = 0; t < nthreads ; t++) {
+		addCounters(counters, thread_counters[t]) ;
+		modified_leaves.insert(modified_leaves.end(), thread_modified_leaves[t].begin(), thread_modified_leaves[t].end()) ;
+		surfels.releaseSlots(thread_removed_slots[t]) ;
+		surfels.logChanges(thread_updated_slots[t]) ;
+		preview->markVoxelsDirty(thread_dirty_voxels[t]) ;
+		preview->addPointsFromIndicesBulk(thread_moved_surfels[t]) ;
+	}
+
+	//The actual removal of marked (negative) indices
+	for (size_t l = 0; l < modified_leaves.size() ; l++) {
+		std::vector<int> &pointIndices = *modified_leaves[l] ;
+		std::vector<int>::iterator end_valid = remove_if(pointIndices.begin(), pointIndices.end(), IsNegative);
+		pointIndices.erase(end_valid, pointIndices.end());
+	}
 }
 
-void SurfelMapper::downsampleSceneCloud()
+void SurfelMapper::getFrameCameraParams(uint32_t width, uint32_t height, CameraParams &params) const
+{
+	//Rescale camera parameters if they refer to a different resolution (e.g. the frame is decimated)
+	params = camera_params ;
+	if (camera_params.width > 0 && camera_params.height > 0) {
+		double sx = double(width) / camera_params.width ;
+		double sy = double(height) / camera_params.height ;
+		params.alpha = camera_params.alpha * sx ;
+		params.beta = camera_params.beta * sy ;
+		params.cx = (camera_params.cx + 0.5) * sx - 0.5 ;
+		params.cy = (camera_params.cy + 0.5) * sy - 0.5 ;
+	}
+	params.width = width ;
+	params.height = height ;
+}
+
+void SurfelMapper::prepareFrameBuffers(uint32_t width, uint32_t height)
 {
-	//Establish maximum tree depth for display
-	unsigned int tree_depth = octree.getTreeDepth() ;
-	unsigned int display_depth = tree_depth ;
-	for (unsigned int depth = 1; depth <= tree_depth ; depth++) {
-		double voxel_side = sqrt(octree.getVoxelSquaredSideLen(depth)) ;
-		if (voxel_side <= PREVIEW_RESOLUTION) {
-			display_depth = depth ;
-			break ;
+	getFrameCameraParams(width, height, frame_camera_params) ;
+
+	if (width == frame_width && height == frame_height)
+		return ;
+
+	frame_width = width ;
+	frame_height = height ;
+	size_t array_size = size_t(width) * height ;
+	scan_covered.assign(array_size, 0) ;
+	if (USE_INDEX_MAP)
+		index_map.resize(array_size) ;
+	if (thread_pool->getThreadCount() > 1)
+		thread_scan_covered.assign(thread_pool->getThreadCount() * array_size, 0) ;
+}
+
+bool SurfelMapper::insertSurfel(const PointCustomSurfel &surfel)
+{
+	int slot ;
+	if (surfels.acquireSlot(slot)) {
+		//Reuse a slot of a removed surfel
+		surfels.setSurfel(slot, surfel) ;
+		inserted_slots.push_back(slot) ;
+		return true ;
+	}
+	inserted_slots.push_back(surfels.append(surfel)) ;
+	return false ;
+}
+
+void SurfelMapper::insertQueuedSurfels()
+{
+	spatial_index->addPointsFromIndicesBulk(inserted_slots) ;
+	preview->addPointsFromIndicesBulk(inserted_slots) ;
+	inserted_slots.clear() ;
+}
+
+void SurfelMapper::estimateNormals(pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloud_normals)
+{
+	if (NORMAL_ESTIMATION == NORMAL_ESTIMATION_CROSS_PRODUCT) {
+		estimateNormalsCrossProduct(*cloud_normals, 2, 0.02f, *thread_pool) ;
+	} else {
+		pcl::IntegralImageNormalEstimation<pcl::PointXYZRGBNormal, pcl::PointXYZRGBNormal> ne;
+		ne.setNormalEstimationMethod (ne.AVERAGE_3D_GRADIENT);
+		ne.setMaxDepthChangeFactor(0.02f);
+		ne.setNormalSmoothingSize(10.0f);
+		ne.setInputCloud(cloud_normals);
+		ne.useSensorOriginAsViewPoint() ;
+		ne.compute(*cloud_normals);
+	}
+}
+
+void SurfelMapper::preprocessFrame(const Eigen::Matrix4d &viewMatrix, PreparedFrame &frame)
+{
+	const float nan = std::numeric_limits<float>::quiet_NaN () ;
+	float m[12] ;
+	for (int r = 0; r < 3 ; r++)
+		for (int c = 0; c < 4 ; c++)
+			m[r * 4 + c] = viewMatrix(r, c) ;
+
+	//The camera frame cloud has the same structure as the world frame one (buffer memory is reused between frames)
+	pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud_normals = *frame.cloud_normals ;
+	pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud_normals_trans = *frame.cloud_normals_trans ;
+	size_t npoints = cloud_normals.points.size() ;
+	cloud_normals_trans.header = cloud_normals.header ;
+	cloud_normals_trans.width = cloud_normals.width ;
+	cloud_normals_trans.height = cloud_normals.height ;
+	cloud_normals_trans.is_dense = false ;
+	cloud_normals_trans.sensor_origin_ = cloud_normals.sensor_origin_ ;
+	cloud_normals_trans.sensor_orientation_ = cloud_normals.sensor_orientation_ ;
+	cloud_normals_trans.points.resize(npoints) ;
+	frame.valid_pixels.clear() ;
+	unsigned int ncorrect_scans = 0 ;
+	unsigned int ncorrect_scans_and_normals = 0 ;
+
+	for (size_t k = 0; k < npoints ; k++) {
+		pcl::PointXYZRGBNormal &point = cloud_normals.points[k] ;
+		pcl::PointXYZRGBNormal &point_trans = cloud_normals_trans.points[k] ;
+		point_trans = point ;
+		if (std::isnan(point.z)) 
+			continue ;
+		ncorrect_scans++ ;
+
+		//Filter-out incorrect normals
+		if (std::isnan(point.normal_x)) {
+			point.x = point.y = point.z = nan ;
+			point_trans.x = point_trans.y = point_trans.z = nan ;
+			continue ;
+		}
+		ncorrect_scans_and_normals++ ;
+
+		//Transform into camera coordinate system
+		point_trans.x = m[0] * point.x + m[1] * point.y + m[2] * point.z + m[3] ;
+		point_trans.y = m[4] * point.x + m[5] * point.y + m[6] * point.z + m[7] ;
+		point_trans.z = m[8] * point.x + m[9] * point.y + m[10] * point.z + m[11] ;
+		point_trans.normal_x = m[0] * point.normal_x + m[1] * point.normal_y + m[2] * point.normal_z ;
+		point_trans.normal_y = m[4] * point.normal_x + m[5] * point.normal_y + m[6] * point.normal_z ;
+		point_trans.normal_z = m[8] * point.normal_x + m[9] * point.normal_y + m[10] * point.normal_z ;
+
+		//Manually NaNing points outside effective Kinect scope and those with too large angle of view
+		//TODO: There are some points (about 0.1%) that have positive normals after cloud transformation - investigate why?
+		if (point_trans.z > MAX_KINECT_DIST || point_trans.z < MIN_KINECT_DIST || point_trans.normal_z > -MIN_SCAN_ZNORMAL) {
+			point_trans.x = point_trans.y = point_trans.z = nan ;
+			continue ;
 		}
+		frame.valid_pixels.push_back(k) ;
 	}
+	frame.ncorrect_scans = ncorrect_scans ;
+	frame.ncorrect_scans_and_normals = ncorrect_scans_and_normals ;
+}
 
-	//Clear point cloud
-	cloudSceneDownsampled->clear() ;
+void SurfelMapper::computeViewMatrix(const Eigen::Vector4f &sensor_origin, const Eigen::Quaternionf &sensor_orientation, Eigen::Matrix4d &viewMatrix)
+{
+	viewMatrix << sensor_orientation.toRotationMatrix().cast<double>(), sensor_origin.topRows<3>().cast<double>(), 0.0, 0.0, 0.0, 1.0 ;
 
-	//Convert voxels at fixed depth to points in a downsampled cloud
-	pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator it = octree.depth_begin() ;
-	const pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator it_end = octree.depth_end();
-	while(it != it_end) {
-		unsigned int current_depth = it.getCurrentOctreeDepth() ;
-		if (current_depth == display_depth) {
-			//Convert a voxel to a single point 
-			Eigen::Vector3f min_bb, max_bb ;
-			octree.getVoxelBounds(it, min_bb, max_bb) ;	
-			
-			pcl::PointXYZRGB point ;
-			point.x = (min_bb[0] + max_bb[0]) / 2 ;
-			point.y = (min_bb[1] + max_bb[1]) / 2 ;
-			point.z = (min_bb[2] + max_bb[2]) / 2 ;
-			point.r = point.g = point.b = 255 ;
-			point.a = 255 ;
+	//std::cout << "Transform matrix used:" << std::endl ;
+	//std::cout <<  viewMatrix ;
+	//std::cout << std::endl ;
+	//std::cout.flush() ;
+	//viewMatrix = viewMatrix.inverse().eval() * cameraRgbToCameraLinkTrans ;
+	viewMatrix = viewMatrix.inverse().eval() ;
+}
+
+boost::shared_ptr<SurfelMapper::PreparedFrame> SurfelMapper::createFrame()
+{
+	boost::shared_ptr<PreparedFrame> frame(new PreparedFrame) ;
+	frame->cloud_normals.reset(new pcl::PointCloud<pcl::PointXYZRGBNormal>) ;
+	frame->cloud_normals_trans.reset(new pcl::PointCloud<pcl::PointXYZRGBNormal>) ;
+	frame->ncorrect_scans = frame->ncorrect_scans_and_normals = 0 ;
+	frame->normal_computation_time = frame->frame_preprocessing_time = 0.0 ;
+	return frame ;
+}
+
+boost::shared_ptr<CloudView> SurfelMapper::createCloudView(const pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud)
+{
+	boost::shared_ptr<CloudView> view(new CloudView) ;
+	const pcl::PointXYZRGB point ;
+	const uint8_t *base = reinterpret_cast<const uint8_t*>(&point) ;
+	view->data = cloud->points.empty() ? NULL : reinterpret_cast<const uint8_t*>(&cloud->points[0]) ;
+	view->width = cloud->width ;
+	view->height = cloud->height ;
+	view->point_step = sizeof(pcl::PointXYZRGB) ;
+	view->row_step = cloud->width * sizeof(pcl::PointXYZRGB) ;
+	view->x_offset = reinterpret_cast<const uint8_t*>(&point.x) - base ;
+	view->y_offset = reinterpret_cast<const uint8_t*>(&point.y) - base ;
+	view->z_offset = reinterpret_cast<const uint8_t*>(&point.z) - base ;
+	view->rgb_offset = reinterpret_cast<const uint8_t*>(&point.rgba) - base ;
+	view->is_dense = cloud->is_dense ;
+	view->sensor_origin = cloud->sensor_origin_ ;
+	view->sensor_orientation = cloud->sensor_orientation_ ;
+	view->owner = cloud ;
+	return view ;
+}
+
+void SurfelMapper::copyCloudView(const CloudView &view, pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud)
+{
+	cloud.width = view.width ;
+	cloud.height = view.height ;
+	cloud.is_dense = view.is_dense ;
+	cloud.sensor_origin_ = view.sensor_origin ;
+	cloud.sensor_orientation_ = view.sensor_orientation ;
+	cloud.points.resize(size_t(view.width) * view.height) ;
+
+	for (uint32_t i = 0; i < view.height ; i++) {
+		const uint8_t *row = view.data + size_t(i) * view.row_step ;
+		pcl::PointXYZRGBNormal *out = &cloud.points[size_t(i) * view.width] ;
+		for (uint32_t j = 0; j < view.width ; j++) {
+			const uint8_t *in = row + size_t(j) * view.point_step ;
+			//Fields of the buffer need not be aligned
+			memcpy(&out[j].x, in + view.x_offset, sizeof(float)) ;
+			memcpy(&out[j].y, in + view.y_offset, sizeof(float)) ;
+			memcpy(&out[j].z, in + view.z_offset, sizeof(float)) ;
+			if (view.rgb_offset >= 0)
+				memcpy(&out[j].rgba, in + view.rgb_offset, sizeof(uint32_t)) ;
+			else
+				out[j].rgba = 0 ;
+		}
+	}
+}
+
+void SurfelMapper::prepareFrame(const CloudView &view, PreparedFrame &frame)
+{
+	//Compute a view matrix
+	Eigen::Matrix4d viewMatrix ;
+	computeViewMatrix(view.sensor_origin, view.sensor_orientation, viewMatrix) ;
+
+	//Read the input frame directly into the frame buffer (reused between frames)
+	copyCloudView(view, *frame.cloud_normals) ;
+	finishFrame(viewMatrix, frame) ;
+}
+
+void SurfelMapper::updateRayTables(uint32_t width, uint32_t height)
+{
+	if (ray_x.size() == width && ray_y.size() == height)
+		return ;
+
+	CameraParams params ;
+	getFrameCameraParams(width, height, params) ;
+	ray_x.resize(width) ;
+	ray_y.resize(height) ;
+	for (uint32_t j = 0; j < width ; j++)
+		ray_x[j] = (j - params.cx) / params.alpha ;
+	for (uint32_t i = 0; i < height ; i++)
+		ray_y[i] = (i - params.cy) / params.beta ;
+}
+
+void SurfelMapper::backProjectDepthImage(const DepthImageView &image, pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud)
+{
+	const float nan = std::numeric_limits<float>::quiet_NaN () ;
+	updateRayTables(image.width, image.height) ;
+
+	//Camera to world transformation
+	Eigen::Matrix3f rotation = image.sensor_orientation.toRotationMatrix() ;
+	Eigen::Vector3f translation = image.sensor_origin.head<3>() ;
+
+	cloud.width = image.width ;
+	cloud.height = image.height ;
+	cloud.is_dense = false ;
+	cloud.sensor_origin_ = image.sensor_origin ;
+	cloud.sensor_orientation_ = image.sensor_orientation ;
+	cloud.points.resize(size_t(image.width) * image.height) ;
+
+	const int ir = image.rgb_bgr ? 2 : 0 ;
+	const int ib = image.rgb_bgr ? 0 : 2 ;
+	for (uint32_t i = 0; i < image.height ; i++) {
+		const uint8_t *depth_row = image.depth + size_t(i) * image.depth_step ;
+		const uint8_t *rgb_row = image.rgb ? image.rgb + size_t(i) * image.rgb_step : NULL ;
+		pcl::PointXYZRGBNormal *out = &cloud.points[size_t(i) * image.width] ;
+		float yp = ray_y[i] ;
+		for (uint32_t j = 0; j < image.width ; j++) {
+			pcl::PointXYZRGBNormal &point = out[j] ;
+			float z ;
+			if (image.depth_float) {
+				memcpy(&z, depth_row + size_t(j) * sizeof(float), sizeof(float)) ;
+			} else {
+				uint16_t d ;
+				memcpy(&d, depth_row + size_t(j) * sizeof(uint16_t), sizeof(uint16_t)) ;
+				z = d > 0 ? d * image.depth_scale : nan ;
+			}
+
+			if (rgb_row) {
+				const uint8_t *c = rgb_row + size_t(j) * image.rgb_channels ;
+				point.rgba = (uint32_t(255) << 24) | (uint32_t(c[ir]) << 16) | (uint32_t(c[1]) << 8) | uint32_t(c[ib]) ;
+			} else
+				point.rgba = 0 ;
+
+			if (!(z > 0.0f) || !pcl_isfinite(z)) {
+				point.x = point.y = point.z = nan ;
+				continue ;
+			}
+			Eigen::Vector3f p = rotation * Eigen::Vector3f(ray_x[j] * z, yp * z, z) + translation ;
+			point.x = p.x() ;
+			point.y = p.y() ;
+			point.z = p.z() ;
+		}
+	}
+}
+
+void SurfelMapper::prepareFrame(const DepthImageView &image, PreparedFrame &frame)
+{
+	Eigen::Matrix4d viewMatrix ;
+	computeViewMatrix(image.sensor_origin, image.sensor_orientation, viewMatrix) ;
+
+	//Back-project the images directly into the frame buffer (reused between frames)
+	backProjectDepthImage(image, *frame.cloud_normals) ;
+	finishFrame(viewMatrix, frame) ;
+}
 
-			computeVoxelColor(it, it_end, point) ; //Computes average color from some selected voxel points and performs skip child voxels procedure at the same time
+void SurfelMapper::finishFrame(const Eigen::Matrix4d &viewMatrix, PreparedFrame &frame)
+{
+	pcl::StopWatch timer ;
 
-			//Add to point cloud
-			cloudSceneDownsampled->push_back(point) ;
+	//Compute normals for the input frame
+	estimateNormals(frame.cloud_normals) ;
+	frame.normal_computation_time = timer.getTimeSeconds() ;
+
+	//Filter-out incorrect normals, transform the frame into camera coordinate system (each keyframe is referenced to the global coord. system by ccny_rgbd)
+	//and filter points outside reliable Kinect scope in a single pass
+	timer.reset() ;
+	preprocessFrame(viewMatrix, frame) ;
+	frame.frame_preprocessing_time = timer.getTimeSeconds() ;
+}
 
-			//Ignore children
-			//it.skipChildVoxels() ;	
-			//skipChildVoxelsCorrect(it, it_end) ;
+void SurfelMapper::preparationLoop()
+{
+	std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+	while (true) {
+		while (!pipeline_stop && (input_queue.empty() || free_frames.empty()))
+			pipeline_cond.wait(lock) ;
+		if (pipeline_stop)
+			return ;
+		InputFrame input = input_queue.front() ;
+		input_queue.pop_front() ;
+		boost::shared_ptr<PreparedFrame> frame = free_frames.back() ;
+		free_frames.pop_back() ;
+		pipeline_cond.notify_all() ; //A place in the input queue is released
+
+		lock.unlock() ;
+		if (input.cloud)
+			prepareFrame(*input.cloud, *frame) ;
+		else
+			prepareFrame(*input.depth_image, *frame) ;
+		input = InputFrame() ; //Input buffers may be released
+		lock.lock() ;
+
+		prepared_queue.push_back(frame) ;
+		pipeline_cond.notify_all() ;
+	}
+}
 
-			//double voxel_side = sqrt(octree.getVoxelSquaredSideLen(current_depth)) ;
-			//std::cout << "side = " << max_bb[0] - min_bb[0] << " " ;
-		} else it++ ;
+void SurfelMapper::integrationLoop()
+{
+	std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+	while (true) {
+		while (!pipeline_stop && prepared_queue.empty())
+			pipeline_cond.wait(lock) ;
+		if (pipeline_stop)
+			return ;
+		boost::shared_ptr<PreparedFrame> frame = prepared_queue.front() ;
+		prepared_queue.pop_front() ;
+
+		lock.unlock() ;
+		FrameStats stats ;
+		integrateFrame(*frame, stats) ;
+		lock.lock() ;
+
+		last_frame_stats = stats ;
+		//Buffers of the integrated frame are reused for the next prepared one
+		free_frames.push_back(frame) ;
+		frames_in_flight-- ;
+		pipeline_cond.notify_all() ;
 	}
+}
+
+void SurfelMapper::startPipeline()
+{
+	if (PIPELINE_DEPTH <= 0)
+		return ;
+
+	//One frame more than the queue depth, so the next frame may be prepared while the previous one is integrated
+	for (int i = 0; i <= PIPELINE_DEPTH ; i++)
+		free_frames.push_back(createFrame()) ;
+	preparation_thread = std::thread(&SurfelMapper::preparationLoop, this) ;
+	integration_thread = std::thread(&SurfelMapper::integrationLoop, this) ;
+}
+
+void SurfelMapper::stopPipeline()
+{
+	{
+		std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+		pipeline_stop = true ;
+	}
+	pipeline_cond.notify_all() ;
+	if (preparation_thread.joinable())
+		preparation_thread.join() ;
+	if (integration_thread.joinable())
+		integration_thread.join() ;
+}
+
+void SurfelMapper::waitForPipeline()
+{
+	std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+	while (frames_in_flight > 0)
+		pipeline_cond.wait(lock) ;
+}
+
+void SurfelMapper::downsampleSceneCloud()
+{
+	pcl::StopWatch timer ;
+
+	//Recompute points of preview voxels changed since the previous call, the rest of the cloud stays in place
+	size_t nrefreshed = preview->refresh(PREVIEW_COLOR_SAMPLES_IN_VOXEL, surfels.rgba, *cloudPreviewBack) ;
+
+	//Publish a snapshot of the back buffer
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudFront(new pcl::PointCloud<pcl::PointXYZRGB>(*cloudPreviewBack)) ;
+	{
+		std::unique_lock<std::mutex> lock(preview_mutex) ;
+		cloudSceneDownsampled = cloudFront ;
+	}
+	if (VERBOSITY >= VERBOSITY_FRAME)
+		std::cout << "Preview voxels recomputed [" << nrefreshed << "] of [" << cloudFront->size() << "], cloud downsampling time(s): [" << timer.getTimeSeconds() << "]" << std::endl ;
 
 	/*
 	//DEBUG!!!!Copy original cloud to downsampled cloud
 	cloudSceneDownsampled->clear() ;
-	for (uint32_t i = 0; i < cloudScene->width ; i++) {
+	for (uint32_t i = 0; i < surfels.size() ; i++) {
 		pcl::PointXYZRGB point ;
 
-		point.x = cloudScene->points[i].x ;
-		point.y = cloudScene->points[i].y ;
-		point.z = cloudScene->points[i].z ;
+		point.x = surfels.positions->points[i].x ;
+		point.y = surfels.positions->points[i].y ;
+		point.z = surfels.positions->points[i].z ;
 
-		point.r = cloudScene->points[i].r ;
-		point.g = cloudScene->points[i].g ;
-		point.b = cloudScene->points[i].b ;
+		point.rgba = surfels.rgba[i] ;
 		point.a = 255 ;
 
 		//Add to point cloud
@@ -249,8 +898,52 @@ void SurfelMapper::downsampleSceneCloud()
 
 }
 
+void SurfelMapper::previewLoop()
+{
+	std::unique_lock<std::mutex> lock(preview_mutex) ;
+	while (true) {
+		while (!preview_stop && !preview_pending)
+			preview_cond.wait(lock) ;
+		if (preview_stop)
+			return ;
+		preview_pending = false ;
+
+		lock.unlock() ;
+		downsampleSceneCloud() ;
+		lock.lock() ;
+
+		preview_busy = preview_pending ;
+		preview_cond.notify_all() ;
+	}
+}
+
+void SurfelMapper::startPreviewWorker()
+{
+	preview_thread = std::thread(&SurfelMapper::previewLoop, this) ;
+}
+
+void SurfelMapper::requestPreview()
+{
+	{
+		std::unique_lock<std::mutex> lock(preview_mutex) ;
+		preview_pending = true ;
+		preview_busy = true ;
+	}
+	preview_cond.notify_all() ;
+}
+
+void SurfelMapper::waitForPreview()
+{
+	std::unique_lock<std::mutex> lock(preview_mutex) ;
+	while (preview_busy)
+		preview_cond.wait(lock) ;
+}
+
 void SurfelMapper::printSettings()
 {
+	if (VERBOSITY < VERBOSITY_INFO)
+		return ;
+
 	std::cout << "SurfelMapper current settings:" << std::endl ;	
 	std::cout << "DMAX = " << DMAX << "\n" ;
 	std::cout << "MIN_KINECT_DIST = " << MIN_KINECT_DIST << std::endl ; 
@@ -264,6 +957,15 @@ void SurfelMapper::printSettings()
 	std::cout << "SCENE_SIZE = " << SCENE_SIZE << std::endl ;
 	std::cout << "LOGGING = " << LOGGING << std::endl ;
 	std::cout << "USE_UPDATE = " << USE_UPDATE << std::endl ;
+	std::cout << "USE_INDEX_MAP = " << USE_INDEX_MAP << std::endl ;
+	std::cout << "NUM_THREADS = " << NUM_THREADS << std::endl ;
+	std::cout << "COMPACTION_RATIO = " << COMPACTION_RATIO << std::endl ;
+	std::cout << "NORMAL_ESTIMATION = " << NORMAL_ESTIMATION << std::endl ;
+	std::cout << "SPATIAL_INDEX = " << SPATIAL_INDEX << std::endl ;
+	std::cout << "PIPELINE_DEPTH = " << PIPELINE_DEPTH << std::endl ;
+	std::cout << "QUEUE_POLICY = " << QUEUE_POLICY << std::endl ;
+	std::cout << "VERBOSITY = " << VERBOSITY << std::endl ;
+	std::cout << "Projection kernel = " << getProjectionKernelName() << std::endl ;
 	std::cout << "alpha = " << camera_params.alpha << std::endl ;
 	std::cout << "beta = " << camera_params.beta << std::endl ;
 	std::cout << "cx = " << camera_params.cx << std::endl ;
@@ -272,26 +974,35 @@ void SurfelMapper::printSettings()
 
 void SurfelMapper::initLogger() 
 {
+	//Names of the fields in the order of LogFieldId
+	static const char *field_names[LOG_FIELD_COUNT] = {
+		"normal_computation_time",
+		"frame_preprocessing_time",
+		"preview_wait_time",
+		"surfel_update_time",
+		"surfel_addition_time",
+		"cloud_scene_width",
+		"cloud_scene_actual_size",
+		"ntotal_scans",
+		"nscans_covered",
+		"nsurfels_inside_frustum",
+		"nsurfels_projected_on_sensor",
+		"octree_nodes_visited",
+		"surfels_updated",
+		"scans_too_far",
+		"scans_too_close",
+		"surfels_removed_on_update",
+		"surfels_added",
+		"cloud_scene_actual_size_after",
+		"surfels_added_to_free_slots",
+		"free_slots",
+		"reclaimed_bytes",
+		"index_leaves"
+	} ;
+
 	logger.turnLoggingOn(LOGGING) ;
-	logger.addField("normal_computation_time") ;
-	logger.addField("normal_filtering_time") ;
-	logger.addField("keyframe_transformation_time") ;
-	logger.addField("scope_filtering_time") ;
-	logger.addField("surfel_update_time") ;
-	logger.addField("surfel_addition_time") ;
-	logger.addField("cloud_scene_width") ;
-	logger.addField("cloud_scene_actual_size") ;
-	logger.addField("ntotal_scans") ;
-	logger.addField("nscans_covered") ;
-	logger.addField("nsurfels_inside_frustum") ;
-	logger.addField("nsurfels_projected_on_sensor") ;
-	logger.addField("octree_nodes_visited") ;
-	logger.addField("surfels_updated") ;
-	logger.addField("scans_too_far") ;
-	logger.addField("scans_too_close") ;
-	logger.addField("surfels_removed_on_update") ;
-	logger.addField("surfels_added") ;
-	logger.addField("cloud_scene_actual_size_after") ;
+	for (int i = 0; i < LOG_FIELD_COUNT ; i++)
+		log_fields[i] = logger.addField(field_names[i]) ;
 
 	logger.initFile() ;
 }
@@ -299,8 +1010,11 @@ void SurfelMapper::initLogger()
 
 SurfelMapper::SurfelMapper(double DMAX, double MIN_KINECT_DIST, double MAX_KINECT_DIST, double OCTREE_RESOLUTION, 
 			   double PREVIEW_RESOLUTION, int PREVIEW_COLOR_SAMPLES_IN_VOXEL, int CONFIDENCE_THRESHOLD1, double MIN_SCAN_ZNORMAL, 
-			   bool USE_FRUSTUM, int SCENE_SIZE, bool LOGGING, bool USE_UPDATE, CameraParams &camera_params): 
-				cloudScene(new pcl::PointCloud<PointCustomSurfel>), cloudSceneDownsampled(new pcl::PointCloud<pcl::PointXYZRGB>), octree(500.0)
+			   bool USE_FRUSTUM, int SCENE_SIZE, bool LOGGING, bool USE_UPDATE, bool USE_INDEX_MAP, int NUM_THREADS, 
+			   double COMPACTION_RATIO, int NORMAL_ESTIMATION, int SPATIAL_INDEX, int PIPELINE_DEPTH, int QUEUE_POLICY, int VERBOSITY, CameraParams &camera_params): 
+				cloudScene(new pcl::PointCloud<PointCustomSurfel>), cloud_scene_valid(false), cloudSceneDownsampled(new pcl::PointCloud<pcl::PointXYZRGB>),
+				cloudPreviewBack(new pcl::PointCloud<pcl::PointXYZRGB>), preview_pending(false), preview_busy(false), preview_stop(false),
+				reclaimed_bytes(0), frame_width(0), frame_height(0), sync_frame(createFrame()), frames_in_flight(0), frames_dropped(0), last_frame_stats(), pipeline_stop(false)
 {
 	this->DMAX  = DMAX ;
 	this->MIN_KINECT_DIST  = MIN_KINECT_DIST ;
@@ -314,21 +1028,35 @@ SurfelMapper::SurfelMapper(double DMAX, double MIN_KINECT_DIST, double MAX_KINEC
 	this->SCENE_SIZE = SCENE_SIZE ;
 	this->LOGGING = LOGGING ;
 	this->USE_UPDATE = USE_UPDATE ;
+	this->USE_INDEX_MAP = USE_INDEX_MAP ;
+	this->NUM_THREADS = NUM_THREADS ;
+	this->COMPACTION_RATIO = COMPACTION_RATIO ;
+	this->NORMAL_ESTIMATION = NORMAL_ESTIMATION ;
+	this->SPATIAL_INDEX = SPATIAL_INDEX ;
+	this->PIPELINE_DEPTH = PIPELINE_DEPTH ;
+	this->QUEUE_POLICY = QUEUE_POLICY ;
+	this->VERBOSITY = VERBOSITY ;
 	this->camera_params = camera_params ;
 
 	printSettings() ;
 
-	cloudScene->reserve(this->SCENE_SIZE) ;
-	octree.setResolution(this->OCTREE_RESOLUTION) ; //Does it give the same effect as placed in the constructor?
-	//octree.defineBoundingBox(-100,-100,-100, 100, 100, 100) ;	
-	octree.setInputCloud(cloudScene) ;
+	surfels.reserve(this->SCENE_SIZE) ;
+	createSpatialIndex() ;
+
+	thread_pool.reset(new ThreadPool(std::max(this->NUM_THREADS, 0))) ;
+	thread_projection_buffers.resize(thread_pool->getThreadCount()) ;
+	prepareFrameBuffers(CLOUD_WIDTH, CLOUD_HEIGHT) ;
+	startPreviewWorker() ;
+	startPipeline() ;
 
 	initLogger() ;
 }
 
 
 SurfelMapper::SurfelMapper(int SCENE_SIZE, bool LOGGING, CameraParams &camera_params): 
-				cloudScene(new pcl::PointCloud<PointCustomSurfel>), cloudSceneDownsampled(new pcl::PointCloud<pcl::PointXYZRGB>), octree(500.0)
+				cloudScene(new pcl::PointCloud<PointCustomSurfel>), cloud_scene_valid(false), cloudSceneDownsampled(new pcl::PointCloud<pcl::PointXYZRGB>),
+				cloudPreviewBack(new pcl::PointCloud<pcl::PointXYZRGB>), preview_pending(false), preview_busy(false), preview_stop(false),
+				reclaimed_bytes(0), frame_width(0), frame_height(0), sync_frame(createFrame()), frames_in_flight(0), frames_dropped(0), last_frame_stats(), pipeline_stop(false)
 {
 	this->SCENE_SIZE = SCENE_SIZE ;
 	this->LOGGING = LOGGING ;
@@ -336,39 +1064,169 @@ SurfelMapper::SurfelMapper(int SCENE_SIZE, bool LOGGING, CameraParams &camera_pa
 
 	printSettings() ;
 
-	cloudScene->reserve(this->SCENE_SIZE) ;
-	octree.setResolution(this->OCTREE_RESOLUTION) ; //Does it give the same effect as placed in the constructor?
-	//octree.defineBoundingBox(-100,-100,-100, 100, 100, 100) ;	
-	octree.setInputCloud(cloudScene) ;
+	surfels.reserve(this->SCENE_SIZE) ;
+	createSpatialIndex() ;
+
+	thread_pool.reset(new ThreadPool(std::max(this->NUM_THREADS, 0))) ;
+	thread_projection_buffers.resize(thread_pool->getThreadCount()) ;
+	prepareFrameBuffers(CLOUD_WIDTH, CLOUD_HEIGHT) ;
+	startPreviewWorker() ;
+	startPipeline() ;
 
 	initLogger() ;
 }
 
-SurfelMapper::SurfelMapper(): cloudScene(new pcl::PointCloud<PointCustomSurfel>), cloudSceneDownsampled(new pcl::PointCloud<pcl::PointXYZRGB>), octree(500.0)
+SurfelMapper::SurfelMapper(): cloudScene(new pcl::PointCloud<PointCustomSurfel>), cloud_scene_valid(false), cloudSceneDownsampled(new pcl::PointCloud<pcl::PointXYZRGB>),
+				cloudPreviewBack(new pcl::PointCloud<pcl::PointXYZRGB>), preview_pending(false), preview_busy(false), preview_stop(false),
+				reclaimed_bytes(0), frame_width(0), frame_height(0), sync_frame(createFrame()), frames_in_flight(0), frames_dropped(0), last_frame_stats(), pipeline_stop(false)
 {
 	printSettings() ;
 
-	cloudScene->reserve(this->SCENE_SIZE) ;
-	octree.setResolution(this->OCTREE_RESOLUTION) ; //Does it give the same effect as placed in the constructor?
-	octree.setInputCloud(cloudScene) ;
+	surfels.reserve(this->SCENE_SIZE) ;
+	createSpatialIndex() ;
+
+	thread_pool.reset(new ThreadPool(std::max(this->NUM_THREADS, 0))) ;
+	thread_projection_buffers.resize(thread_pool->getThreadCount()) ;
+	prepareFrameBuffers(CLOUD_WIDTH, CLOUD_HEIGHT) ;
+	startPreviewWorker() ;
+	startPipeline() ;
 
 	initLogger() ;
 }
 
 SurfelMapper::~SurfelMapper()
-{}
+{
+	stopPipeline() ;
+	{
+		std::unique_lock<std::mutex> lock(preview_mutex) ;
+		preview_stop = true ;
+	}
+	preview_cond.notify_all() ;
+	preview_thread.join() ;
+}
 
-/**
- * Simple predicate testing negativeness of the number
- *
- * @param i input number
- * @return true if the number is negative, false otherwise
- */
-bool IsNegative (int i) { return i < 0 ; }
+FrameStats SurfelMapper::addPointCloudToScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud)
+{
+	return addCloudViewToScene(*createCloudView(cloud)) ;
+}
+
+FrameStats SurfelMapper::addCloudViewToScene(const CloudView &view)
+{
+	//Frames enqueued earlier are integrated first
+	waitForPipeline() ;
+	prepareFrame(view, *sync_frame) ;
+	FrameStats stats ;
+	integrateFrame(*sync_frame, stats) ;
+
+	std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+	last_frame_stats = stats ;
+	return stats ;
+}
+
+bool SurfelMapper::enqueuePointCloud(const pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud)
+{
+	return enqueueCloudView(createCloudView(cloud)) ;
+}
+
+bool SurfelMapper::enqueueCloudView(const boost::shared_ptr<const CloudView> &view)
+{
+	if (PIPELINE_DEPTH <= 0) {
+		addCloudViewToScene(*view) ;
+		return true ;
+	}
+
+	InputFrame input ;
+	input.cloud = view ;
+	return enqueueFrame(input) ;
+}
+
+FrameStats SurfelMapper::addDepthImageToScene(const DepthImageView &image)
+{
+	//Frames enqueued earlier are integrated first
+	waitForPipeline() ;
+	prepareFrame(image, *sync_frame) ;
+	FrameStats stats ;
+	integrateFrame(*sync_frame, stats) ;
+
+	std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+	last_frame_stats = stats ;
+	return stats ;
+}
 
-void SurfelMapper::addPointCloudToScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud)
+bool SurfelMapper::enqueueDepthImage(const boost::shared_ptr<const DepthImageView> &image)
 {
+	if (PIPELINE_DEPTH <= 0) {
+		addDepthImageToScene(*image) ;
+		return true ;
+	}
+
+	InputFrame input ;
+	input.depth_image = image ;
+	return enqueueFrame(input) ;
+}
+
+bool SurfelMapper::enqueueFrame(const InputFrame &input)
+{
+	{
+		std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+		if (input_queue.size() >= size_t(PIPELINE_DEPTH)) {
+			switch (QUEUE_POLICY) {
+				case QUEUE_DROP_OLDEST:
+					input_queue.pop_front() ;
+					frames_in_flight-- ;
+					frames_dropped++ ;
+					break ;
+				case QUEUE_DROP_NEWEST:
+					frames_dropped++ ;
+					return false ;
+				case QUEUE_COALESCE:
+					//Frames waiting at the front are kept, so the map is still updated at a regular pace
+					input_queue.pop_back() ;
+					frames_in_flight-- ;
+					frames_dropped++ ;
+					break ;
+				default:
+					while (input_queue.size() >= size_t(PIPELINE_DEPTH))
+						pipeline_cond.wait(lock) ;
+			}
+		}
+		input_queue.push_back(input) ;
+		frames_in_flight++ ;
+	}
+	pipeline_cond.notify_all() ;
+	return true ;
+}
+
+size_t SurfelMapper::getDroppedFrameCount()
+{
+	std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+	return frames_dropped ;
+}
+
+FrameStats SurfelMapper::getLastFrameStats()
+{
+	std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+	return last_frame_stats ;
+}
+
+void SurfelMapper::flushPipeline()
+{
+	waitForPipeline() ;
+}
+
+bool SurfelMapper::isPipelineIdle()
+{
+	std::unique_lock<std::mutex> lock(pipeline_mutex) ;
+	return frames_in_flight == 0 ;
+}
+
+void SurfelMapper::integrateFrame(PreparedFrame &frame, FrameStats &stats)
+{
+	stats = FrameStats() ;
 	pcl::StopWatch timer ;
+	pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloudNormals = frame.cloud_normals ;
+	pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr &cloudNormalsTrans = frame.cloud_normals_trans ;
+	const std::vector<int> &valid_pixels = frame.valid_pixels ;
 	
 	//Testing cloud frustum
 	//testCloud(cloud) ;
@@ -378,10 +1236,16 @@ void SurfelMapper::addPointCloudToScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &
 	//double beta = 517.211658 ; //fy
 	//double cy = 260.384697 ;
 
-	double alpha = camera_params.alpha ; //fx
-	double cx = camera_params.cx ;
-	double beta = camera_params.beta ; //fy
-	double cy =  camera_params.cy ;
+	//Per-frame buffers and camera parameters follow the resolution of the incoming frame
+	prepareFrameBuffers(cloudNormals->width, cloudNormals->height) ;
+
+	//Surfels modified by this frame are stamped with a new epoch
+	surfels.beginEpoch() ;
+
+	double alpha = frame_camera_params.alpha ; //fx
+	double cx = frame_camera_params.cx ;
+	double beta = frame_camera_params.beta ; //fy
+	double cy =  frame_camera_params.cy ;
 
 	//std::cout << "alpha " << alpha << std::endl ;
 	//std::cout << "cx " << cx << std::endl ;
@@ -391,84 +1255,19 @@ void SurfelMapper::addPointCloudToScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &
 	//double zTor = 0.25 * (1.0 / alpha + 1.0 / beta) ;
 	double zTor = 1.0/(sqrt(2.0) * (alpha + beta) / 2.0) ;
 
-	double width = 640 ;
-	double height = 480 ;
+	double width = frame_width ;
+	double height = frame_height ;
 
 
-	//Compute a view matrix
+	//Compute a view matrix (the frame keeps the sensor pose of the input cloud)
 	Eigen::Matrix4d viewMatrix ;
-	viewMatrix << cloud->sensor_orientation_.toRotationMatrix().cast<double>(), cloud->sensor_origin_.topRows<3>().cast<double>(), 0.0, 0.0, 0.0, 1.0 ;
-
-	//std::cout << "Transform matrix used:" << std::endl ;
-	//std::cout <<  viewMatrix ;
-	//std::cout << std::endl ;
-	//std::cout.flush() ;
-	//viewMatrix = viewMatrix.inverse().eval() * cameraRgbToCameraLinkTrans ;
-	viewMatrix = viewMatrix.inverse().eval() ;
-
-
-	//Compute normals for the input cloud
-	timer.reset() ;
-	pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr cloudNormals(new pcl::PointCloud<pcl::PointXYZRGBNormal>) ;
-	pcl::copyPointCloud(*cloud, *cloudNormals) ;	
-	pcl::IntegralImageNormalEstimation<pcl::PointXYZRGBNormal, pcl::PointXYZRGBNormal> ne;
-	ne.setNormalEstimationMethod (ne.AVERAGE_3D_GRADIENT);
-        ne.setMaxDepthChangeFactor(0.02f);
-        ne.setNormalSmoothingSize(10.0f);
-        ne.setInputCloud(cloudNormals);
-	ne.useSensorOriginAsViewPoint() ;
-        ne.compute(*cloudNormals);
-	std::cout << "Normal computation for the frame [" << timer.getTimeSeconds() << "]" << std::endl ;
-	logger.log("normal_computation_time", timer.getTimeSeconds()) ;
-
-	//Filter-out incorrect normals
-	//TODO:could be possibly merged with a filterCloudByDistance function
-	unsigned int ncorrect_scans = 0 ;
-	unsigned int ncorrect_scans_and_normals = 0 ;
-	timer.reset() ;
-	for (uint32_t i = 0; i < cloudNormals->height ; i++) 
-		for (uint32_t j = 0; j < cloudNormals->width ; j++) {
-			if (!std::isnan((*cloudNormals)(j, i).z)) {
-				ncorrect_scans++ ;
-				if (!std::isnan((*cloudNormals)(j, i).normal_x)) 
-					ncorrect_scans_and_normals++ ;
-				else {
-					pcl::PointXYZRGBNormal &point = (*cloudNormals)(j, i) ;	
-					point.x = point.y = point.z = std::numeric_limits<float>::quiet_NaN () ;
-				}
-			}
-		}
-	std::cout << "Filtering out incorrect normals [" << timer.getTimeSeconds() << "]" << std::endl ;
-	logger.log("normal_filtering_time", timer.getTimeSeconds()) ;
-
-	//Transform input cloud into camera coordinate system (each keyframe is referenced to the global coord. system by ccny_rgbd) 
-	timer.reset() ;
-	pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr cloudNormalsTrans(new pcl::PointCloud<pcl::PointXYZRGBNormal>) ;
-	pcl::transformPointCloudWithNormals(*cloudNormals, *cloudNormalsTrans, viewMatrix) ;
-	std::cout << "Keyframe transformation into original camera frame time (s): [" << timer.getTimeSeconds() << "]" << std::endl ;
-	logger.log("keyframe_transformation_time", timer.getTimeSeconds()) ;
-
-	//Debug - display the cloud transformed back 
-	/*for (uint32_t i = 0; i < cloud->height ; i++)  {
-		for (uint32_t j = 0; j < cloud->width ; j++) { 
-			pcl::PointXYZRGBNormal pointTrans = (*cloudNormalsTrans)(j, i) ;
-			if (i % 50 == 0 && j % 50 ==0 && pcl::isFinite(pointTrans)) {
-				float xp = pointTrans.x / pointTrans.z ;
-				float yp = pointTrans.y / pointTrans.z ;
-				float u = alpha * xp + cx ;
-				float v = beta * yp + cy ;
-				std::cout << "(" << j << "," << i << "):" << u << " " << v << " " << pointTrans.z << " \n" ;
-			}
-		}
-	}*/
-	
+	computeViewMatrix(cloudNormals->sensor_origin_, cloudNormals->sensor_orientation_, viewMatrix) ;
 
-	//Filter points too close and too far
-	
-	timer.reset() ;	
-	filterCloudByDistance(cloudNormalsTrans) ;
-	std::cout << "Filtering points outside reliable Kinect scope time (s): [" << timer.getTimeSeconds() << "]" << std::endl ;
-	logger.log("scope_filtering_time", timer.getTimeSeconds()) ;
+	//Normals and preprocessing are computed in the preparation stage
+	stats.normal_computation_time = frame.normal_computation_time ;
+	stats.frame_preprocessing_time = frame.frame_preprocessing_time ;
+	stats.ncorrect_scans = frame.ncorrect_scans ;
+	stats.ncorrect_scans_and_normals = frame.ncorrect_scans_and_normals ;
 	
 	//Compute a projection matrix	
 	double f = MAX_KINECT_DIST + DMAX ; //When filtering surfels we want to have slightly larger aperture than for the scan cloud 
@@ -489,162 +1288,50 @@ void SurfelMapper::addPointCloudToScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &
 	pcl::visualization::getViewFrustum(projectionViewMatrix, frustum) ;
 
 	//Clean-up the scan covered array
-	static char scan_covered[CLOUD_HEIGHT][CLOUD_WIDTH] ;
-	memset(scan_covered, 0, sizeof(scan_covered[0][0]) * CLOUD_HEIGHT * CLOUD_WIDTH);
-
-	unsigned int nsurfels_updated = 0 ;
-	unsigned int octree_nodes_visited = 0 ;
-	unsigned int surfels_inside_octree_frustum = 0 ;
-	unsigned int surfels_projected_on_sensor = 0 ;
-	unsigned int nscan_too_close = 0 ;
-	unsigned int nscan_too_far = 0 ;
-	unsigned int nsurfels_invalid_reading = 0 ;
-	unsigned int nsurfels_removed = 0 ;
-	unsigned int ntotal_scans = 0 ;
-	int ncorrect_surfels = getPointCount() ;
-
-	/*float umin = 1e6 ;
-	float umax = -1e6 ;
-	float vmin = 1e6 ;
-	float vmax = -1e6 ;*/
-	
-	if (USE_UPDATE) {	
-		timer.reset() ;
-		//Iterate Octree in a depth-first manner
-		unsigned int acceptBelowDepth = UINT_MAX ;
-		pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator it = octree.depth_begin() ;
-		const pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator it_end = octree.depth_end();
-		while(it != it_end) {
-			octree_nodes_visited++ ;
-			unsigned int current_depth = it.getCurrentOctreeDepth() ;
-			//std::cout << "Current depth: " << current_depth << std::endl ;
-
-			//Cancel acceptBelowDepth if we went above a child branch that is completely in a frustum
-			if (current_depth <= acceptBelowDepth)
-				acceptBelowDepth = UINT_MAX ;
-
-			//Compute frustum if necessary
-			int frustum_result ;
-			if (current_depth > acceptBelowDepth)  
-				frustum_result = pcl::visualization::PCL_INSIDE_FRUSTUM ;
-			else {
-				Eigen::Vector3f min_bb, max_bb ;
-				octree.getVoxelBounds(it, min_bb, max_bb) ;	
-				if (!USE_FRUSTUM)
-					frustum_result = pcl::visualization::PCL_INSIDE_FRUSTUM ; //If we don't want frustum calling - let denote any voxel as belonging to frustum (accept everything)
-				else 
-					frustum_result = pcl::visualization::cullFrustum(frustum, min_bb.cast<double>(), max_bb.cast<double>()) ; 
-				if (frustum_result == pcl::visualization::PCL_INSIDE_FRUSTUM)
-					acceptBelowDepth = it.getCurrentOctreeDepth() ; //We may mark that all nodes below will be automatically accepted
-			}
+	std::fill(scan_covered.begin(), scan_covered.end(), 0) ;
 
+	//The preview worker reads the store, so it has to finish before the store is modified
+	timer.reset() ;
+	waitForPreview() ;
+	stats.preview_wait_time = timer.getTimeSeconds() ;
 
-			if (frustum_result == pcl::visualization::PCL_OUTSIDE_FRUSTUM) 
-				skipChildVoxelsCorrect(it, it_end) ;
-			else { 
-				if (it.isLeafNode()) {
-					//Transform and update all points in a leaf
-					pcl::octree::OctreeContainerPointIndices& container = it.getLeafContainer();
-					std::vector<int> &pointIndices  = container.getPointIndicesVector() ;
-					//std::vector<int> pointIndices ; 
-					//container.getPointIndices(pointIndices) ;
-
-					PointCustomSurfel pointTrans ;
-					for (int i = 0; i < pointIndices.size() ; i++)  {
-						surfels_inside_octree_frustum++ ;
-						transformPointAffine(cloudScene->points[pointIndices[i]], pointTrans, viewMatrix) ; //TODO: might perform unnecessary copying (we need only xyz, not the metadata...)
-						if (pointTrans.z <= MAX_KINECT_DIST + DMAX && pointTrans.z >= MIN_KINECT_DIST - DMAX) { //In frustum cullling we remove surfels too close or too far, should we be consistent in that? 
-							float xp = pointTrans.x / pointTrans.z ;
-							float yp = pointTrans.y / pointTrans.z ;
-							float u = alpha * xp + cx ;
-							float v = beta * yp + cy ;
-
-							/*if (u <= umin) umin = u ;
-							  if (u >= umax) umax = u ;
-							  if (v <= vmin) vmin = v ;
-							  if (v >= vmax) vmax = v ;*/
-
-							float zscan = getZAtPosition(cloudNormalsTrans, u, v) ;
-							if (std::isnan(zscan) || zscan >= 0.0f) //in both cases we hit image plane
-								surfels_projected_on_sensor++ ;
-							if (!std::isnan(zscan) && zscan >= 0.0f) {
-								//surfels_projected_on_sensor++ ;
-								if (fabs(zscan - pointTrans.z) <= DMAX) { 
-									//We have a surfel-scan match, we may update the surfel here... 
-
-									pcl::PointXYZRGBNormal pointInterpolated, pointInterpolatedTrans ; 
-									getPointAtPosition(cloudNormals, cloudNormalsTrans, u, v, pointInterpolated, pointInterpolatedTrans) ;
-									//Computing running average
-									PointCustomSurfel &pointSurfel = cloudScene->points[pointIndices[i]] ;
-
-									pointSurfel.x = (pointSurfel.x * pointSurfel.count + pointInterpolated.x) / (pointSurfel.count + 1) ;
-									pointSurfel.y = (pointSurfel.y * pointSurfel.count + pointInterpolated.y) / (pointSurfel.count + 1) ;
-									pointSurfel.z = (pointSurfel.z * pointSurfel.count + pointInterpolated.z) / (pointSurfel.count + 1) ;
-
-									pointSurfel.normal_x = (pointSurfel.normal_x * pointSurfel.count + pointInterpolated.normal_x) / (pointSurfel.count + 1) ;
-									pointSurfel.normal_y = (pointSurfel.normal_y * pointSurfel.count + pointInterpolated.normal_y) / (pointSurfel.count + 1) ;
-									pointSurfel.normal_z = (pointSurfel.normal_z * pointSurfel.count + pointInterpolated.normal_z) / (pointSurfel.count + 1) ;
-
-									pointSurfel.r = (uint8_t) ((((uint32_t) pointSurfel.r) * pointSurfel.count + pointInterpolated.r) / (pointSurfel.count + 1)) ;
-									pointSurfel.g = (uint8_t) ((((uint32_t) pointSurfel.g) * pointSurfel.count + pointInterpolated.g) / (pointSurfel.count + 1)) ;
-									pointSurfel.b = (uint8_t) ((((uint32_t) pointSurfel.b) * pointSurfel.count + pointInterpolated.b) / (pointSurfel.count + 1)) ;
-
-									pointSurfel.count++ ;
-									pointSurfel.confidence++ ;
-
-									float scanR = -pointInterpolatedTrans.z / pointInterpolatedTrans.normal_z * zTor  ;
-									/*if (fabs(scanR) > 0.2) {
-									  std::cout << "pointinterpolated.z " << pointInterpolated.z << std::endl ;
-									  std::cout << "pointinterpolated.normal_z " << pointInterpolated.normal_z ;
-									  }*/
-									pointSurfel.radius = std::min<float>(pointSurfel.radius, scanR) ; //Update radius only when the new one is smaller
-									/*if (pointSurfel.radius < 0) {
-									  std::cout << pointSurfel.radius ;
-									  }*/
-
-									//We do not update colors now (in original solution (Weise) - they take color from the most perpendicular view)
-									//TODO: possibly handle color update...
-
-									markScanAsCovered(scan_covered, u, v) ; 
-									nsurfels_updated++ ;
-								} else if (zscan - pointTrans.z > DMAX) {
-									//The observed point is behing the surfel, we may either remove the observation or the surfel (depending e.g. on the confidence)
-									//markScanAsCovered(scan_covered, u, v) ; 
-									PointCustomSurfel &pointSurfel = cloudScene->points[pointIndices[i]] ;
-									if (pointSurfel.confidence < CONFIDENCE_THRESHOLD1) {
-										//NaN surfel in the cloud (we do not remove it in order to maintain the structure of indices
-										pointSurfel.x = pointSurfel.y = pointSurfel.z = std::numeric_limits<float>::quiet_NaN () ;
-										//remove surfel from Octree
-										pointIndices[i] = -1 ; //Mark as invalid (designed for future removal)
-										nsurfels_removed++ ;
-									} else {
-										markScanAsCovered(scan_covered, u, v) ;
-									}
-									nscan_too_far++ ;
-								} else
-									nscan_too_close++ ;
-							} else nsurfels_invalid_reading++ ;
-						}
-					}
-					//The actual removal of marked (negative) indices
-                    std::vector<int>::iterator end_valid = remove_if(pointIndices.begin(), pointIndices.end(), IsNegative);
-					pointIndices.erase(end_valid, pointIndices.end());
-				}
-				it++ ;
-			}
+	UpdateCounters counters = UpdateCounters() ;
+	unsigned int index_nodes_visited = 0 ;
+	stats.live_surfels_before = surfels.getLiveCount() ;
+
+	if (USE_UPDATE) {	
+		timer.reset() ;
+		ProjectionParams projection ;
+		computeProjectionParams(viewMatrix, projection) ;
+		std::vector<std::vector<int>*> leaves ;
+		collectFrustumLeaves(frustum, viewMatrix, leaves, index_nodes_visited) ;
+		if (USE_INDEX_MAP)
+			updateSurfelsByIndexMap(leaves, projection, cloudNormals, cloudNormalsTrans, &scan_covered[0], counters) ;
+		else if (thread_pool->getThreadCount() > 1)
+			updateSurfelsParallel(leaves, projection, cloudNormals, cloudNormalsTrans, &scan_covered[0], counters) ;
+		else {
+			std::vector<int> removed_slots ;
+			std::vector<int> updated_slots ;
+			std::vector<int> dirty_voxels ;
+			std::vector<int> moved_surfels ;
+			for (size_t l = 0; l < leaves.size() ; l++)
+				updateLeafSurfels(*leaves[l], projection, cloudNormals, cloudNormalsTrans, &scan_covered[0], thread_projection_buffers[0], 
+						removed_slots, updated_slots, dirty_voxels, moved_surfels, counters) ;
+			surfels.releaseSlots(removed_slots) ;
+			surfels.logChanges(updated_slots) ;
+			preview->markVoxelsDirty(dirty_voxels) ;
+			preview->addPointsFromIndicesBulk(moved_surfels) ;
 		}
-		std::cout << "Surfel update time (s): [" << timer.getTimeSeconds() << "]" << std::endl ;
-		logger.log("surfel_update_time", timer.getTimeSeconds()) ;
+		stats.surfel_update_time = timer.getTimeSeconds() ;
 	}
 
 	//std::cout << "(u,v)-bounds: [" << umin << "," << umax << "],[" << vmin << "," << vmax << "]" << std::endl ;
 
 	unsigned int nscans_covered = 0 ;
-	//Debug - counting positive elements in scan_covered
-	for (int i = 0; i < cloud->height ; i++)
-		for (int j = 0; j < cloud->width ; j++)
-			if (scan_covered[i][j])
-				nscans_covered++ ;
+	//Debug - counting positive elements in scan_covered (only valid scans may be covered)
+	for (size_t k = 0; k < valid_pixels.size() ; k++)
+		if (scan_covered[valid_pixels[k]])
+			nscans_covered++ ;
 	//debug - end
 
 	timer.reset() ;
@@ -657,139 +1344,267 @@ void SurfelMapper::addPointCloudToScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &
 	Eigen::Matrix4d viewMatrixInv = viewMatrix.inverse().eval() ;
 
 	unsigned int surfels_added = 0 ;
+	unsigned int surfels_reused = 0 ;
 	double distance  = 0.0 ;
 	int distance_count = 0 ;
 	//Update surfel data in the cloud to add and remove covered measurements
-	for (uint32_t i = 0; i < cloud->height ; i++) 
-		for (uint32_t j = 0; j < cloud->width ; j++) { 
-			pcl::PointXYZRGBNormal pointNormalTrans = (*cloudNormalsTrans)(j, i) ;
-			if (!scan_covered[i][j] && pcl::isFinite(pointNormalTrans)) { //We check cloudTrans - since it reflect point invalidations due to distance
-				//Add a new point to the scene cloud (and the associated octree)
-				pcl::PointXYZRGBNormal pointNormal = (*cloudNormals)(j, i) ;
-				PointCustomSurfel pointSurfel ;
-				pointSurfel.x = pointNormal.x ; pointSurfel.y = pointNormal.y; pointSurfel.z = pointNormal.z ;
-				pointSurfel.normal_x = pointNormal.normal_x; pointSurfel.normal_y = pointNormal.normal_y ; pointSurfel.normal_z = pointNormal.normal_z ;
-				pointSurfel.rgba = pointNormal.rgba ;
-				pointSurfel.count = 1 ;
-				pointSurfel.radius = -pointNormalTrans.z / pointNormalTrans.normal_z * zTor  ;
-				pointSurfel.confidence = 1 ;
-
-				octree.addPointToCloud(pointSurfel, cloudScene) ;
-				surfels_added++ ;
-				//Debug - add point using cloudTrans data
-				
-					/*float xp = (j - cx) / alpha ;
-					float yp = (i - cy) / beta ;
-					pcl::PointXYZRGB p = (*cloudTrans)(j, i) ;
-					p.x = xp * p.z ; 
-					p.y = yp * p.z ;
-					pcl::PointXYZRGB p1 ;
-					transformPointAffine(p, p1, viewMatrixInv) ;
-					//octree.addPointToCloud(p1, cloudScene) ;
-					distance += fabs((*cloud)(j, i).x - p1.x) + fabs((*cloud)(j, i).y - p1.y) + fabs((*cloud)(j, i).z - p1.z) ;
-					distance_count++ ;*/
-				
-				//TODO Some other (more complex) processing is required here...
-			}
+	for (size_t k = 0; k < valid_pixels.size() ; k++) {
+		int idx = valid_pixels[k] ; //Only scans valid after preprocessing (reflecting point invalidations due to distance) are visited
+		if (!scan_covered[idx]) {
+			const pcl::PointXYZRGBNormal &pointNormalTrans = cloudNormalsTrans->points[idx] ;
+			//Add a new point to the scene cloud (and the associated octree)
+			const pcl::PointXYZRGBNormal &pointNormal = cloudNormals->points[idx] ;
+			PointCustomSurfel pointSurfel ;
+			pointSurfel.x = pointNormal.x ; pointSurfel.y = pointNormal.y; pointSurfel.z = pointNormal.z ;
+			pointSurfel.normal_x = pointNormal.normal_x; pointSurfel.normal_y = pointNormal.normal_y ; pointSurfel.normal_z = pointNormal.normal_z ;
+			pointSurfel.rgba = pointNormal.rgba ;
+			pointSurfel.count = 1 ;
+			pointSurfel.radius = -pointNormalTrans.z / pointNormalTrans.normal_z * zTor  ;
+			pointSurfel.confidence = 1 ;
+
+			if (insertSurfel(pointSurfel))
+				surfels_reused++ ;
+			surfels_added++ ;
+			//Debug - add point using cloudTrans data
+			
+				/*float xp = (j - cx) / alpha ;
+				float yp = (i - cy) / beta ;
+				pcl::PointXYZRGB p = (*cloudTrans)(j, i) ;
+				p.x = xp * p.z ; 
+				p.y = yp * p.z ;
+				pcl::PointXYZRGB p1 ;
+				transformPointAffine(p, p1, viewMatrixInv) ;
+				//octree.addPointToCloud(p1, surfels.positions) ;
+				distance += fabs((*cloud)(j, i).x - p1.x) + fabs((*cloud)(j, i).y - p1.y) + fabs((*cloud)(j, i).z - p1.z) ;
+				distance_count++ ;*/
+			
+			//TODO Some other (more complex) processing is required here...
 		}
+	}
+
+	insertQueuedSurfels() ;
 
 	//ROS_INFO("Average distance between corresponding points [%f]", distance / distance_count) ;
 
-	std::cout << "Surfel addition time (s): [" << timer.getTimeSeconds() << "]" << std::endl ;
-	logger.log("surfel_addition_time", timer.getTimeSeconds()) ;
-
-	std::cout << "cloud_scene size (all surfels including removed): [" << cloudScene->width << "]" << std::endl ;
-	logger.log("cloud_scene_width", cloudScene->width) ;
-	std::cout << "Actual scene size (without removed surfels) [" << ncorrect_surfels << "]" <<  std::endl ;
-	logger.log("cloud_scene_actual_size", ncorrect_surfels) ;
-	std::cout << "Correct scans [" << ncorrect_scans << "]" << std::endl ;
-	std::cout << "Correct scans and normals [" << ncorrect_scans_and_normals << "]" << std::endl ;
-	ntotal_scans = nscans_covered + surfels_added ;
-	std::cout << "Correct (add-able) scans (inside bounds and frontal-oriented) [" << ntotal_scans << "]"  << std::endl ; 
-	logger.log("ntotal_scans", ntotal_scans) ;
-	std::cout << "No. of scans covered [" << nscans_covered << "]" << std::endl ;
-	logger.log("nscans_covered", nscans_covered) ;
-	std::cout << "Surfels inside octree frustum [" << surfels_inside_octree_frustum << "]" << std::endl ;
-	logger.log("nsurfels_inside_frustum", surfels_inside_octree_frustum) ;
-	std::cout << "Surfels projected on sensor plane [" << surfels_projected_on_sensor << "]" << std::endl ;
-	logger.log("nsurfels_projected_on_sensor", surfels_projected_on_sensor) ;
-	std::cout << "Projected/inside frustum (%) [" << double(surfels_projected_on_sensor)/surfels_inside_octree_frustum * 100 << "]" << std::endl ;
-	std::cout << "Outside frustum/total points (%) [" << double(ncorrect_surfels - surfels_inside_octree_frustum) / ncorrect_surfels * 100 << "]" << std::endl ;
-	std::cout << "Octree nodes visited during update [" << octree_nodes_visited << "]" << std::endl ;
-	logger.log("octree_nodes_visited", octree_nodes_visited) ;
-	std::cout << "Surfels updated [" << nsurfels_updated << "]" << std::endl ;
-	logger.log("surfels_updated", nsurfels_updated) ;
-	std::cout << "Scans too far for surfel update [" << nscan_too_far << "]" << std::endl ;
-	logger.log("scans_too_far", nscan_too_far) ;
-	std::cout << "Scans too close for surfel update [" << nscan_too_close << "]" << std::endl ;
-	logger.log("scans_too_close", nscan_too_close) ;
-	std::cout << "Surfels without matching reading (NaN, outside frame) [" << nsurfels_invalid_reading << "]" << std::endl ;
-	std::cout << "Surfels removed during update [" << nsurfels_removed << "]" << std::endl ;
-	logger.log("surfels_removed_on_update", nsurfels_removed) ;
-	std::cout << "Surfels added [" << surfels_added << "]" << std::endl ;
-	logger.log("surfels_added", surfels_added) ;
-	int ncorrect_surfels_after = getPointCount() ;
-	std::cout << "cloud_scene size after update and addition (without removed surfels): [" << ncorrect_surfels_after << "]" << std::endl ;
-	logger.log("cloud_scene_actual_size_after", ncorrect_surfels_after) ;
-	logger.nextRow() ;
+	stats.surfel_addition_time = timer.getTimeSeconds() ;
+
+	stats.store_size = surfels.size() ;
+	stats.live_surfels_after = surfels.getLiveCount() ;
+	stats.nscans_covered = nscans_covered ;
+	stats.ntotal_scans = nscans_covered + surfels_added ;
+	stats.nsurfels_inside_frustum = counters.surfels_inside_octree_frustum ;
+	stats.nsurfels_projected_on_sensor = counters.surfels_projected_on_sensor ;
+	stats.index_nodes_visited = index_nodes_visited ;
+	stats.nsurfels_updated = counters.nsurfels_updated ;
+	stats.nscans_too_far = counters.nscan_too_far ;
+	stats.nscans_too_close = counters.nscan_too_close ;
+	stats.nsurfels_invalid_reading = counters.nsurfels_invalid_reading ;
+	stats.nsurfels_removed = counters.nsurfels_removed ;
+	stats.nsurfels_added = surfels_added ;
+	stats.nsurfels_added_to_free_slots = surfels_reused ;
+	stats.free_slots = surfels.getTombstoneCount() ;
+	stats.reclaimed_bytes = reclaimed_bytes ;
+	reclaimed_bytes = 0 ;
+	SurfelIndexStats index_stats ;
+	spatial_index->getIndexStats(index_stats) ;
+	stats.index_leaves = index_stats.leaf_count ;
+
+	//Reporting is deferred to the end of the integration, nothing is formatted unless asked for
+	logFrameStats(stats) ;
+	if (VERBOSITY >= VERBOSITY_FRAME)
+		printFrameStats(stats) ;
+
+	cloud_scene_valid = false ;
+
+	//Now downsample scene cloud (in the background, the worker runs until the store is modified by the next frame)
+	requestPreview() ;
 
 
-	//Now downsample scene cloud
-	timer.reset() ;	
-	downsampleSceneCloud() ;
-	std::cout << "Cloud downsampling time(s): [" << timer.getTimeSeconds() << "]" << std::endl ;
+	//std::cout << "Octree depth: [" << octree.getTreeDepth() << "]" << std::endl ;
+}
 
+void SurfelMapper::logFrameStats(const FrameStats &stats)
+{
+	logger.log(log_fields[LOG_NORMAL_COMPUTATION_TIME], stats.normal_computation_time) ;
+	logger.log(log_fields[LOG_FRAME_PREPROCESSING_TIME], stats.frame_preprocessing_time) ;
+	logger.log(log_fields[LOG_PREVIEW_WAIT_TIME], stats.preview_wait_time) ;
+	if (USE_UPDATE)
+		logger.log(log_fields[LOG_SURFEL_UPDATE_TIME], stats.surfel_update_time) ;
+	logger.log(log_fields[LOG_SURFEL_ADDITION_TIME], stats.surfel_addition_time) ;
+	logger.log(log_fields[LOG_CLOUD_SCENE_WIDTH], stats.store_size) ;
+	logger.log(log_fields[LOG_CLOUD_SCENE_ACTUAL_SIZE], stats.live_surfels_before) ;
+	logger.log(log_fields[LOG_NTOTAL_SCANS], stats.ntotal_scans) ;
+	logger.log(log_fields[LOG_NSCANS_COVERED], stats.nscans_covered) ;
+	logger.log(log_fields[LOG_NSURFELS_INSIDE_FRUSTUM], stats.nsurfels_inside_frustum) ;
+	logger.log(log_fields[LOG_NSURFELS_PROJECTED_ON_SENSOR], stats.nsurfels_projected_on_sensor) ;
+	logger.log(log_fields[LOG_OCTREE_NODES_VISITED], stats.index_nodes_visited) ;
+	logger.log(log_fields[LOG_SURFELS_UPDATED], stats.nsurfels_updated) ;
+	logger.log(log_fields[LOG_SCANS_TOO_FAR], stats.nscans_too_far) ;
+	logger.log(log_fields[LOG_SCANS_TOO_CLOSE], stats.nscans_too_close) ;
+	logger.log(log_fields[LOG_SURFELS_REMOVED_ON_UPDATE], stats.nsurfels_removed) ;
+	logger.log(log_fields[LOG_SURFELS_ADDED], stats.nsurfels_added) ;
+	logger.log(log_fields[LOG_CLOUD_SCENE_ACTUAL_SIZE_AFTER], stats.live_surfels_after) ;
+	logger.log(log_fields[LOG_SURFELS_ADDED_TO_FREE_SLOTS], stats.nsurfels_added_to_free_slots) ;
+	logger.log(log_fields[LOG_FREE_SLOTS], stats.free_slots) ;
+	logger.log(log_fields[LOG_RECLAIMED_BYTES], stats.reclaimed_bytes) ;
+	logger.log(log_fields[LOG_INDEX_LEAVES], stats.index_leaves) ;
+	logger.nextRow() ;
+}
 
-	//std::cout << "Octree depth: [" << octree.getTreeDepth() << "]" << std::endl ;
+void SurfelMapper::printFrameStats(const FrameStats &stats)
+{
+	std::ostringstream report ;
+	report << "Normal computation for the frame [" << stats.normal_computation_time << "]\n" ;
+	report << "Frame preprocessing (normal filtering, transformation and scope filtering) time (s): [" << stats.frame_preprocessing_time << "]\n" ;
+	if (USE_UPDATE)
+		report << "Surfel update time (s): [" << stats.surfel_update_time << "]\n" ;
+	report << "Surfel addition time (s): [" << stats.surfel_addition_time << "]\n" ;
+	report << "cloud_scene size (all surfels including removed): [" << stats.store_size << "]\n" ;
+	report << "Actual scene size (without removed surfels) [" << stats.live_surfels_before << "]\n" ;
+	report << "Correct scans [" << stats.ncorrect_scans << "]\n" ;
+	report << "Correct scans and normals [" << stats.ncorrect_scans_and_normals << "]\n" ;
+	report << "Correct (add-able) scans (inside bounds and frontal-oriented) [" << stats.ntotal_scans << "]\n" ;
+	report << "No. of scans covered [" << stats.nscans_covered << "]\n" ;
+	report << "Surfels inside octree frustum [" << stats.nsurfels_inside_frustum << "]\n" ;
+	report << "Surfels projected on sensor plane [" << stats.nsurfels_projected_on_sensor << "]\n" ;
+	report << "Projected/inside frustum (%) [" << double(stats.nsurfels_projected_on_sensor) / stats.nsurfels_inside_frustum * 100 << "]\n" ;
+	report << "Outside frustum/total points (%) [" << (double(stats.live_surfels_before) - stats.nsurfels_inside_frustum) / stats.live_surfels_before * 100 << "]\n" ;
+	report << "Spatial index (" << spatial_index->getName() << ") nodes visited during update [" << stats.index_nodes_visited << "]\n" ;
+	report << "Surfels updated [" << stats.nsurfels_updated << "]\n" ;
+	report << "Scans too far for surfel update [" << stats.nscans_too_far << "]\n" ;
+	report << "Scans too close for surfel update [" << stats.nscans_too_close << "]\n" ;
+	report << "Surfels without matching reading (NaN, outside frame) [" << stats.nsurfels_invalid_reading << "]\n" ;
+	report << "Surfels removed during update [" << stats.nsurfels_removed << "]\n" ;
+	report << "Surfels added [" << stats.nsurfels_added << "]\n" ;
+	report << "cloud_scene size after update and addition (without removed surfels): [" << stats.live_surfels_after << "]\n" ;
+	report << "Surfels added to free slots [" << stats.nsurfels_added_to_free_slots << "]\n" ;
+	report << "Free slots left [" << stats.free_slots << "]\n" ;
+	report << "Spatial index leaves [" << stats.index_leaves << "]\n" ;
+
+	//A single write of the whole report
+	std::cout << report.str() << std::flush ;
 }
 
 pcl::PointCloud<PointCustomSurfel>::Ptr &SurfelMapper::getCloudScene()
 {
+	waitForPipeline() ;
+	if (!cloud_scene_valid) {
+		surfels.toPointCloud(*cloudScene) ;
+		cloud_scene_valid = true ;
+	}
 	return cloudScene ;
 }
 
-pcl::PointCloud<pcl::PointXYZRGB>::Ptr &SurfelMapper::getCloudSceneDownsampled()
+pcl::PointCloud<pcl::PointXYZRGB>::Ptr SurfelMapper::getCloudSceneDownsampled()
 {
+	std::unique_lock<std::mutex> lock(preview_mutex) ;
 	return cloudSceneDownsampled ;
 }
 
+void SurfelMapper::flushPreview()
+{
+	waitForPipeline() ;
+	waitForPreview() ;
+}
+
 size_t SurfelMapper::getPointCount()
 {
-	//Convert voxels at fixed depth to points in a downsampled cloud
-	pcl::octree::OctreePointCloud<PointCustomSurfel>::LeafNodeIterator it = octree.leaf_begin() ;
-	const pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator it_end = octree.leaf_end();
-	size_t count = 0 ;
-	while(it != it_end) {
-		if (it.isLeafNode()) {
-			//Examine points in the voxel	
-			pcl::octree::OctreeContainerPointIndices& container = it.getLeafContainer();
-			count += container.getSize() ;
-		} else {
-			std::cerr << "LeafNode iterator error - we are not in the leaf node!" << std::endl ;
-		}
-		it++ ;
-	}
-	return count ;
+	waitForPipeline() ;
+	return surfels.getLiveCount() ;
 }
 
+MapStats SurfelMapper::getMapStats()
+{
+	waitForPipeline() ;
+	MapStats stats ;
+	stats.live_surfels = surfels.getLiveCount() ;
+	stats.tombstones = surfels.getTombstoneCount() ;
+	stats.slots = surfels.size() ;
+	stats.store_bytes = stats.slots * SurfelStore::getBytesPerSurfel() ;
+
+	SurfelIndexStats index_stats ;
+	spatial_index->getIndexStats(index_stats) ;
+	stats.index_leaves = index_stats.leaf_count ;
+	stats.index_branches = index_stats.branch_count ;
+	stats.index_leaf_depth = index_stats.leaf_depth ;
+	return stats ;
+}
+
+
+bool SurfelMapper::needsCompaction()
+{
+	waitForPipeline() ;
+	if (COMPACTION_RATIO <= 0.0 || surfels.size() == 0)
+		return false ;
+	return double(surfels.getTombstoneCount()) / surfels.size() > COMPACTION_RATIO ;
+}
+
+size_t SurfelMapper::compactMap()
+{
+	pcl::StopWatch timer ;
+
+	waitForPipeline() ;
+	waitForPreview() ;
+	std::vector<int> remap ;
+	size_t nreclaimed = surfels.compact(remap) ;
+	if (nreclaimed == 0)
+		return 0 ;
+
+	//Renumber indices held by leaves of the spatial index
+	std::vector<std::vector<int>*> leaves ;
+	spatial_index->collectAllLeaves(leaves) ;
+	for (size_t l = 0; l < leaves.size() ; l++) {
+		std::vector<int> &pointIndices = *leaves[l] ;
+		for (size_t i = 0; i < pointIndices.size() ; i++)
+			pointIndices[i] = remap[pointIndices[i]] ;
+	}
+
+	//Preview voxels may still hold indices of removed surfels
+	leaves.clear() ;
+	preview->collectAllLeaves(leaves) ;
+	for (size_t l = 0; l < leaves.size() ; l++) {
+		std::vector<int> &pointIndices = *leaves[l] ;
+		for (size_t i = 0; i < pointIndices.size() ; i++)
+			pointIndices[i] = remap[pointIndices[i]] ;
+		std::vector<int>::iterator end_valid = remove_if(pointIndices.begin(), pointIndices.end(), IsNegative);
+		pointIndices.erase(end_valid, pointIndices.end());
+	}
+	cloud_scene_valid = false ;
+
+	size_t nbytes = nreclaimed * SurfelStore::getBytesPerSurfel() ;
+	reclaimed_bytes += nbytes ;
+	if (VERBOSITY >= VERBOSITY_INFO)
+		std::cout << "Map compaction: reclaimed slots [" << nreclaimed << "], reclaimed bytes [" << nbytes << "], time (s): [" << timer.getTimeSeconds() << "]" << std::endl ;
+	return nbytes ;
+}
 
 void SurfelMapper::resetMap()
 {
+	waitForPipeline() ;
+	waitForPreview() ;
+	surfels.clear() ;
+	reclaimed_bytes = 0 ;
 	cloudScene = pcl::PointCloud<PointCustomSurfel>::Ptr(new pcl::PointCloud<PointCustomSurfel>) ;
-	cloudScene->reserve(this->SCENE_SIZE) ;
+	cloud_scene_valid = false ;
 
-	cloudSceneDownsampled = pcl::PointCloud<pcl::PointXYZRGB>::Ptr(new pcl::PointCloud<pcl::PointXYZRGB>) ;
+	{
+		std::unique_lock<std::mutex> lock(preview_mutex) ;
+		cloudSceneDownsampled = pcl::PointCloud<pcl::PointXYZRGB>::Ptr(new pcl::PointCloud<pcl::PointXYZRGB>) ;
+	}
+	cloudPreviewBack->clear() ;
 
-	octree.deleteTree() ;
-	octree.setResolution(this->OCTREE_RESOLUTION) ; //Does it give the same effect as placed in the constructor?
-	octree.setInputCloud(cloudScene) ;
+	spatial_index->clear() ;
+	spatial_index->setSurfelPositions(surfels.positions) ;
+	preview->clear() ;
+	preview->setSurfelPositions(surfels.positions) ;
 
 	initLogger() ;
 }
 
 void SurfelMapper::getBoundingBoxIndices(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<int> &k_indices)
 {
-	octree.boxSearch(min_pt, max_pt, k_indices) ;
+	waitForPipeline() ;
+	spatial_index->searchBox(min_pt, max_pt, k_indices) ;
 }
 
 void SurfelMapper::getAllIndices(std::vector<int> &k_indices) 
@@ -802,19 +1617,102 @@ void SurfelMapper::getAllIndices(std::vector<int> &k_indices)
 	//octree.boxSearch(min_pt, max_pt, k_indices) ;
 
 	//Collect indices of points from all leaves
-	pcl::octree::OctreePointCloud<PointCustomSurfel>::LeafNodeIterator it = octree.leaf_begin() ;
-	const pcl::octree::OctreePointCloud<PointCustomSurfel>::DepthFirstIterator it_end = octree.leaf_end();
-	while(it != it_end) {
-		if (it.isLeafNode()) {
-			//Examine points in the voxel	
-			pcl::octree::OctreeContainerPointIndices& container = it.getLeafContainer() ;
-			std::vector<int> &pointIndices  = container.getPointIndicesVector() ;
-			k_indices.insert(k_indices.end(), pointIndices.begin(), pointIndices.end()) ; //What about the performance
-		} else {
-			std::cerr << "LeafNode iterator error - we are not in the leaf node!" << std::endl ;
-		}
-		it++ ;
-	}
+	waitForPipeline() ;
+	std::vector<std::vector<int>*> leaves ;
+	spatial_index->collectAllLeaves(leaves) ;
+	for (size_t l = 0; l < leaves.size() ; l++)
+		k_indices.insert(k_indices.end(), leaves[l]->begin(), leaves[l]->end()) ; //What about the performance
 
 	//std::cout << "getAllIndices: method 1 " << k_indices.size() << " and method 2 " << k_indices1.size() << std::endl ;
 }
+
+size_t SurfelMapper::getPackedSurfels(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<uint8_t> &data)
+{
+	waitForPipeline() ;
+	std::vector<int> k_indices ;
+	spatial_index->searchBox(min_pt, max_pt, k_indices) ;
+	data.resize(k_indices.size() * sizeof(PackedSurfel)) ;
+	size_t n = k_indices.empty() ? 0 : surfels.pack(k_indices, reinterpret_cast<PackedSurfel*>(&data[0])) ;
+	data.resize(n * sizeof(PackedSurfel)) ;
+	return n ;
+}
+
+boost::shared_ptr<const SurfelMapSnapshot> SurfelMapper::takeSnapshot()
+{
+	pcl::StopWatch timer ;
+	waitForPipeline() ;
+	boost::shared_ptr<const SurfelMapSnapshot> snapshot(new SurfelMapSnapshot(surfels, *spatial_index, SPATIAL_INDEX, OCTREE_RESOLUTION)) ;
+	if (VERBOSITY >= VERBOSITY_INFO)
+		std::cout << "Map snapshot: surfels [" << snapshot->getLiveCount() << "], epoch [" << snapshot->epoch << "], time (s): [" << timer.getTimeSeconds() << "]" << std::endl ;
+	return snapshot ;
+}
+
+bool SurfelMapper::saveMap(const std::string &file_name, size_t &nsaved)
+{
+	waitForPipeline() ;
+	nsaved = 0 ;
+	MapFileFormat format = SurfelMapWriter::getFormatFromFileName(file_name) ;
+	if (format == MAP_FORMAT_SURFEL_MAP)
+		return SurfelMapFile::save(file_name, surfels, *spatial_index, SPATIAL_INDEX, OCTREE_RESOLUTION, nsaved) ;
+
+	SurfelMapWriter writer ;
+	if (!writer.open(file_name, format))
+		return false ;
+
+	std::vector<std::vector<int>*> leaves ;
+	spatial_index->collectAllLeaves(leaves) ;
+	for (size_t l = 0; l < leaves.size() ; l++)
+		writer.write(surfels, *leaves[l]) ;
+
+	nsaved = writer.getWrittenCount() ;
+	return writer.close() ;
+}
+
+bool SurfelMapper::loadMap(const std::string &file_name, size_t &nloaded)
+{
+	pcl::StopWatch timer ;
+
+	nloaded = 0 ;
+	SurfelMapFile file ;
+	if (!file.open(file_name))
+		return false ;
+
+	resetMap() ;
+	file.loadStore(surfels) ;
+	const SurfelMapFileHeader &header = file.getHeader() ;
+	nloaded = header.surfel_count ;
+
+	//Leaves are recreated from the file if it comes from the same kind of index, otherwise surfels are inserted in bulk
+	std::vector<int> indices(nloaded) ;
+	for (size_t i = 0; i < nloaded ; i++)
+		indices[i] = i ;
+	bool leaves_loaded = header.index_type == SPATIAL_INDEX && header.resolution == OCTREE_RESOLUTION &&
+		spatial_index->loadLeaves(header.layout, static_cast<const SurfelLeafRange*>(file.getSection(MAP_SECTION_LEAVES)), header.leaf_count) ;
+	if (!leaves_loaded)
+		spatial_index->addPointsFromIndicesBulk(indices) ;
+	preview->addPointsFromIndicesBulk(indices) ;
+	requestPreview() ;
+
+	if (VERBOSITY >= VERBOSITY_INFO)
+		std::cout << "Map loaded: surfels [" << nloaded << "], leaves " << (leaves_loaded ? "loaded" : "rebuilt") << ", time (s): [" << timer.getTimeSeconds() << "]" << std::endl ;
+	return true ;
+}
+
+uint32_t SurfelMapper::getMapEpoch()
+{
+	waitForPipeline() ;
+	return surfels.current_epoch ;
+}
+
+bool SurfelMapper::getMapDelta(uint32_t since_epoch, uint32_t &epoch, std::vector<int> &slots, std::vector<uint8_t> &data, std::vector<int> &removed_slots)
+{
+	waitForPipeline() ;
+	epoch = surfels.current_epoch ;
+	slots.clear() ;
+	removed_slots.clear() ;
+	bool tracked = surfels.getChangedSlots(since_epoch, slots, removed_slots) ;
+	data.resize(slots.size() * sizeof(PackedSurfel)) ;
+	if (!slots.empty())
+		surfels.pack(slots, reinterpret_cast<PackedSurfel*>(&data[0])) ;
+	return tracked ;
+}
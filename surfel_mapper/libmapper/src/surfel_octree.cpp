@@ -0,0 +1,197 @@
+/**
+ *  @file surfel_octree.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "surfel_octree.hpp"
+#include <pcl/octree/octree_impl.h>
+#include <pcl/visualization/common/common.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+SurfelOctree::SurfelOctree(const double resolution): pcl::octree::OctreePointCloudSearch<pcl::PointXYZ>(resolution)
+{}
+
+bool SurfelOctree::compareKeyedIndices(const KeyedIndex &a, const KeyedIndex &b)
+{
+	if (a.key.x != b.key.x)
+		return a.key.x < b.key.x ;
+	if (a.key.y != b.key.y)
+		return a.key.y < b.key.y ;
+	if (a.key.z != b.key.z)
+		return a.key.z < b.key.z ;
+	return a.index < b.index ;
+}
+
+void SurfelOctree::addPointsFromIndicesBulk(const std::vector<int> &indices)
+{
+	if (indices.empty())
+		return ;
+
+	//Adapt the bounding box once for the whole batch (growing the tree changes keys, so it has to be done before keys are computed)
+	pcl::PointXYZ min_pt = input_->points[indices[0]] ;
+	pcl::PointXYZ max_pt = min_pt ;
+	for (size_t k = 1; k < indices.size() ; k++) {
+		const pcl::PointXYZ &point = input_->points[indices[k]] ;
+		min_pt.x = std::min(min_pt.x, point.x) ; max_pt.x = std::max(max_pt.x, point.x) ;
+		min_pt.y = std::min(min_pt.y, point.y) ; max_pt.y = std::max(max_pt.y, point.y) ;
+		min_pt.z = std::min(min_pt.z, point.z) ; max_pt.z = std::max(max_pt.z, point.z) ;
+	}
+	adoptBoundingBoxToPoint(min_pt) ;
+	adoptBoundingBoxToPoint(max_pt) ;
+
+	//Group points by leaf keys
+	keyed_indices.resize(indices.size()) ;
+	for (size_t k = 0; k < indices.size() ; k++) {
+		genOctreeKeyforPoint(input_->points[indices[k]], keyed_indices[k].key) ;
+		keyed_indices[k].index = indices[k] ;
+	}
+	std::sort(keyed_indices.begin(), keyed_indices.end(), compareKeyedIndices) ;
+
+	//Single descent per leaf
+	size_t k = 0 ;
+	while (k < keyed_indices.size()) {
+		const pcl::octree::OctreeKey &key = keyed_indices[k].key ;
+		pcl::octree::OctreeContainerPointIndices *container = createLeaf(key) ;
+		do {
+			container->addPointIndex(keyed_indices[k].index) ;
+			k++ ;
+		} while (k < keyed_indices.size() && keyed_indices[k].key == key) ;
+	}
+}
+
+const char *SurfelOctree::getName() const
+{
+	return "octree" ;
+}
+
+void SurfelOctree::getIndexStats(SurfelIndexStats &stats) const
+{
+	stats.leaf_count = getLeafCount() ;
+	stats.branch_count = getBranchCount() ;
+	stats.leaf_depth = getTreeDepth() ;
+}
+
+void SurfelOctree::setSurfelPositions(const pcl::PointCloud<pcl::PointXYZ>::Ptr &positions)
+{
+	setInputCloud(positions) ;
+}
+
+void SurfelOctree::clear()
+{
+	deleteTree() ;
+}
+
+void SurfelOctree::skipChildVoxelsCorrect(DepthFirstIterator &it, const DepthFirstIterator &it_end)
+{
+	unsigned int current_depth = it.getCurrentOctreeDepth() ;
+	it++ ;	
+	if (it != it_end && it.getCurrentOctreeDepth() > current_depth)
+		it.skipChildVoxels() ; //Actually we skip siblings of the child here
+}
+
+void SurfelOctree::collectFrustumLeaves(double frustum[24], const Eigen::Vector3f &frustum_min, const Eigen::Vector3f &frustum_max, 
+		std::vector<std::vector<int>*> &leaves, unsigned int &nodes_visited)
+{
+	//Iterate Octree in a depth-first manner (the bounding box of the frustum is not needed, the hierarchy prunes the search)
+	unsigned int acceptBelowDepth = UINT_MAX ;
+	DepthFirstIterator it = depth_begin() ;
+	const DepthFirstIterator it_end = depth_end();
+	while(it != it_end) {
+		nodes_visited++ ;
+		unsigned int current_depth = it.getCurrentOctreeDepth() ;
+
+		//Cancel acceptBelowDepth if we went above a child branch that is completely in a frustum
+		if (current_depth <= acceptBelowDepth)
+			acceptBelowDepth = UINT_MAX ;
+
+		//Compute frustum if necessary
+		int frustum_result ;
+		if (current_depth > acceptBelowDepth)  
+			frustum_result = pcl::visualization::PCL_INSIDE_FRUSTUM ;
+		else {
+			Eigen::Vector3f min_bb, max_bb ;
+			getVoxelBounds(it, min_bb, max_bb) ;	
+			frustum_result = pcl::visualization::cullFrustum(frustum, min_bb.cast<double>(), max_bb.cast<double>()) ; 
+			if (frustum_result == pcl::visualization::PCL_INSIDE_FRUSTUM)
+				acceptBelowDepth = it.getCurrentOctreeDepth() ; //We may mark that all nodes below will be automatically accepted
+		}
+
+		if (frustum_result == pcl::visualization::PCL_OUTSIDE_FRUSTUM) 
+			skipChildVoxelsCorrect(it, it_end) ;
+		else { 
+			if (it.isLeafNode()) 
+				leaves.push_back(&it.getLeafContainer().getPointIndicesVector()) ;
+			it++ ;
+		}
+	}
+}
+
+void SurfelOctree::collectAllLeaves(std::vector<std::vector<int>*> &leaves)
+{
+	LeafNodeIterator it = leaf_begin() ;
+	const LeafNodeIterator it_end = leaf_end();
+	while(it != it_end) {
+		leaves.push_back(&it.getLeafContainer().getPointIndicesVector()) ;
+		it++ ;
+	}
+}
+
+void SurfelOctree::collectAllLeaves(std::vector<std::vector<int>*> &leaves, std::vector<int32_t> &keys)
+{
+	LeafNodeIterator it = leaf_begin() ;
+	const LeafNodeIterator it_end = leaf_end();
+	while(it != it_end) {
+		const pcl::octree::OctreeKey &key = it.getCurrentOctreeKey() ;
+		leaves.push_back(&it.getLeafContainer().getPointIndicesVector()) ;
+		keys.push_back(key.x) ;
+		keys.push_back(key.y) ;
+		keys.push_back(key.z) ;
+		it++ ;
+	}
+}
+
+void SurfelOctree::getLayout(double layout[6]) const
+{
+	getBoundingBox(layout[0], layout[1], layout[2], layout[3], layout[4], layout[5]) ;
+}
+
+bool SurfelOctree::loadLeaves(const double layout[6], const SurfelLeafRange *ranges, size_t nranges)
+{
+	if (nranges == 0)
+		return true ;
+
+	//Keys are valid only for the same bounding box (and so the same depth) of the tree
+	defineBoundingBox(layout[0], layout[1], layout[2], layout[3], layout[4], layout[5]) ;
+	double min_x, min_y, min_z, max_x, max_y, max_z ;
+	getBoundingBox(min_x, min_y, min_z, max_x, max_y, max_z) ;
+	double tolerance = 1e-6 * resolution_ ;
+	if (std::abs(min_x - layout[0]) > tolerance || std::abs(min_y - layout[1]) > tolerance || std::abs(min_z - layout[2]) > tolerance ||
+	    std::abs(max_x - layout[3]) > tolerance || std::abs(max_y - layout[4]) > tolerance || std::abs(max_z - layout[5]) > tolerance) {
+		deleteTree() ;
+		return false ;
+	}
+
+	for (size_t l = 0; l < nranges ; l++) {
+		const SurfelLeafRange &range = ranges[l] ;
+		pcl::octree::OctreeKey key ;
+		key.x = range.key[0] ;
+		key.y = range.key[1] ;
+		key.z = range.key[2] ;
+		std::vector<int> &pointIndices = createLeaf(key)->getPointIndicesVector() ;
+		for (uint32_t i = 0; i < range.count ; i++)
+			pointIndices.push_back(range.first + i) ;
+	}
+	return true ;
+}
+
+void SurfelOctree::searchBox(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<int> &k_indices)
+{
+	boxSearch(min_pt, max_pt, k_indices) ;
+}
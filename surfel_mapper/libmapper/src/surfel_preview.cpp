@@ -0,0 +1,165 @@
+/**
+ *  @file surfel_preview.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "surfel_preview.hpp"
+#include <cmath>
+#include <algorithm>
+
+SurfelPreview::SurfelPreview(const double resolution): SurfelVoxelHash(resolution)
+{}
+
+bool SurfelPreview::belongsToBlock(const Block &block, int idx) const
+{
+	const pcl::PointXYZ &position = positions->points[idx] ;
+	if (!pcl_isfinite(position.x))
+		return false ;
+	int x, y, z ;
+	getBlockCoords(position, x, y, z) ;
+	return x == block.x && y == block.y && z == block.z ;
+}
+
+void SurfelPreview::removeBlockPoint(int b, pcl::PointCloud<pcl::PointXYZRGB> &preview)
+{
+	int p = block_points[b] ;
+	int last = preview.points.size() - 1 ;
+	preview.points[p] = preview.points[last] ;
+	point_blocks[p] = point_blocks[last] ;
+	block_points[point_blocks[p]] = p ;
+	preview.points.pop_back() ;
+	point_blocks.pop_back() ;
+	block_points[b] = -1 ;
+}
+
+int SurfelPreview::getVoxelIndex(const pcl::PointXYZ &position) const
+{
+	int x, y, z ;
+	getBlockCoords(position, x, y, z) ;
+	return findBlock(x, y, z) ;
+}
+
+bool SurfelPreview::isInVoxel(int voxel, const pcl::PointXYZ &position) const
+{
+	if (voxel < 0)
+		return false ;
+	int x, y, z ;
+	getBlockCoords(position, x, y, z) ;
+	const Block &block = blocks[voxel] ;
+	return x == block.x && y == block.y && z == block.z ;
+}
+
+void SurfelPreview::markVoxelsDirty(const std::vector<int> &voxels)
+{
+	for (size_t k = 0; k < voxels.size() ; k++) {
+		int b = voxels[k] ;
+		if (b >= 0 && !block_dirty[b]) {
+			block_dirty[b] = 1 ;
+			dirty_blocks.push_back(b) ;
+		}
+	}
+}
+
+size_t SurfelPreview::getDirtyCount() const
+{
+	return dirty_blocks.size() ;
+}
+
+void SurfelPreview::addPointsFromIndicesBulk(const std::vector<int> &indices)
+{
+	//Consecutive surfels usually come from neighbouring pixels, so the last block is cached
+	int b = -1 ;
+	for (size_t k = 0; k < indices.size() ; k++) {
+		int x, y, z ;
+		getBlockCoords(positions->points[indices[k]], x, y, z) ;
+		if (b < 0 || blocks[b].x != x || blocks[b].y != y || blocks[b].z != z) {
+			b = getOrCreateBlock(x, y, z) ;
+			if (b >= (int)block_dirty.size()) {
+				block_dirty.resize(b + 1, 0) ;
+				block_points.resize(b + 1, -1) ;
+			}
+			if (!block_dirty[b]) {
+				block_dirty[b] = 1 ;
+				dirty_blocks.push_back(b) ;
+			}
+		}
+		blocks[b].indices.push_back(indices[k]) ;
+	}
+}
+
+void SurfelPreview::clear()
+{
+	SurfelVoxelHash::clear() ;
+	block_points.clear() ;
+	point_blocks.clear() ;
+	block_dirty.clear() ;
+	dirty_blocks.clear() ;
+}
+
+size_t SurfelPreview::refresh(int color_samples, const std::vector<uint32_t> &rgba, pcl::PointCloud<pcl::PointXYZRGB> &preview)
+{
+	size_t nrefreshed = dirty_blocks.size() ;
+	for (size_t k = 0; k < dirty_blocks.size() ; k++) {
+		int b = dirty_blocks[k] ;
+		block_dirty[b] = 0 ;
+		Block &block = blocks[b] ;
+
+		//Drop indices of removed surfels (also when the slot is already reused) and surfels that moved to other voxels
+		size_t nvalid = 0 ;
+		for (size_t i = 0; i < block.indices.size() ; i++)
+			if (belongsToBlock(block, block.indices[i]))
+				block.indices[nvalid++] = block.indices[i] ;
+		block.indices.resize(nvalid) ;
+		//A slot reused in the same voxel is added to it again
+		std::sort(block.indices.begin(), block.indices.end()) ;
+		block.indices.erase(std::unique(block.indices.begin(), block.indices.end()), block.indices.end()) ;
+
+		if (block.indices.empty()) {
+			if (block_points[b] >= 0)
+				removeBlockPoint(b, preview) ;
+			continue ;
+		}
+
+		//Convert the voxel to a single point 
+		pcl::PointXYZRGB point ;
+		point.x = (block.x + 0.5) * resolution ;
+		point.y = (block.y + 0.5) * resolution ;
+		point.z = (block.z + 0.5) * resolution ;
+		point.r = point.g = point.b = 255 ;
+		point.a = 255 ;
+
+		//Select a few surfels from the voxel and compute an average color
+		unsigned long rs, gs, bs ;
+		rs = gs = bs = 0 ;
+		unsigned long count = 0 ;
+		unsigned int step = block.indices.size() / color_samples ;
+		if (step < 1) step = 1 ;
+		for (unsigned int i = 0; i < block.indices.size() ; i += step) {
+			uint32_t color = rgba[block.indices[i]] ;
+			rs += (color >> 16) & 0xff ;
+			gs += (color >> 8) & 0xff ;
+			bs += color & 0xff ;
+			count++ ;
+		}
+		point.r = rs / count ;
+		point.g = gs / count ;
+		point.b = bs / count ;
+
+		if (block_points[b] < 0) {
+			block_points[b] = preview.points.size() ;
+			point_blocks.push_back(b) ;
+			preview.points.push_back(point) ;
+		} else 
+			preview.points[block_points[b]] = point ;
+	}
+	dirty_blocks.clear() ;
+
+	preview.width = preview.points.size() ;
+	preview.height = 1 ;
+	return nrefreshed ;
+}
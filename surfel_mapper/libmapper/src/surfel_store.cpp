@@ -0,0 +1,334 @@
+/**
+ *  @file surfel_store.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "surfel_store.hpp"
+#include <limits>
+#include <cmath>
+
+#define CHANGE_LOG_MAX_FRACTION 4 /**< The change log is restarted when it holds more than 1/CHANGE_LOG_MAX_FRACTION of slots */
+
+SurfelStore::SurfelStore(): positions(new pcl::PointCloud<pcl::PointXYZ>), live_count(0), current_epoch(0), resync_epoch(0), log_epoch(0)
+{}
+
+void SurfelStore::reserve(size_t n)
+{
+	positions->reserve(n) ;
+	normal_x.reserve(n) ;
+	normal_y.reserve(n) ;
+	normal_z.reserve(n) ;
+	rgba.reserve(n) ;
+	radius.reserve(n) ;
+	confidence.reserve(n) ;
+	count.reserve(n) ;
+	epoch.reserve(n) ;
+	logged.reserve(n) ;
+}
+
+void SurfelStore::clear()
+{
+	positions->clear() ;
+	normal_x.clear() ;
+	normal_y.clear() ;
+	normal_z.clear() ;
+	rgba.clear() ;
+	radius.clear() ;
+	confidence.clear() ;
+	count.clear() ;
+	epoch.clear() ;
+	free_slots.clear() ;
+	live_count = 0 ;
+	//Epochs keep increasing, so that mirrors of the map can detect the reset
+	resync_epoch = beginEpoch() ;
+	logged.clear() ;
+	restartChangeLog() ;
+}
+
+void SurfelStore::resize(size_t n)
+{
+	positions->points.resize(n) ;
+	positions->width = n ;
+	positions->height = 1 ;
+	normal_x.resize(n) ;
+	normal_y.resize(n) ;
+	normal_z.resize(n) ;
+	rgba.resize(n) ;
+	radius.resize(n) ;
+	confidence.resize(n) ;
+	count.resize(n) ;
+	free_slots.clear() ;
+	live_count = n ;
+	resync_epoch = beginEpoch() ;
+	epoch.assign(n, resync_epoch) ;
+	logged.assign(n, 0) ;
+	restartChangeLog() ;
+}
+
+size_t SurfelStore::size() const
+{
+	return positions->points.size() ;
+}
+
+size_t SurfelStore::getTombstoneCount() const
+{
+	return free_slots.size() ;
+}
+
+size_t SurfelStore::getLiveCount() const
+{
+	return live_count ;
+}
+
+size_t SurfelStore::getBytesPerSurfel()
+{
+	return sizeof(pcl::PointXYZ) + 3 * sizeof(float) + sizeof(uint32_t) + sizeof(float) + 3 * sizeof(uint32_t) ;
+}
+
+void SurfelStore::appendAttributes(const PointCustomSurfel &surfel)
+{
+	normal_x.push_back(surfel.normal_x) ;
+	normal_y.push_back(surfel.normal_y) ;
+	normal_z.push_back(surfel.normal_z) ;
+	rgba.push_back(surfel.rgba) ;
+	radius.push_back(surfel.radius) ;
+	confidence.push_back(surfel.confidence) ;
+	count.push_back(surfel.count) ;
+	epoch.push_back(current_epoch) ;
+	logged.push_back(0) ;
+	logSlot(epoch.size() - 1) ;
+	live_count++ ;
+}
+
+size_t SurfelStore::append(const PointCustomSurfel &surfel)
+{
+	positions->push_back(pcl::PointXYZ(surfel.x, surfel.y, surfel.z)) ;
+	appendAttributes(surfel) ;
+	return size() - 1 ;
+}
+
+void SurfelStore::setSurfel(size_t idx, const PointCustomSurfel &surfel)
+{
+	pcl::PointXYZ &position = positions->points[idx] ;
+	position.x = surfel.x ;
+	position.y = surfel.y ;
+	position.z = surfel.z ;
+	normal_x[idx] = surfel.normal_x ;
+	normal_y[idx] = surfel.normal_y ;
+	normal_z[idx] = surfel.normal_z ;
+	rgba[idx] = surfel.rgba ;
+	radius[idx] = surfel.radius ;
+	confidence[idx] = surfel.confidence ;
+	count[idx] = surfel.count ;
+	epoch[idx] = current_epoch ;
+	logSlot(idx) ;
+}
+
+void SurfelStore::getSurfel(size_t idx, PointCustomSurfel &surfel) const
+{
+	const pcl::PointXYZ &position = positions->points[idx] ;
+	surfel.x = position.x ;
+	surfel.y = position.y ;
+	surfel.z = position.z ;
+	surfel.data[3] = 1.0f ;
+	surfel.normal_x = normal_x[idx] ;
+	surfel.normal_y = normal_y[idx] ;
+	surfel.normal_z = normal_z[idx] ;
+	surfel.data_n[3] = 0.0f ;
+	surfel.rgba = rgba[idx] ;
+	surfel.radius = radius[idx] ;
+	surfel.confidence = confidence[idx] ;
+	surfel.count = count[idx] ;
+}
+
+void SurfelStore::invalidate(size_t idx)
+{
+	pcl::PointXYZ &position = positions->points[idx] ;
+	position.x = position.y = position.z = std::numeric_limits<float>::quiet_NaN () ;
+	epoch[idx] = current_epoch ;
+}
+
+void SurfelStore::releaseSlots(const std::vector<int> &slots)
+{
+	free_slots.insert(free_slots.end(), slots.begin(), slots.end()) ;
+	live_count -= slots.size() ;
+	logChanges(slots) ;
+}
+
+bool SurfelStore::acquireSlot(int &idx)
+{
+	if (free_slots.empty())
+		return false ;
+	idx = free_slots.back() ;
+	free_slots.pop_back() ;
+	live_count++ ;
+	return true ;
+}
+
+size_t SurfelStore::compact(std::vector<int> &remap)
+{
+	size_t n = size() ;
+	remap.assign(n, -1) ;
+	if (free_slots.empty())  {
+		for (size_t i = 0; i < n ; i++)
+			remap[i] = i ;
+		return 0 ;
+	}
+
+	//Mark tombstones
+	for (size_t k = 0; k < free_slots.size() ; k++)
+		remap[free_slots[k]] = -2 ;
+
+	//Move live surfels (the target slot is never behind the source slot, so in-place copy is safe)
+	size_t n_live = 0 ;
+	for (size_t i = 0; i < n ; i++) {
+		if (remap[i] == -2) {
+			remap[i] = -1 ;
+			continue ;
+		}
+		if (n_live != i) {
+			positions->points[n_live] = positions->points[i] ;
+			normal_x[n_live] = normal_x[i] ;
+			normal_y[n_live] = normal_y[i] ;
+			normal_z[n_live] = normal_z[i] ;
+			rgba[n_live] = rgba[i] ;
+			radius[n_live] = radius[i] ;
+			confidence[n_live] = confidence[i] ;
+			count[n_live] = count[i] ;
+			epoch[n_live] = epoch[i] ;
+		}
+		remap[i] = n_live++ ;
+	}
+
+	positions->points.resize(n_live) ;
+	positions->width = n_live ;
+	positions->height = 1 ;
+	normal_x.resize(n_live) ;
+	normal_y.resize(n_live) ;
+	normal_z.resize(n_live) ;
+	rgba.resize(n_live) ;
+	radius.resize(n_live) ;
+	confidence.resize(n_live) ;
+	count.resize(n_live) ;
+	epoch.resize(n_live) ;
+	free_slots.clear() ;
+	resync_epoch = beginEpoch() ;
+	logged.assign(n_live, 0) ;
+	restartChangeLog() ;
+
+	return n - n_live ;
+}
+
+void SurfelStore::toPointCloud(pcl::PointCloud<PointCustomSurfel> &cloud) const
+{
+	size_t n = size() ;
+	cloud.points.resize(n) ;
+	cloud.width = n ;
+	cloud.height = 1 ;
+	cloud.is_dense = false ;
+	for (size_t i = 0; i < n ; i++)
+		getSurfel(i, cloud.points[i]) ;
+}
+
+size_t SurfelStore::pack(const std::vector<int> &slots, PackedSurfel *packed) const
+{
+	return slots.empty() ? 0 : pack(&slots[0], slots.size(), packed) ;
+}
+
+size_t SurfelStore::pack(const int *slots, size_t nslots, PackedSurfel *packed) const
+{
+	size_t n = 0 ;
+	for (size_t i = 0; i < nslots ; i++) {
+		int idx = slots[i] ;
+		const pcl::PointXYZ &position = positions->points[idx] ;
+		if (std::isnan(position.x))
+			continue ;
+		PackedSurfel &record = packed[n++] ;
+		record.x = position.x ;
+		record.y = position.y ;
+		record.z = position.z ;
+		record.normal_x = normal_x[idx] ;
+		record.normal_y = normal_y[idx] ;
+		record.normal_z = normal_z[idx] ;
+		record.rgba = rgba[idx] ;
+		record.radius = radius[idx] ;
+		record.confidence = confidence[idx] ;
+		record.count = count[idx] ;
+	}
+	return n ;
+}
+
+uint32_t SurfelStore::beginEpoch()
+{
+	//A large log is not cheaper than scanning the epochs
+	if (change_log.size() > size() / CHANGE_LOG_MAX_FRACTION)
+		restartChangeLog() ;
+	return ++current_epoch ;
+}
+
+void SurfelStore::touch(size_t idx)
+{
+	epoch[idx] = current_epoch ;
+}
+
+void SurfelStore::logSlot(size_t idx)
+{
+	if (!logged[idx]) {
+		logged[idx] = 1 ;
+		change_log.push_back(idx) ;
+	}
+}
+
+void SurfelStore::logChanges(const std::vector<int> &slots)
+{
+	for (size_t k = 0; k < slots.size() ; k++)
+		logSlot(slots[k]) ;
+}
+
+void SurfelStore::restartChangeLog()
+{
+	//Slots of the log may be already renumbered, they are cleared only if still present
+	for (size_t k = 0; k < change_log.size() ; k++)
+		if ((size_t)change_log[k] < logged.size())
+			logged[change_log[k]] = 0 ;
+	change_log.clear() ;
+	log_epoch = current_epoch ;
+}
+
+bool SurfelStore::getChangedSlots(uint32_t since_epoch, std::vector<int> &changed, std::vector<int> &removed) const
+{
+	//Epochs newer than the current one come from another instance of the map
+	bool tracked = since_epoch >= resync_epoch && since_epoch <= current_epoch ;
+
+	if (tracked && since_epoch >= log_epoch) {
+		//Only slots of the change log may be modified after since_epoch
+		for (size_t k = 0; k < change_log.size() ; k++) {
+			int i = change_log[k] ;
+			if (epoch[i] <= since_epoch)
+				continue ;
+			if (std::isnan(positions->points[i].x))
+				removed.push_back(i) ;
+			else
+				changed.push_back(i) ;
+		}
+		return true ;
+	}
+
+	//Linear scan over the (cold) epoch array, positions are only read for modified slots
+	size_t n = size() ;
+	for (size_t i = 0; i < n ; i++) {
+		if (tracked && epoch[i] <= since_epoch)
+			continue ;
+		if (std::isnan(positions->points[i].x)) {
+			if (tracked)
+				removed.push_back(i) ;
+		} else
+			changed.push_back(i) ;
+	}
+	return tracked ;
+}
@@ -0,0 +1,253 @@
+/**
+ *  @file surfel_voxel_hash.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "surfel_voxel_hash.hpp"
+#include <pcl/visualization/common/common.h>
+#include <cmath>
+#include <climits>
+#include <stdint.h>
+
+#define VOXEL_HASH_INITIAL_CAPACITY 1024 /**< Initial number of slots of the hash table */
+#define VOXEL_HASH_MAX_COORD (INT_MAX / 2) /**< Block coordinates are clamped to [-VOXEL_HASH_MAX_COORD, VOXEL_HASH_MAX_COORD] */
+
+/**
+ * @brief Converts a coordinate to the block coordinate, clamping values (e.g. of "everything" boxes) outside of the int range
+ */
+static inline int toBlockCoord(double value, double resolution)
+{
+	double coord = floor(value / resolution) ;
+	if (!(coord > -VOXEL_HASH_MAX_COORD)) //Also NaN
+		return coord != coord ? 0 : -VOXEL_HASH_MAX_COORD ;
+	if (coord > VOXEL_HASH_MAX_COORD)
+		return VOXEL_HASH_MAX_COORD ;
+	return int(coord) ;
+}
+
+SurfelVoxelHash::SurfelVoxelHash(const double resolution): resolution(resolution)
+{
+	rehash(VOXEL_HASH_INITIAL_CAPACITY) ;
+}
+
+size_t SurfelVoxelHash::hashCoords(int x, int y, int z)
+{
+	return (uint32_t(x) * 73856093u) ^ (uint32_t(y) * 19349663u) ^ (uint32_t(z) * 83492791u) ;
+}
+
+void SurfelVoxelHash::getBlockCoords(const pcl::PointXYZ &point, int &x, int &y, int &z) const
+{
+	x = toBlockCoord(point.x, resolution) ;
+	y = toBlockCoord(point.y, resolution) ;
+	z = toBlockCoord(point.z, resolution) ;
+}
+
+void SurfelVoxelHash::getBlockCoords(const Eigen::Vector3f &point, int &x, int &y, int &z) const
+{
+	x = toBlockCoord(point[0], resolution) ;
+	y = toBlockCoord(point[1], resolution) ;
+	z = toBlockCoord(point[2], resolution) ;
+}
+
+void SurfelVoxelHash::getBlockBounds(const Block &block, Eigen::Vector3f &min_bb, Eigen::Vector3f &max_bb) const
+{
+	min_bb = Eigen::Vector3f(block.x * resolution, block.y * resolution, block.z * resolution) ;
+	max_bb = Eigen::Vector3f((block.x + 1) * resolution, (block.y + 1) * resolution, (block.z + 1) * resolution) ;
+}
+
+int SurfelVoxelHash::findBlock(int x, int y, int z) const
+{
+	size_t mask = table.size() - 1 ;
+	for (size_t slot = hashCoords(x, y, z) & mask ; ; slot = (slot + 1) & mask) {
+		const Entry &entry = table[slot] ;
+		if (entry.block < 0)
+			return -1 ;
+		if (entry.x == x && entry.y == y && entry.z == z)
+			return entry.block ;
+	}
+}
+
+int SurfelVoxelHash::getOrCreateBlock(int x, int y, int z)
+{
+	//Keep the load factor below 0.5 so probe sequences stay short
+	if (2 * (blocks.size() + 1) > table.size())
+		rehash(2 * table.size()) ;
+
+	size_t mask = table.size() - 1 ;
+	size_t slot = hashCoords(x, y, z) & mask ;
+	while (table[slot].block >= 0) {
+		const Entry &entry = table[slot] ;
+		if (entry.x == x && entry.y == y && entry.z == z)
+			return entry.block ;
+		slot = (slot + 1) & mask ;
+	}
+
+	Entry &entry = table[slot] ;
+	entry.x = x ; entry.y = y ; entry.z = z ;
+	entry.block = blocks.size() ;
+	blocks.push_back(Block()) ;
+	Block &block = blocks.back() ;
+	block.x = x ; block.y = y ; block.z = z ;
+	return entry.block ;
+}
+
+void SurfelVoxelHash::rehash(size_t capacity)
+{
+	Entry empty_entry = {0, 0, 0, -1} ;
+	table.assign(capacity, empty_entry) ;
+	size_t mask = capacity - 1 ;
+	for (size_t b = 0; b < blocks.size() ; b++) {
+		const Block &block = blocks[b] ;
+		size_t slot = hashCoords(block.x, block.y, block.z) & mask ;
+		while (table[slot].block >= 0)
+			slot = (slot + 1) & mask ;
+		Entry &entry = table[slot] ;
+		entry.x = block.x ; entry.y = block.y ; entry.z = block.z ;
+		entry.block = b ;
+	}
+}
+
+void SurfelVoxelHash::collectBlocksInRange(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<int> &block_indices, unsigned int &nprobes) const
+{
+	int xmin, ymin, zmin, xmax, ymax, zmax ;
+	getBlockCoords(min_pt, xmin, ymin, zmin) ;
+	getBlockCoords(max_pt, xmax, ymax, zmax) ;
+	if (xmax < xmin || ymax < ymin || zmax < zmin)
+		return ;
+
+	//Spans of clamped coordinates do not fit in int
+	double ncells = double(int64_t(xmax) - xmin + 1) * double(int64_t(ymax) - ymin + 1) * double(int64_t(zmax) - zmin + 1) ;
+	if (ncells < blocks.size()) {
+		//Probe every cell of the range
+		for (int x = xmin; x <= xmax ; x++)
+			for (int y = ymin; y <= ymax ; y++)
+				for (int z = zmin; z <= zmax ; z++) {
+					nprobes++ ;
+					int b = findBlock(x, y, z) ;
+					if (b >= 0)
+						block_indices.push_back(b) ;
+				}
+	} else {
+		//Scan all blocks
+		for (size_t b = 0; b < blocks.size() ; b++) {
+			nprobes++ ;
+			const Block &block = blocks[b] ;
+			if (block.x >= xmin && block.x <= xmax && block.y >= ymin && block.y <= ymax && block.z >= zmin && block.z <= zmax)
+				block_indices.push_back(b) ;
+		}
+	}
+}
+
+size_t SurfelVoxelHash::getBlockCount() const
+{
+	return blocks.size() ;
+}
+
+const char *SurfelVoxelHash::getName() const
+{
+	return "voxel_hash" ;
+}
+
+void SurfelVoxelHash::getIndexStats(SurfelIndexStats &stats) const
+{
+	stats.leaf_count = blocks.size() ;
+	stats.branch_count = 0 ;
+	stats.leaf_depth = 1 ;
+}
+
+void SurfelVoxelHash::setSurfelPositions(const pcl::PointCloud<pcl::PointXYZ>::Ptr &positions)
+{
+	this->positions = positions ;
+}
+
+void SurfelVoxelHash::clear()
+{
+	blocks.clear() ;
+	rehash(VOXEL_HASH_INITIAL_CAPACITY) ;
+}
+
+void SurfelVoxelHash::addPointsFromIndicesBulk(const std::vector<int> &indices)
+{
+	//Consecutive surfels usually come from neighbouring pixels, so the last block is cached
+	Block *block = NULL ;
+	for (size_t k = 0; k < indices.size() ; k++) {
+		int x, y, z ;
+		getBlockCoords(positions->points[indices[k]], x, y, z) ;
+		if (block == NULL || block->x != x || block->y != y || block->z != z)
+			block = &blocks[getOrCreateBlock(x, y, z)] ;
+		block->indices.push_back(indices[k]) ;
+	}
+}
+
+void SurfelVoxelHash::collectFrustumLeaves(double frustum[24], const Eigen::Vector3f &frustum_min, const Eigen::Vector3f &frustum_max, 
+		std::vector<std::vector<int>*> &leaves, unsigned int &nodes_visited)
+{
+	std::vector<int> block_indices ;
+	collectBlocksInRange(frustum_min, frustum_max, block_indices, nodes_visited) ;
+
+	for (size_t k = 0; k < block_indices.size() ; k++) {
+		Block &block = blocks[block_indices[k]] ;
+		if (block.indices.empty())
+			continue ;
+		Eigen::Vector3f min_bb, max_bb ;
+		getBlockBounds(block, min_bb, max_bb) ;
+		if (pcl::visualization::cullFrustum(frustum, min_bb.cast<double>(), max_bb.cast<double>()) != pcl::visualization::PCL_OUTSIDE_FRUSTUM)
+			leaves.push_back(&block.indices) ;
+	}
+}
+
+void SurfelVoxelHash::collectAllLeaves(std::vector<std::vector<int>*> &leaves)
+{
+	for (size_t b = 0; b < blocks.size() ; b++)
+		leaves.push_back(&blocks[b].indices) ;
+}
+
+void SurfelVoxelHash::collectAllLeaves(std::vector<std::vector<int>*> &leaves, std::vector<int32_t> &keys)
+{
+	for (size_t b = 0; b < blocks.size() ; b++) {
+		leaves.push_back(&blocks[b].indices) ;
+		keys.push_back(blocks[b].x) ;
+		keys.push_back(blocks[b].y) ;
+		keys.push_back(blocks[b].z) ;
+	}
+}
+
+void SurfelVoxelHash::getLayout(double layout[6]) const
+{
+	//Block coordinates do not depend on the extent of the map
+	for (int k = 0; k < 6 ; k++)
+		layout[k] = 0.0 ;
+}
+
+bool SurfelVoxelHash::loadLeaves(const double layout[6], const SurfelLeafRange *ranges, size_t nranges)
+{
+	for (size_t l = 0; l < nranges ; l++) {
+		const SurfelLeafRange &range = ranges[l] ;
+		Block &block = blocks[getOrCreateBlock(range.key[0], range.key[1], range.key[2])] ;
+		for (uint32_t i = 0; i < range.count ; i++)
+			block.indices.push_back(range.first + i) ;
+	}
+	return true ;
+}
+
+void SurfelVoxelHash::searchBox(const Eigen::Vector3f &min_pt, const Eigen::Vector3f &max_pt, std::vector<int> &k_indices)
+{
+	std::vector<int> block_indices ;
+	unsigned int nprobes = 0 ;
+	collectBlocksInRange(min_pt, max_pt, block_indices, nprobes) ;
+
+	for (size_t k = 0; k < block_indices.size() ; k++) {
+		const std::vector<int> &pointIndices = blocks[block_indices[k]].indices ;
+		for (size_t i = 0; i < pointIndices.size() ; i++) {
+			const pcl::PointXYZ &point = positions->points[pointIndices[i]] ;
+			if (point.x >= min_pt[0] && point.y >= min_pt[1] && point.z >= min_pt[2] &&
+			    point.x <= max_pt[0] && point.y <= max_pt[1] && point.z <= max_pt[2])
+				k_indices.push_back(pointIndices[i]) ;
+		}
+	}
+}
@@ -0,0 +1,96 @@
+/**
+ *  @file thread_pool.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "thread_pool.hpp"
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int nthreads): current_task(NULL), task_size(0), next_item(0), generation(0), pending(0), stop(false)
+{
+	if (nthreads == 0)
+		nthreads = std::max<unsigned int>(std::thread::hardware_concurrency(), 1) ;
+
+	//The calling thread takes part in computations, so we need one worker less
+	for (unsigned int i = 1; i < nthreads ; i++)
+		workers.push_back(std::thread(&ThreadPool::workerLoop, this, i)) ;
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex) ;
+		stop = true ;
+	}
+	start_cond.notify_all() ;
+	for (size_t i = 0; i < workers.size() ; i++)
+		workers[i].join() ;
+}
+
+unsigned int ThreadPool::getThreadCount() const
+{
+	return workers.size() + 1 ;
+}
+
+void ThreadPool::runItems(unsigned int thread_id)
+{
+	size_t item ;
+	while ((item = next_item.fetch_add(1)) < task_size)
+		(*current_task)(thread_id, item) ;
+}
+
+void ThreadPool::workerLoop(unsigned int thread_id)
+{
+	size_t seen_generation = 0 ;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex) ;
+			while (!stop && generation == seen_generation)
+				start_cond.wait(lock) ;
+			if (stop)
+				return ;
+			seen_generation = generation ;
+		}
+
+		runItems(thread_id) ;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex) ;
+			if (--pending == 0)
+				done_cond.notify_one() ;
+		}
+	}
+}
+
+void ThreadPool::parallelFor(size_t nitems, const Task &task)
+{
+	//No need to wake up workers for trivial loops
+	if (workers.empty() || nitems <= 1) {
+		for (size_t i = 0; i < nitems ; i++)
+			task(0, i) ;
+		return ;
+	}
+
+	std::unique_lock<std::mutex> call_lock(call_mutex) ;
+	{
+		std::unique_lock<std::mutex> lock(mutex) ;
+		current_task = &task ;
+		task_size = nitems ;
+		next_item = 0 ;
+		pending = workers.size() ;
+		generation++ ;
+	}
+	start_cond.notify_all() ;
+
+	runItems(0) ;
+
+	std::unique_lock<std::mutex> lock(mutex) ;
+	while (pending > 0)
+		done_cond.wait(lock) ;
+	current_task = NULL ;
+}
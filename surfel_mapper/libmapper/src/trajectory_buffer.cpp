@@ -0,0 +1,99 @@
+/**
+ *  @file trajectory_buffer.cpp
+ *  @author Artur Wilkowski <ArturWilkowski@piap.pl>
+ *
+ *  @section LICENSE
+ *
+ *  Copyright (C) 2015, Industrial Research Institute for Automation and Measurements
+ *  Security and Defence Systems Division <http://www.piap.pl>
+ */
+
+#include "trajectory_buffer.hpp"
+#include <limits>
+
+TrajectoryBuffer::TrajectoryBuffer(int64_t tolerance): tolerance(tolerance)
+{}
+
+int TrajectoryBuffer::findPoseBefore(int64_t stamp) const
+{
+	if (poses.empty() || poses.front().stamp > stamp)
+		return -1 ;
+
+	//Search by bi-section (the first pose is not newer, the one past the end is)
+	size_t i = 0, j = poses.size() ;
+	while (i + 1 < j) {
+		size_t k = (i + j) / 2 ;
+		if (poses[k].stamp <= stamp)
+			i = k ;
+		else
+			j = k ;
+	}
+	return i ;
+}
+
+bool TrajectoryBuffer::addPose(int64_t stamp, const Eigen::Vector3d &position, const Eigen::Quaterniond &orientation)
+{
+	if (!poses.empty() && stamp <= poses.back().stamp)
+		return false ;
+
+	TimedPose pose ;
+	pose.stamp = stamp ;
+	pose.position = position ;
+	pose.orientation = orientation.normalized() ;
+	poses.push_back(pose) ;
+	return true ;
+}
+
+PoseLookupResult TrajectoryBuffer::getPose(int64_t stamp, Eigen::Vector4f &origin, Eigen::Quaternionf &orientation) const
+{
+	if (poses.empty() || stamp > poses.back().stamp + tolerance)
+		return POSE_PENDING ;
+	if (stamp < poses.front().stamp - tolerance)
+		return POSE_UNAVAILABLE ;
+
+	//Clamp time stamps slightly outside of the buffer to the end poses
+	Eigen::Vector3d position ;
+	Eigen::Quaterniond rotation ;
+	int i = findPoseBefore(stamp) ;
+	if (i < 0) {
+		position = poses.front().position ;
+		rotation = poses.front().orientation ;
+	} else if (size_t(i) + 1 == poses.size()) {
+		position = poses.back().position ;
+		rotation = poses.back().orientation ;
+	} else {
+		const TimedPose &p0 = poses[i] ;
+		const TimedPose &p1 = poses[i + 1] ;
+		double t = double(stamp - p0.stamp) / double(p1.stamp - p0.stamp) ;
+		position = p0.position + t * (p1.position - p0.position) ;
+		rotation = p0.orientation.slerp(t, p1.orientation) ;
+	}
+
+	origin = Eigen::Vector4f(position.x(), position.y(), position.z(), 1.0f) ;
+	orientation = rotation.cast<float>() ;
+	return POSE_AVAILABLE ;
+}
+
+size_t TrajectoryBuffer::evictBefore(int64_t stamp)
+{
+	int i = findPoseBefore(stamp) ;
+	if (i <= 0)
+		return 0 ;
+	poses.erase(poses.begin(), poses.begin() + i) ;
+	return i ;
+}
+
+int64_t TrajectoryBuffer::getLastStamp() const
+{
+	return poses.empty() ? std::numeric_limits<int64_t>::min() : poses.back().stamp ;
+}
+
+size_t TrajectoryBuffer::size() const
+{
+	return poses.size() ;
+}
+
+void TrajectoryBuffer::clear()
+{
+	poses.clear() ;
+}
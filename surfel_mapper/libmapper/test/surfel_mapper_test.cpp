@@ -14,7 +14,20 @@
 #define BOOST_TEST_MODULE SurfelMapperTest 
 #include <boost/test/unit_test.hpp>
 #include "surfel_mapper.hpp"
+#include "surfel_octree.hpp"
+#include "surfel_voxel_hash.hpp"
+#include "surfel_preview.hpp"
+#include "trajectory_buffer.hpp"
+#include "surfel_map_writer.hpp"
+#include "logger.hpp"
 #include <pcl/common/transforms.h>
+#include <pcl/common/io.h>
+#include <pcl/io/pcd_io.h>
+#include <set>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <cstdio>
 
 
 ////////////////////////////////////////////////////////////////////////
@@ -54,8 +67,9 @@ CameraParams camera_params = { //Default camera parameters
  * Constructs a sample point cloud (flat surface)
  *
  * @param cloud  output cloud
+ * @param depth  depth of the surface
  */
-void constructPointCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud) {
+void constructPointCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud, float depth = 2.0f) {
 	// Create a simple input cloud (flat surface) 
 	pcl::PointXYZRGB p ;
 	p.x = p.y = p.z = std::numeric_limits<float>::quiet_NaN() ;
@@ -79,7 +93,7 @@ void constructPointCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud) {
 
 			float xp = (j - cx) / alpha ;
 			float yp = (i - cy) / beta ;
-			float zp = 2.0f ;
+			float zp = depth ;
 
 			point.x = xp * zp ;
 			point.y = yp * zp ;
@@ -146,6 +160,33 @@ BOOST_AUTO_TEST_CASE(TestAddSingleViewpoint) {
     	BOOST_CHECK(startcount == endcount) ;
 }
 
+/**
+ * Boost test case - integration of a frame reports its counters
+ */
+BOOST_AUTO_TEST_CASE(TestFrameStats) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 
+				0, 0, QUEUE_BLOCK, VERBOSITY_QUIET, camera_params))  ;
+	FrameStats first = mapper->addPointCloudToScene(cloud) ;
+    	BOOST_CHECK(first.live_surfels_before == 0) ;
+    	BOOST_CHECK(first.nsurfels_added == mapper->getPointCount()) ;
+    	BOOST_CHECK(first.live_surfels_after == first.nsurfels_added) ;
+    	BOOST_CHECK(first.ntotal_scans == first.nscans_covered + first.nsurfels_added) ;
+
+	//The same frame again - all scans are covered by existing surfels
+	FrameStats second = mapper->addPointCloudToScene(cloud) ;
+    	BOOST_CHECK(second.live_surfels_before == first.live_surfels_after) ;
+    	BOOST_CHECK(second.nsurfels_added == 0) ;
+    	BOOST_CHECK(second.ntotal_scans == first.ntotal_scans) ;
+    	BOOST_CHECK(second.nsurfels_updated > 0) ;
+    	BOOST_CHECK(mapper->getLastFrameStats().nsurfels_updated == second.nsurfels_updated) ;
+}
+
 /**
  * Boost test case - adding several different clouds 
  */
@@ -177,6 +218,1004 @@ BOOST_AUTO_TEST_CASE(testAddMultipleViewpoints) {
     	BOOST_CHECK(startcount * 3 == endcount) ;
 }
 
+/**
+ * Boost test case - adding several similar clouds with index map association
+ */
+BOOST_AUTO_TEST_CASE(TestAddSingleViewpointIndexMap) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, true, 1, 0.0, 0, 0, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+	size_t startcount = mapper->getPointCount() ;
+	mapper->addPointCloudToScene(cloud) ;
+	mapper->addPointCloudToScene(cloud) ;
+	size_t endcount = mapper->getPointCount() ;
+
+    	BOOST_CHECK(startcount > 8500 && startcount < 9000) ;
+    	BOOST_CHECK(startcount == endcount) ;
+}
+
+/**
+ * Boost test case - index map association updates surfels as the traversal one in an occluded multi-viewpoint sequence
+ */
+BOOST_AUTO_TEST_CASE(TestIndexMapOccludedSequence) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud, cloudOccluder, cloudDistant ;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudTrans ;
+	constructPointCloud(cloud) ;
+	constructPointCloud(cloudOccluder, 1.5f) ; //Transient object in front of the surface
+	constructPointCloud(cloudDistant, 2.5f) ;
+	cloud->sensor_origin_ = cloudOccluder->sensor_origin_ = Eigen::Vector4f(0, 0, 0, 1) ;
+	cloud->sensor_orientation_ = cloudOccluder->sensor_orientation_ = cloudDistant->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	//The surface seen from behind the first viewpoint, several surfels are rendered into a single pixel
+	cloudDistant->sensor_origin_ << 0, 0, -0.5, 1 ;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudDistantTrans ;
+	transformCloud(cloudDistant, cloudDistantTrans) ;
+
+	cloud->sensor_orientation_ = Eigen::Quaternionf(0.70710678118654760,0,0.7071067811865476,0) ; //Euler -90 0 0
+	transformCloud(cloud, cloudTrans) ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr> sequence ;
+	sequence.push_back(cloud) ;
+	sequence.push_back(cloudOccluder) ;
+	sequence.push_back(cloud) ; //The occluder is gone - its surfels are removed and the surface behind is fused
+	sequence.push_back(cloudTrans) ;
+	sequence.push_back(cloudDistantTrans) ;
+	sequence.push_back(cloudOccluder) ;
+	sequence.push_back(cloud) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 0, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	boost::shared_ptr<SurfelMapper> mapper_index_map(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, true, 1, 0.0, 0, 0, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	for (size_t k = 0; k < sequence.size() ; k++) {
+		FrameStats stats = mapper->addPointCloudToScene(sequence[k]) ;
+		FrameStats stats_index_map = mapper_index_map->addPointCloudToScene(sequence[k]) ;
+	    	BOOST_CHECK(stats_index_map.nsurfels_updated == stats.nsurfels_updated) ;
+	    	BOOST_CHECK(stats_index_map.nsurfels_removed == stats.nsurfels_removed) ;
+	    	BOOST_CHECK(stats_index_map.nscans_covered == stats.nscans_covered) ;
+	    	BOOST_CHECK(stats_index_map.nsurfels_added == stats.nsurfels_added) ;
+	    	BOOST_CHECK(stats_index_map.nsurfels_invalid_reading == stats.nsurfels_invalid_reading) ;
+	    	BOOST_CHECK(mapper_index_map->getPointCount() == mapper->getPointCount()) ;
+	}
+}
+
+/**
+ * Boost test case - parallel surfel update gives the same map as the serial one
+ */
+BOOST_AUTO_TEST_CASE(TestParallelUpdate) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudTrans ;
+
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 0, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	boost::shared_ptr<SurfelMapper> mapper_parallel(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 4, 0.0, 0, 0, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+	mapper_parallel->addPointCloudToScene(cloud) ;
+
+	cloud->sensor_orientation_ = Eigen::Quaternionf(0.70710678118654760,0,0.7071067811865476,0) ; //Euler -90 0 0
+	transformCloud(cloud, cloudTrans) ;
+	mapper->addPointCloudToScene(cloudTrans) ;
+	mapper_parallel->addPointCloudToScene(cloudTrans) ;
+
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+	mapper->addPointCloudToScene(cloud) ;
+	mapper_parallel->addPointCloudToScene(cloud) ;
+
+    	BOOST_CHECK(mapper->getPointCount() == mapper_parallel->getPointCount()) ;
+}
+
+/**
+ * Boost test case - vectorized transform-and-project kernel matches the scalar one
+ */
+BOOST_AUTO_TEST_CASE(TestProjectionKernel) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	std::vector<int> indices ;
+	for (size_t i = 0; i < cloud->size() ; i++)
+		if (pcl::isFinite(cloud->points[i]))
+			indices.push_back(i) ;
+
+	Eigen::Matrix3f rotation(Eigen::AngleAxisf(0.3f, Eigen::Vector3f(0.0f, 1.0f, 0.0f))) ;
+	ProjectionParams params ;
+	for (int r = 0; r < 3 ; r++) {
+		for (int c = 0; c < 3 ; c++)
+			params.m[r * 4 + c] = rotation(r, c) ;
+		params.m[r * 4 + 3] = 0.1f * r ;
+	}
+	params.alpha = camera_params.alpha ;
+	params.beta = camera_params.beta ;
+	params.cx = camera_params.cx ;
+	params.cy = camera_params.cy ;
+
+	size_t n = indices.size() ;
+	std::vector<float> u(n), v(n), z(n), u_ref(n), v_ref(n), z_ref(n) ;
+	const size_t stride = sizeof(pcl::PointXYZRGB) / sizeof(float) ;
+	const pcl::PointXYZRGB &first = cloud->points[0] ;
+	transformProjectBatch(&first.x, &first.y, &first.z, stride, &indices[0], n, params, &u[0], &v[0], &z[0]) ;
+	transformProjectBatchScalar(&first.x, &first.y, &first.z, stride, &indices[0], n, params, &u_ref[0], &v_ref[0], &z_ref[0]) ;
+
+	for (size_t k = 0; k < n ; k++) {
+		BOOST_CHECK_SMALL(u[k] - u_ref[k], 1e-2f) ;
+		BOOST_CHECK_SMALL(v[k] - v_ref[k], 1e-2f) ;
+		BOOST_CHECK_SMALL(z[k] - z_ref[k], 1e-5f) ;
+	}
+}
+
+/**
+ * Boost test case - scene cloud view assembled from the surfel store
+ */
+BOOST_AUTO_TEST_CASE(TestCloudSceneView) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+
+	pcl::PointCloud<PointCustomSurfel>::Ptr cloudScene = mapper->getCloudScene() ;
+	std::vector<int> indices ;
+	mapper->getAllIndices(indices) ;
+    	BOOST_CHECK(indices.size() == mapper->getPointCount()) ;
+	for (size_t i = 0; i < indices.size() ; i++) {
+		const PointCustomSurfel &surfel = cloudScene->points[indices[i]] ;
+		BOOST_CHECK(pcl::isFinite(surfel)) ;
+		BOOST_CHECK(surfel.r == 100 && surfel.g == 100 && surfel.b == 100) ;
+		BOOST_CHECK(surfel.count == 1 && surfel.confidence == 1) ;
+	}
+}
+
+/**
+ * Boost test case - packed surfel records match the scene cloud
+ */
+BOOST_AUTO_TEST_CASE(TestPackedSurfels) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+
+	Eigen::Vector3f min_pt(-10.0f, -10.0f, -10.0f), max_pt(10.0f, 10.0f, 10.0f) ;
+	std::vector<int> indices ;
+	mapper->getBoundingBoxIndices(min_pt, max_pt, indices) ;
+	std::vector<uint8_t> data ;
+	size_t n = mapper->getPackedSurfels(min_pt, max_pt, data) ;
+    	BOOST_CHECK(sizeof(PackedSurfel) == 40) ;
+    	BOOST_CHECK(n == mapper->getPointCount() && n == indices.size()) ;
+    	BOOST_CHECK(data.size() == n * sizeof(PackedSurfel)) ;
+
+	pcl::PointCloud<PointCustomSurfel>::Ptr cloudScene = mapper->getCloudScene() ;
+	const PackedSurfel *packed = reinterpret_cast<const PackedSurfel*>(&data[0]) ;
+	for (size_t i = 0; i < n ; i++) {
+		const PointCustomSurfel &surfel = cloudScene->points[indices[i]] ;
+		BOOST_CHECK(packed[i].x == surfel.x && packed[i].y == surfel.y && packed[i].z == surfel.z) ;
+		BOOST_CHECK(packed[i].normal_z == surfel.normal_z && packed[i].rgba == surfel.rgba) ;
+		BOOST_CHECK(packed[i].radius == surfel.radius && packed[i].confidence == surfel.confidence && packed[i].count == surfel.count) ;
+	}
+}
+
+/**
+ * Boost test case - slots of removed surfels are reused by new surfels
+ */
+BOOST_AUTO_TEST_CASE(TestSlotReuse) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+	size_t startcount = mapper->getPointCount() ;
+
+	//The same surface observed further away - all (unconfident) surfels are removed and replaced by new ones
+	for (size_t i = 0; i < cloud->size() ; i++) {
+		pcl::PointXYZRGB &point = cloud->points[i] ;
+		point.x *= 1.5f ; point.y *= 1.5f ; point.z *= 1.5f ;
+	}
+	mapper->addPointCloudToScene(cloud) ;
+
+    	BOOST_CHECK(mapper->getPointCount() == startcount) ;
+    	BOOST_CHECK(mapper->getCloudScene()->size() == startcount) ;
+	BOOST_CHECK(mapper->compactMap() == 0) ;
+}
+
+/**
+ * Boost test case - compaction of the surfel store
+ */
+BOOST_AUTO_TEST_CASE(TestSurfelStoreCompaction) {
+	SurfelStore store ;
+	for (int i = 0; i < 5 ; i++) {
+		PointCustomSurfel surfel ;
+		surfel.x = surfel.y = surfel.z = i ;
+		surfel.count = i ;
+		store.positions->push_back(pcl::PointXYZ(surfel.x, surfel.y, surfel.z)) ;
+		store.appendAttributes(surfel) ;
+	}
+
+	std::vector<int> removed ;
+	removed.push_back(1) ;
+	removed.push_back(3) ;
+	store.invalidate(1) ;
+	store.invalidate(3) ;
+	store.releaseSlots(removed) ;
+	BOOST_CHECK(store.getTombstoneCount() == 2) ;
+
+	std::vector<int> remap ;
+	BOOST_CHECK(store.compact(remap) == 2) ;
+	BOOST_CHECK(store.size() == 3 && store.getTombstoneCount() == 0) ;
+	BOOST_CHECK(remap[0] == 0 && remap[1] == -1 && remap[2] == 1 && remap[3] == -1 && remap[4] == 2) ;
+	BOOST_CHECK(store.positions->points[2].x == 4.0f && store.count[1] == 2) ;
+
+	int slot ;
+	BOOST_CHECK(!store.acquireSlot(slot)) ;
+}
+
+/**
+ * Boost test case - changes of the surfel store tracked with epochs
+ */
+BOOST_AUTO_TEST_CASE(TestSurfelStoreEpochs) {
+	SurfelStore store ;
+	uint32_t epoch0 = store.beginEpoch() ;
+	for (int i = 0; i < 4 ; i++) {
+		PointCustomSurfel surfel ;
+		surfel.x = surfel.y = surfel.z = i ;
+		store.append(surfel) ;
+	}
+
+	//The second epoch: surfel 1 updated, surfel 2 removed
+	uint32_t epoch1 = store.beginEpoch() ;
+	store.count[1]++ ;
+	store.touch(1) ;
+	store.logChanges(std::vector<int>(1, 1)) ;
+	std::vector<int> removed ;
+	removed.push_back(2) ;
+	store.invalidate(2) ;
+	store.releaseSlots(removed) ;
+
+	std::vector<int> changed_slots, removed_slots ;
+	BOOST_CHECK(store.getChangedSlots(epoch0, changed_slots, removed_slots)) ;
+	BOOST_CHECK(changed_slots.size() == 1 && changed_slots[0] == 1) ;
+	BOOST_CHECK(removed_slots.size() == 1 && removed_slots[0] == 2) ;
+
+	changed_slots.clear() ; removed_slots.clear() ;
+	BOOST_CHECK(store.getChangedSlots(epoch1, changed_slots, removed_slots)) ;
+	BOOST_CHECK(changed_slots.empty() && removed_slots.empty()) ;
+
+	//Changes older than the change log are found by scanning the epochs
+	changed_slots.clear() ; removed_slots.clear() ;
+	BOOST_CHECK(store.getChangedSlots(0, changed_slots, removed_slots)) ;
+	BOOST_CHECK(changed_slots.size() == 3 && removed_slots.size() == 1 && removed_slots[0] == 2) ;
+
+	//Compaction renumbers slots - all live surfels are returned
+	std::vector<int> remap ;
+	store.compact(remap) ;
+	BOOST_CHECK(!store.getChangedSlots(epoch1, changed_slots, removed_slots)) ;
+	BOOST_CHECK(changed_slots.size() == 3 && removed_slots.empty()) ;
+}
+
+/**
+ * Boost test case - map deltas between integrated frames
+ */
+BOOST_AUTO_TEST_CASE(TestMapDelta) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+
+	uint32_t epoch ;
+	std::vector<int> slots, removed_slots ;
+	std::vector<uint8_t> data ;
+	BOOST_CHECK(mapper->getMapDelta(0, epoch, slots, data, removed_slots)) ;
+	BOOST_CHECK(epoch == mapper->getMapEpoch()) ;
+	BOOST_CHECK(slots.size() == mapper->getPointCount() && data.size() == slots.size() * sizeof(PackedSurfel)) ;
+
+	//The same view fuses into existing surfels
+	uint32_t since_epoch = epoch ;
+	mapper->addPointCloudToScene(cloud) ;
+	BOOST_CHECK(mapper->getMapDelta(since_epoch, epoch, slots, data, removed_slots)) ;
+	BOOST_CHECK(epoch > since_epoch && !slots.empty() && removed_slots.empty()) ;
+	const PackedSurfel *packed = reinterpret_cast<const PackedSurfel*>(&data[0]) ;
+	size_t nfused = 0 ;
+	for (size_t i = 0; i < slots.size() ; i++)
+		nfused += (packed[i].count == 2) ;
+	BOOST_CHECK(nfused > 0) ;
+
+	since_epoch = epoch ;
+	BOOST_CHECK(mapper->getMapDelta(since_epoch, epoch, slots, data, removed_slots)) ;
+	BOOST_CHECK(epoch == since_epoch && slots.empty() && data.empty()) ;
+
+	mapper->resetMap() ;
+	BOOST_CHECK(!mapper->getMapDelta(since_epoch, epoch, slots, data, removed_slots)) ;
+	BOOST_CHECK(slots.empty()) ;
+}
+
+/**
+ * Boost test case - streaming map save (PCD and PLY)
+ */
+BOOST_AUTO_TEST_CASE(TestSaveMap) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+
+	size_t nsaved ;
+	BOOST_CHECK(mapper->saveMap("surfel_mapper_test.pcd", nsaved)) ;
+	BOOST_CHECK(nsaved == mapper->getPointCount()) ;
+
+	pcl::PointCloud<PointCustomSurfel> loaded ;
+	BOOST_CHECK(pcl::io::loadPCDFile("surfel_mapper_test.pcd", loaded) == 0) ;
+	BOOST_CHECK(loaded.size() == nsaved) ;
+	for (size_t i = 0; i < loaded.size() ; i++) {
+		const PointCustomSurfel &surfel = loaded.points[i] ;
+		BOOST_CHECK(pcl::isFinite(surfel)) ;
+		BOOST_CHECK(surfel.r == 100 && surfel.g == 100 && surfel.b == 100) ;
+		BOOST_CHECK(surfel.count == 1 && surfel.confidence == 1 && surfel.radius > 0.0f) ;
+	}
+
+	//PLY - the header is followed by packed records
+	BOOST_CHECK(SurfelMapWriter::getFormatFromFileName("map.PLY") == MAP_FORMAT_PLY) ;
+	BOOST_CHECK(mapper->saveMap("surfel_mapper_test.ply", nsaved)) ;
+	std::ifstream ply("surfel_mapper_test.ply", std::ios::binary) ;
+	std::string line ;
+	size_t nvertices = 0 ;
+	while (std::getline(ply, line) && line != "end_header")
+		if (line.compare(0, 15, "element vertex ") == 0)
+			nvertices = atol(line.c_str() + 15) ;
+	std::streampos data_start = ply.tellg() ;
+	ply.seekg(0, std::ios::end) ;
+	BOOST_CHECK(nvertices == nsaved) ;
+	BOOST_CHECK(size_t(ply.tellg() - data_start) == nsaved * sizeof(PackedSurfel)) ;
+}
+
+/**
+ * Boost test case - saving and loading the native map file
+ */
+BOOST_AUTO_TEST_CASE(TestNativeMapFile) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+	size_t startcount = mapper->getPointCount() ;
+
+	size_t nsaved, nloaded ;
+	BOOST_CHECK(mapper->saveMap("surfel_mapper_test.smap", nsaved)) ;
+	BOOST_CHECK(nsaved == startcount) ;
+
+	//Leaves loaded from the file (the same index backend) and rebuilt (the other backend)
+	boost::shared_ptr<SurfelMapper> mapper_loaded(new SurfelMapper(3e7, false, camera_params))  ;
+	boost::shared_ptr<SurfelMapper> mapper_hash(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 
+				SPATIAL_INDEX_VOXEL_HASH, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	BOOST_CHECK(mapper_loaded->loadMap("surfel_mapper_test.smap", nloaded) && nloaded == startcount) ;
+	BOOST_CHECK(mapper_hash->loadMap("surfel_mapper_test.smap", nloaded) && nloaded == startcount) ;
+	BOOST_CHECK(!mapper_loaded->loadMap("surfel_mapper_test.pcd", nloaded)) ;
+	BOOST_CHECK(mapper_loaded->getPointCount() == startcount) ;
+
+	std::vector<int> indices ;
+	mapper_loaded->getAllIndices(indices) ;
+	BOOST_CHECK(indices.size() == startcount) ;
+
+	//The loaded map associates new readings with the loaded surfels
+	mapper_loaded->addPointCloudToScene(cloud) ;
+	mapper_hash->addPointCloudToScene(cloud) ;
+	BOOST_CHECK(mapper_loaded->getPointCount() == startcount) ;
+	BOOST_CHECK(mapper_hash->getPointCount() == startcount) ;
+}
+
+/**
+ * Boost test case - map snapshot saved in the background while new frames are integrated
+ */
+BOOST_AUTO_TEST_CASE(TestMapSnapshot) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudTrans ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 
+				0, 2, QUEUE_BLOCK, VERBOSITY_INFO, camera_params))  ;
+	mapper->enqueuePointCloud(cloud) ;
+	boost::shared_ptr<const SurfelMapSnapshot> snapshot = mapper->takeSnapshot() ;
+	size_t startcount = mapper->getPointCount() ;
+	BOOST_CHECK(snapshot->getLiveCount() == startcount && snapshot->epoch == mapper->getMapEpoch()) ;
+
+	//A new view adds surfels to the map, but not to the snapshot
+	size_t nsaved = 0 ;
+	bool saved = false ;
+	std::thread save_thread([&]() { saved = snapshot->save("surfel_mapper_snapshot_test.pcd", nsaved) ; }) ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(0.70710678118654760,0,0.7071067811865476,0) ; //Euler -90 0 0
+	transformCloud(cloud, cloudTrans) ;
+	mapper->enqueuePointCloud(cloudTrans) ;
+	save_thread.join() ;
+
+	BOOST_CHECK(saved && nsaved == startcount) ;
+	BOOST_CHECK(mapper->getPointCount() == 2 * startcount) ;
+	BOOST_CHECK(snapshot->getLiveCount() == startcount && snapshot->epoch < mapper->getMapEpoch()) ;
+}
+
+/**
+ * Boost test case - integrating decimated frames with camera parameters given for the full resolution
+ */
+BOOST_AUTO_TEST_CASE(TestDecimatedFrame) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	//Decimate the frame 2 times in both directions
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudDecimated(new pcl::PointCloud<pcl::PointXYZRGB>(cloud->width / 2, cloud->height / 2)) ;
+	for (uint32_t i = 0; i < cloudDecimated->height ; i++)
+		for (uint32_t j = 0; j < cloudDecimated->width ; j++)
+			(*cloudDecimated)(j, i) = (*cloud)(2 * j, 2 * i) ;
+	cloudDecimated->sensor_origin_ << 0, 0, 0, 1 ;
+	cloudDecimated->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	CameraParams camera_params_full = camera_params ;
+	camera_params_full.width = cloud->width ;
+	camera_params_full.height = cloud->height ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params_full))  ;
+	mapper->addPointCloudToScene(cloudDecimated) ;
+	size_t startcount = mapper->getPointCount() ;
+	mapper->addPointCloudToScene(cloudDecimated) ;
+	mapper->addPointCloudToScene(cloudDecimated) ;
+	size_t endcount = mapper->getPointCount() ;
+
+    	BOOST_CHECK(startcount > 1500 && startcount <= 2500) ;
+    	BOOST_CHECK(startcount == endcount) ;
+}
+
+/**
+ * Boost test case - native cross product normals of a flat surface facing the sensor
+ */
+BOOST_AUTO_TEST_CASE(TestCrossProductNormals) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+
+	pcl::PointCloud<pcl::PointXYZRGBNormal> cloudNormals ;
+	pcl::copyPointCloud(*cloud, cloudNormals) ;
+	ThreadPool pool(4) ;
+	estimateNormalsCrossProduct(cloudNormals, 2, 0.02f, pool) ;
+
+	size_t nnormals = 0 ;
+	for (size_t i = 0; i < cloudNormals.size() ; i++) {
+		const pcl::PointXYZRGBNormal &point = cloudNormals.points[i] ;
+		if (std::isnan(point.normal_x))
+			continue ;
+		nnormals++ ;
+		BOOST_CHECK_SMALL(point.normal_x, 1e-4f) ;
+		BOOST_CHECK_SMALL(point.normal_y, 1e-4f) ;
+		BOOST_CHECK_CLOSE(point.normal_z, -1.0f, 1e-2f) ;
+	}
+	//Borders of the surface (2 pixels wide) have no valid normals
+	BOOST_CHECK(nnormals == 96 * 96) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 
+				NORMAL_ESTIMATION_CROSS_PRODUCT, SPATIAL_INDEX_OCTREE, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+	mapper->addPointCloudToScene(cloud) ;
+	size_t startcount = mapper->getPointCount() ;
+	mapper->addPointCloudToScene(cloud) ;
+    	BOOST_CHECK(startcount == 96 * 96) ;
+    	BOOST_CHECK(mapper->getPointCount() == startcount) ;
+}
+
+/**
+ * Boost test case - bulk insertion into the octree gives the same octree as inserting points one by one
+ */
+BOOST_AUTO_TEST_CASE(TestOctreeBulkInsertion) {
+	pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZ>) ;
+	pcl::PointCloud<pcl::PointXYZ>::Ptr cloudBulk(new pcl::PointCloud<pcl::PointXYZ>) ;
+	SurfelOctree octree(0.2) ;
+	SurfelOctree octreeBulk(0.2) ;
+	octree.setInputCloud(cloud) ;
+	octreeBulk.setInputCloud(cloudBulk) ;
+
+	//Two batches, the second one enlarges the bounding box
+	for (int batch = 0; batch < 2 ; batch++) {
+		std::vector<int> indices ;
+		for (int i = 0; i < 1000 ; i++) {
+			float scale = (batch + 1) * 5.0f ;
+			pcl::PointXYZ point(scale * (rand() / float(RAND_MAX) - 0.5f), scale * (rand() / float(RAND_MAX) - 0.5f), scale * (rand() / float(RAND_MAX) - 0.5f)) ;
+			octree.addPointToCloud(point, cloud) ;
+			indices.push_back(cloudBulk->size()) ;
+			cloudBulk->push_back(point) ;
+		}
+		octreeBulk.addPointsFromIndicesBulk(indices) ;
+	}
+
+	BOOST_CHECK(octree.getLeafCount() == octreeBulk.getLeafCount()) ;
+	std::vector<int> indices, indicesBulk ;
+	Eigen::Vector3f min_pt(-1.0f, -1.0f, -1.0f), max_pt(2.0f, 2.0f, 2.0f) ;
+	octree.boxSearch(min_pt, max_pt, indices) ;
+	octreeBulk.boxSearch(min_pt, max_pt, indicesBulk) ;
+	std::sort(indices.begin(), indices.end()) ;
+	std::sort(indicesBulk.begin(), indicesBulk.end()) ;
+	BOOST_CHECK(indices == indicesBulk) ;
+}
+
+/**
+ * Boost test case - the voxel hash backend gives the same map as the octree backend
+ */
+BOOST_AUTO_TEST_CASE(TestVoxelHashBackend) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudTrans ;
+
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 
+				SPATIAL_INDEX_OCTREE, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	boost::shared_ptr<SurfelMapper> mapper_hash(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 
+				SPATIAL_INDEX_VOXEL_HASH, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+	mapper_hash->addPointCloudToScene(cloud) ;
+
+	cloud->sensor_orientation_ = Eigen::Quaternionf(0.70710678118654760,0,0.7071067811865476,0) ; //Euler -90 0 0
+	transformCloud(cloud, cloudTrans) ;
+	mapper->addPointCloudToScene(cloudTrans) ;
+	mapper_hash->addPointCloudToScene(cloudTrans) ;
+
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+	mapper->addPointCloudToScene(cloud) ;
+	mapper_hash->addPointCloudToScene(cloud) ;
+
+    	BOOST_CHECK(mapper->getPointCount() == mapper_hash->getPointCount()) ;
+
+	std::vector<int> indices, indicesHash ;
+	Eigen::Vector3f min_pt(-0.5f, -0.5f, 0.0f), max_pt(0.5f, 0.5f, 3.0f) ;
+	mapper->getBoundingBoxIndices(min_pt, max_pt, indices) ;
+	mapper_hash->getBoundingBoxIndices(min_pt, max_pt, indicesHash) ;
+    	BOOST_CHECK(!indices.empty()) ;
+    	BOOST_CHECK(indices.size() == indicesHash.size()) ; //Slots of removed surfels may be reused in a different order, so only sizes are compared
+
+	//A box exceeding the range of block coordinates covers the whole map
+	indicesHash.clear() ;
+	mapper_hash->getBoundingBoxIndices(Eigen::Vector3f(-1e10f, -1e10f, -1e10f), Eigen::Vector3f(1e10f, 1e10f, 1e10f), indicesHash) ;
+    	BOOST_CHECK(indicesHash.size() == mapper_hash->getPointCount()) ;
+}
+
+/**
+ * Boost test case - incrementally maintained map statistics agree with the map contents
+ */
+BOOST_AUTO_TEST_CASE(TestMapStats) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	MapStats stats = mapper->getMapStats() ;
+	BOOST_CHECK(stats.live_surfels == 0 && stats.slots == 0 && stats.index_leaves == 0) ;
+
+	mapper->addPointCloudToScene(cloud) ;
+	//The same surface observed further away - surfels are removed and replaced
+	for (size_t i = 0; i < cloud->size() ; i++) {
+		pcl::PointXYZRGB &point = cloud->points[i] ;
+		point.x *= 1.2f ; point.y *= 1.2f ; point.z *= 1.2f ;
+	}
+	mapper->addPointCloudToScene(cloud) ;
+
+	std::vector<int> indices ;
+	mapper->getAllIndices(indices) ;
+	stats = mapper->getMapStats() ;
+	BOOST_CHECK(stats.live_surfels == indices.size()) ;
+	BOOST_CHECK(stats.live_surfels == mapper->getPointCount()) ;
+	BOOST_CHECK(stats.slots == stats.live_surfels + stats.tombstones) ;
+	BOOST_CHECK(stats.index_leaves > 0) ;
+
+	mapper->compactMap() ;
+	stats = mapper->getMapStats() ;
+	BOOST_CHECK(stats.tombstones == 0) ;
+	BOOST_CHECK(stats.slots == indices.size()) ;
+}
+
+/**
+ * Boost test case - the incrementally refreshed preview has a single point per occupied preview voxel
+ */
+BOOST_AUTO_TEST_CASE(TestIncrementalPreview) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudTrans ;
+	constructPointCloud(cloud) ;
+
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+	mapper->flushPreview() ;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr snapshot = mapper->getCloudSceneDownsampled() ;
+	size_t startcount = snapshot->size() ;
+	mapper->addPointCloudToScene(cloud) ;
+	mapper->flushPreview() ;
+    	BOOST_CHECK(mapper->getCloudSceneDownsampled()->size() == startcount) ;
+
+	cloud->sensor_orientation_ = Eigen::Quaternionf(0.70710678118654760,0,0.7071067811865476,0) ; //Euler -90 0 0
+	transformCloud(cloud, cloudTrans) ;
+	mapper->addPointCloudToScene(cloudTrans) ;
+	mapper->flushPreview() ;
+    	BOOST_CHECK(snapshot->size() == startcount) ; //Published snapshots are not modified by subsequent refreshes
+
+	//Count preview voxels (0.2 - default preview resolution) occupied by surfels
+	pcl::PointCloud<PointCustomSurfel>::Ptr cloudScene = mapper->getCloudScene() ;
+	std::set<std::vector<int> > voxels ;
+	for (size_t i = 0; i < cloudScene->size() ; i++) {
+		const PointCustomSurfel &surfel = cloudScene->points[i] ;
+		if (!pcl_isfinite(surfel.x))
+			continue ;
+		std::vector<int> key(3) ;
+		key[0] = floor(surfel.x / 0.2) ; key[1] = floor(surfel.y / 0.2) ; key[2] = floor(surfel.z / 0.2) ;
+		voxels.insert(key) ;
+	}
+    	BOOST_CHECK(mapper->getCloudSceneDownsampled()->size() > startcount) ;
+    	BOOST_CHECK(mapper->getCloudSceneDownsampled()->size() == voxels.size()) ;
+}
+
+/**
+ * Boost test case - preview follows surfels moved to another voxel by the fusion
+ */
+BOOST_AUTO_TEST_CASE(TestPreviewMovedSurfels) {
+	//The first view lies just below the voxel boundary (z = 2.0), fused surfels end up just above it
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudNear, cloudFar ;
+	constructPointCloud(cloudNear, 1.999f) ;
+	constructPointCloud(cloudFar, 2.003f) ;
+	cloudNear->sensor_origin_ = cloudFar->sensor_origin_ = Eigen::Vector4f(0, 0, 0, 1) ;
+	cloudNear->sensor_orientation_ = cloudFar->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	//Traversal and index map update paths
+	for (int use_index_map = 0; use_index_map < 2 ; use_index_map++) {
+		boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, use_index_map, 1, 0.0, 0, 0, 0, 0, VERBOSITY_INFO, camera_params))  ;
+		mapper->addPointCloudToScene(cloudNear) ;
+		mapper->addPointCloudToScene(cloudFar) ;
+		mapper->flushPreview() ;
+		BOOST_CHECK(mapper->getLastFrameStats().nsurfels_updated > 0) ;
+
+		//Preview voxels (0.2 - preview resolution) occupied by surfels
+		pcl::PointCloud<PointCustomSurfel>::Ptr cloudScene = mapper->getCloudScene() ;
+		std::set<std::vector<int> > voxels ;
+		for (size_t i = 0; i < cloudScene->size() ; i++) {
+			const PointCustomSurfel &surfel = cloudScene->points[i] ;
+			if (!pcl_isfinite(surfel.x))
+				continue ;
+			std::vector<int> key(3) ;
+			key[0] = floor(surfel.x / 0.2) ; key[1] = floor(surfel.y / 0.2) ; key[2] = floor(surfel.z / 0.2) ;
+			voxels.insert(key) ;
+		}
+
+		//Preview points are placed in voxel centres
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr preview = mapper->getCloudSceneDownsampled() ;
+		std::set<std::vector<int> > preview_voxels ;
+		for (size_t i = 0; i < preview->size() ; i++) {
+			std::vector<int> key(3) ;
+			key[0] = floor(preview->points[i].x / 0.2) ; key[1] = floor(preview->points[i].y / 0.2) ; key[2] = floor(preview->points[i].z / 0.2) ;
+			preview_voxels.insert(key) ;
+		}
+		BOOST_CHECK(!voxels.empty()) ;
+		BOOST_CHECK(preview->size() == voxels.size()) ;
+		BOOST_CHECK(preview_voxels == voxels) ;
+	}
+}
+
+/**
+ * Boost test case - a slot removed and reused in the same preview voxel within one frame is kept once
+ */
+BOOST_AUTO_TEST_CASE(TestPreviewReusedSlot) {
+	pcl::PointCloud<pcl::PointXYZ>::Ptr positions(new pcl::PointCloud<pcl::PointXYZ>) ;
+	positions->push_back(pcl::PointXYZ(0.05f, 0.05f, 2.05f)) ;
+	positions->push_back(pcl::PointXYZ(0.1f, 0.1f, 2.1f)) ;
+	std::vector<uint32_t> rgba(2) ;
+	rgba[0] = 0xffff0000 ; //red
+	rgba[1] = 0xff0000ff ; //blue
+
+	SurfelPreview preview(0.2) ;
+	preview.setSurfelPositions(positions) ;
+	pcl::PointCloud<pcl::PointXYZRGB> cloudPreview ;
+	std::vector<int> indices(1, 0) ;
+	indices.push_back(1) ;
+	preview.addPointsFromIndicesBulk(indices) ;
+	preview.refresh(3, rgba, cloudPreview) ;
+
+	//Surfel 0 is removed and its slot is reused by a new surfel in the same voxel
+	std::vector<int> voxels(1, preview.getVoxelIndex(positions->points[0])) ;
+	preview.markVoxelsDirty(voxels) ;
+	positions->points[0] = pcl::PointXYZ(0.15f, 0.15f, 2.15f) ;
+	preview.addPointsFromIndicesBulk(std::vector<int>(1, 0)) ;
+	preview.refresh(3, rgba, cloudPreview) ;
+
+	std::vector<std::vector<int>*> leaves ;
+	preview.collectAllLeaves(leaves) ;
+    	BOOST_CHECK(leaves.size() == 1) ;
+    	BOOST_CHECK(leaves[0]->size() == 2) ;
+    	BOOST_CHECK(cloudPreview.size() == 1) ;
+    	BOOST_CHECK(cloudPreview.points[0].r == 127 && cloudPreview.points[0].b == 127) ; //Both surfels weighted equally
+}
+
+/**
+ * Boost test case - pipelined ingestion gives the same map as the synchronous one
+ */
+BOOST_AUTO_TEST_CASE(TestPipelinedIngestion) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+
+	//Enqueued clouds must not be modified, so every view gets its own cloud
+	std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr> views(3) ;
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+	transformCloud(cloud, views[0]) ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(0.70710678118654760,0,0.7071067811865476,0) ; //Euler -90 0 0
+	transformCloud(cloud, views[1]) ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(0.70710678118654760,0,-0.7071067811865476,0) ; //Euler 90 0 0
+	transformCloud(cloud, views[2]) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 0, 0, 0, VERBOSITY_INFO, camera_params))  ;
+	boost::shared_ptr<SurfelMapper> mapper_pipelined(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 0, 2, 0, VERBOSITY_INFO, camera_params))  ;
+	for (size_t k = 0; k < views.size() ; k++) {
+		mapper->addPointCloudToScene(views[k]) ;
+		mapper->addPointCloudToScene(views[k]) ;
+		mapper_pipelined->enqueuePointCloud(views[k]) ;
+		mapper_pipelined->enqueuePointCloud(views[k]) ;
+	}
+
+    	BOOST_CHECK(mapper->getPointCount() == mapper_pipelined->getPointCount()) ; //Waits for the enqueued clouds
+    	BOOST_CHECK(mapper_pipelined->isPipelineIdle()) ;
+	std::vector<int> indices, indices_pipelined ;
+	mapper->getAllIndices(indices) ;
+	mapper_pipelined->getAllIndices(indices_pipelined) ;
+    	BOOST_CHECK(indices == indices_pipelined) ;
+}
+
+/**
+ * Boost test case - frames dropped from a full pipeline queue are accounted for and do not affect the map
+ */
+BOOST_AUTO_TEST_CASE(TestPipelineQueuePolicy) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+	size_t count = mapper->getPointCount() ;
+
+	int policies[] = {QUEUE_DROP_OLDEST, QUEUE_DROP_NEWEST, QUEUE_COALESCE} ;
+	for (int p = 0; p < 3 ; p++) {
+		boost::shared_ptr<SurfelMapper> mapper_pipelined(new SurfelMapper(0.005, 0.8, 4.0, 0.2, 0.2, 3, 5, 0.2, true, 3e7, false, true, false, 1, 0.0, 0, 0, 1, 
+					policies[p], VERBOSITY_INFO, camera_params))  ;
+		size_t nrejected = 0 ;
+		for (int k = 0; k < 10 ; k++)
+			if (!mapper_pipelined->enqueuePointCloud(cloud))
+				nrejected++ ;
+		mapper_pipelined->flushPipeline() ;
+
+    		BOOST_CHECK(mapper_pipelined->getPointCount() == count) ; //The same view is integrated at least once
+    		BOOST_CHECK(mapper_pipelined->getDroppedFrameCount() < 10) ;
+		if (policies[p] == QUEUE_DROP_NEWEST)
+    			BOOST_CHECK(mapper_pipelined->getDroppedFrameCount() == nrejected) ;
+		else
+    			BOOST_CHECK(nrejected == 0) ;
+	}
+}
+
+/**
+ * Boost test case - a frame read in place from a strided buffer gives the same map as the PCL cloud
+ */
+BOOST_AUTO_TEST_CASE(TestCloudView) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	constructPointCloud(cloud) ;
+	cloud->sensor_origin_ << 0, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(1,0,0,0) ;
+
+	//Pack the cloud as in a PointCloud2 message (x, y, z, rgb, padding at the end of each row)
+	const uint32_t point_step = 4 * sizeof(float) ;
+	const uint32_t row_step = cloud->width * point_step + 8 ;
+	std::vector<uint8_t> buffer(row_step * cloud->height) ;
+	for (uint32_t i = 0; i < cloud->height ; i++)
+		for (uint32_t j = 0; j < cloud->width ; j++) {
+			const pcl::PointXYZRGB &point = (*cloud)(j, i) ;
+			uint8_t *out = &buffer[i * row_step + j * point_step] ;
+			memcpy(out, &point.x, sizeof(float)) ;
+			memcpy(out + 4, &point.y, sizeof(float)) ;
+			memcpy(out + 8, &point.z, sizeof(float)) ;
+			memcpy(out + 12, &point.rgba, sizeof(uint32_t)) ;
+		}
+
+	CloudView view ;
+	view.data = &buffer[0] ;
+	view.width = cloud->width ;
+	view.height = cloud->height ;
+	view.point_step = point_step ;
+	view.row_step = row_step ;
+	view.x_offset = 0 ; view.y_offset = 4 ; view.z_offset = 8 ; view.rgb_offset = 12 ;
+	view.is_dense = cloud->is_dense ;
+	view.sensor_origin = cloud->sensor_origin_ ;
+	view.sensor_orientation = cloud->sensor_orientation_ ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	boost::shared_ptr<SurfelMapper> mapper_view(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloud) ;
+	mapper_view->addCloudViewToScene(view) ;
+
+	pcl::PointCloud<PointCustomSurfel>::Ptr cloudScene = mapper->getCloudScene() ;
+	pcl::PointCloud<PointCustomSurfel>::Ptr cloudSceneView = mapper_view->getCloudScene() ;
+    	BOOST_CHECK(cloudScene->size() > 0) ;
+    	BOOST_REQUIRE(cloudScene->size() == cloudSceneView->size()) ;
+	bool equal = true ;
+	for (size_t i = 0; i < cloudScene->size() ; i++)
+		equal = equal && cloudScene->points[i].z == cloudSceneView->points[i].z && cloudScene->points[i].rgba == cloudSceneView->points[i].rgba ;
+    	BOOST_CHECK(equal) ;
+}
+
+/**
+ * Boost test case - a frame given as depth and color images gives the same map as the back-projected cloud
+ */
+BOOST_AUTO_TEST_CASE(TestDepthImageInput) {
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud ;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudTrans ;
+	constructPointCloud(cloud) ;
+	cloud->sensor_origin_ << 0.1, 0, 0, 1 ;
+	cloud->sensor_orientation_ = Eigen::Quaternionf(0.70710678118654760,0,0.7071067811865476,0) ; //Euler -90 0 0
+	transformCloud(cloud, cloudTrans) ;
+
+	//Depth (16-bit, millimeters) and color images of the sample cloud
+	std::vector<uint16_t> depth(cloud->width * cloud->height, 0) ;
+	std::vector<uint8_t> rgb(3 * cloud->width * cloud->height, 0) ;
+	for (size_t k = 0; k < cloud->points.size() ; k++) {
+		const pcl::PointXYZRGB &point = cloud->points[k] ;
+		if (!pcl_isfinite(point.z))
+			continue ;
+		depth[k] = static_cast<uint16_t>(point.z * 1000.0f + 0.5f) ;
+		rgb[3 * k] = point.r ; rgb[3 * k + 1] = point.g ; rgb[3 * k + 2] = point.b ;
+	}
+
+	DepthImageView image ;
+	image.depth = reinterpret_cast<const uint8_t*>(&depth[0]) ;
+	image.depth_step = cloud->width * sizeof(uint16_t) ;
+	image.depth_float = false ;
+	image.depth_scale = 0.001f ;
+	image.rgb = &rgb[0] ;
+	image.rgb_step = 3 * cloud->width ;
+	image.rgb_channels = 3 ;
+	image.rgb_bgr = false ;
+	image.width = cloud->width ;
+	image.height = cloud->height ;
+	image.sensor_origin = cloud->sensor_origin_ ;
+	image.sensor_orientation = cloud->sensor_orientation_ ;
+
+	boost::shared_ptr<SurfelMapper> mapper(new SurfelMapper(3e7, false, camera_params))  ;
+	boost::shared_ptr<SurfelMapper> mapper_image(new SurfelMapper(3e7, false, camera_params))  ;
+	mapper->addPointCloudToScene(cloudTrans) ;
+	mapper_image->addDepthImageToScene(image) ;
+
+	pcl::PointCloud<PointCustomSurfel>::Ptr cloudScene = mapper->getCloudScene() ;
+	pcl::PointCloud<PointCustomSurfel>::Ptr cloudSceneImage = mapper_image->getCloudScene() ;
+    	BOOST_CHECK(cloudScene->size() > 0) ;
+    	BOOST_REQUIRE(cloudScene->size() == cloudSceneImage->size()) ;
+	double max_distance = 0.0 ;
+	for (size_t i = 0; i < cloudScene->size() ; i++) {
+		const PointCustomSurfel &s1 = cloudScene->points[i] ;
+		const PointCustomSurfel &s2 = cloudSceneImage->points[i] ;
+		max_distance = std::max(max_distance, double(fabs(s1.x - s2.x) + fabs(s1.y - s2.y) + fabs(s1.z - s2.z))) ;
+	}
+    	BOOST_CHECK(max_distance < 1e-3) ;
+    	BOOST_CHECK(cloudSceneImage->points[0].r == 100) ;
+}
+
+/**
+ * Boost test case - poses are interpolated between bracketing poses of the trajectory buffer
+ */
+BOOST_AUTO_TEST_CASE(TestTrajectoryBuffer) {
+	TrajectoryBuffer trajectory ;
+	for (int k = 0; k < 10 ; k++)
+		trajectory.addPose(int64_t(k) * 100000000, Eigen::Vector3d(k, 0, 0), Eigen::Quaterniond(Eigen::AngleAxisd(k * 0.1, Eigen::Vector3d::UnitZ()))) ;
+    	BOOST_CHECK(!trajectory.addPose(0, Eigen::Vector3d(0, 0, 0), Eigen::Quaterniond::Identity())) ; //Poses must be appended in order
+
+	Eigen::Vector4f origin ;
+	Eigen::Quaternionf orientation ;
+    	BOOST_REQUIRE(trajectory.getPose(250000000, origin, orientation) == POSE_AVAILABLE) ;
+    	BOOST_CHECK(fabs(origin.x() - 2.5) < 1e-5) ;
+    	BOOST_CHECK(fabs(Eigen::AngleAxisf(orientation).angle() - 0.25) < 1e-5) ;
+    	BOOST_CHECK(trajectory.getPose(910000000, origin, orientation) == POSE_PENDING) ;
+
+	//The pose bracketing the eviction time stamp is kept
+    	BOOST_CHECK(trajectory.evictBefore(350000000) == 3) ;
+    	BOOST_CHECK(trajectory.getPose(350000000, origin, orientation) == POSE_AVAILABLE) ;
+    	BOOST_CHECK(trajectory.getPose(250000000, origin, orientation) == POSE_UNAVAILABLE) ;
+}
+
+/**
+ * Boost test case - rows logged through field handles are written by the background writer (CSV and binary)
+ */
+BOOST_AUTO_TEST_CASE(TestLogger) {
+	std::remove("surfel_mapper_test_log.csv") ;
+	{
+		Logger logger("surfel_mapper_test_log.csv") ;
+		logger.turnLoggingOn(true) ;
+		LogField time = logger.addField("time") ;
+		LogField count = logger.addField("count") ;
+		BOOST_CHECK(logger.addField("time") == time) ;
+		logger.initFile() ;
+		BOOST_CHECK(logger.addField("late") == -1) ;
+
+		logger.log(time, 0.25) ;
+		logger.log(count, size_t(1234567)) ;
+		logger.nextRow() ;
+		logger.log(count, 7) ;
+		logger.nextRow() ;
+		logger.flush() ;
+	}
+	std::ifstream csv("surfel_mapper_test_log.csv") ;
+	std::string line ;
+	std::getline(csv, line) ;
+    	BOOST_CHECK(line == "time;count;") ;
+	std::getline(csv, line) ;
+    	BOOST_CHECK(line == "0.25;1234567;") ;
+	std::getline(csv, line) ;
+    	BOOST_CHECK(line == "n/a;7;") ;
+
+	//Binary - header with field names followed by rows of doubles
+	{
+		Logger logger("surfel_mapper_test_log.bin", 4) ;
+		logger.turnLoggingOn(true) ;
+		LogField value = logger.addField("value") ;
+		logger.initFile() ;
+		for (int k = 0; k < 100 ; k++) {
+			logger.log(value, k) ;
+			logger.nextRow() ;
+		}
+		logger.flush() ;
+		BOOST_CHECK(logger.getDroppedRows() < 100) ;
+	}
+	std::ifstream bin("surfel_mapper_test_log.bin", std::ios::binary) ;
+	char magic[8] ;
+	uint32_t nfields, len ;
+	char name[5] ;
+	bin.read(magic, 8) ;
+	bin.read((char*)&nfields, sizeof(nfields)) ;
+	bin.read((char*)&len, sizeof(len)) ;
+	bin.read(name, 5) ;
+    	BOOST_CHECK(std::string(magic) == "SMLOG01") ;
+    	BOOST_REQUIRE(nfields == 1 && len == 5) ;
+    	BOOST_CHECK(std::string(name, 5) == "value") ;
+
+	//Rows are written in order, some of them may be dropped when the ring is full
+	double v, previous = -1 ;
+	size_t nrows = 0 ;
+	while (bin.read((char*)&v, sizeof(v))) {
+		BOOST_CHECK(v > previous) ;
+		previous = v ;
+		nrows++ ;
+	}
+    	BOOST_CHECK(nrows > 0 && nrows <= 100) ;
+}
+
 /*int main() {
 	testAddPointCloud() ;
 	testAddSingleViewpoint() ;
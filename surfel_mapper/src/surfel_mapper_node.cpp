@@ -11,6 +11,8 @@
 #include "ros/ros.h"
 #include "nav_msgs/Path.h"
 #include "sensor_msgs/PointCloud2.h"
+#include "sensor_msgs/Image.h"
+#include <sensor_msgs/image_encodings.h>
 #include <sensor_msgs/CameraInfo.h>
 #include "visualization_msgs/Marker.h"
 
@@ -24,11 +26,21 @@
 #include <tf/transform_listener.h>
 #include <tf_conversions/tf_eigen.h>  
 #include "surfel_mapper.hpp"
+#include "trajectory_buffer.hpp"
 #include "surfel_mapper/ResetMap.h"
 #include "surfel_mapper/PublishMap.h"
 #include "surfel_mapper/SaveMap.h"
+#include "surfel_mapper/LoadMap.h"
+#include "surfel_mapper/GetMapDelta.h"
+#include "surfel_mapper/SurfelMapDelta.h"
 #include <algorithm>
 #include <math.h>
+#include <stddef.h>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#define MAX_PENDING_KEYFRAMES 200 /**< Maximum number of keyframe messages waiting for poses (the oldest ones are dropped) */
 
 
 //Node parameters
@@ -44,6 +56,17 @@ bool use_frustum ; /**< @brief use frustum or no*/
 int scene_size ; /**< @brief preallocated size of scene*/
 bool logging ; /**< @brief logging turned on or off*/
 bool use_update ; /**< @brief use surfel update or no*/
+bool use_index_map ; /**< @brief associate surfels with scans through a rendered surfel index map*/
+int num_threads ; /**< @brief number of threads used for the surfel update (0 - use hardware concurrency)*/
+double compaction_ratio ; /**< @brief fraction of removed surfels in the map that triggers idle map compaction (0 - compaction turned off)*/
+int normal_estimation ; /**< @brief normal estimation backend (0 - PCL integral image, 1 - native cross product)*/
+int spatial_index ; /**< @brief spatial index backend (0 - octree, 1 - voxel hash)*/
+int pipeline_depth ; /**< @brief number of keyframes queued for the integration worker of the mapper (0 - keyframes are integrated synchronously in callbacks)*/
+int queue_policy ; /**< @brief behaviour of the full keyframe queue (0 - block, 1 - drop oldest, 2 - drop newest, 3 - coalesce)*/
+int verbosity ; /**< @brief console output of the mapper (0 - quiet, 1 - settings and map operations, 2 - report for every keyframe)*/
+int input_mode ; /**< @brief keyframe input (0 - point clouds in the world frame, 1 - registered depth and color images)*/
+bool publish_markers ; /**< @brief publish the requested map also as RViz markers (debug mode)*/
+bool publish_deltas ; /**< @brief publish changes of the map on each maintenance tick*/
 
 /**
  * @brief Structure describing sensor pose
@@ -57,91 +80,232 @@ struct SensorPose {
 //typedef std::list<pcl::PointCloud<pcl::PointXYZRGB>::Ptr> PointCloudMsgListT ;
 typedef std::list<sensor_msgs::PointCloud2::ConstPtr> PointCloudMsgListT ; /**< @brief message list of points clouds */
 
-nav_msgs::Path::ConstPtr current_path ; /**< @brief pointer to the current path message */
+TrajectoryBuffer trajectory ; /**< @brief sensor poses received with path messages (only poses needed for queued keyframes are kept) */
+ros::Time last_keyframe_stamp ; /**< @brief time stamp of the last keyframe passed to the mapper */
 PointCloudMsgListT cloudMsgQueue ; /**< @brief queue of point cloud messages */ 
+typedef std::list<sensor_msgs::Image::ConstPtr> ImageMsgListT ; /**< @brief message list of images */
+ImageMsgListT depthMsgQueue ; /**< @brief queue of keyframe depth image messages */
+ImageMsgListT rgbMsgQueue ; /**< @brief queue of keyframe color image messages */
 
 //Eigen::Matrix4d cameraRgbToCameraLinkTrans ;
-boost::shared_ptr<SurfelMapper> mapper ; /**< @brief mapper pointer */
-
-ros::Publisher surfel_map_pub ; /**< @brief surfel mapper publisher */ 
+boost::shared_ptr<SurfelMapper> mapper ; /**< @brief mapper pointer (set and used by callbacks run on the spinner thread) */
+std::mutex mapper_mutex ; /**< @brief mutex guarding the mapper pointer when read from the main thread */
+std::thread save_thread ; /**< @brief background thread saving map snapshots */
+std::atomic<bool> save_busy(false) ; /**< @brief is a map snapshot being saved */
 
-//ccny_rgbd uses timestamps for keyframes compatible with rgb camera, but odometry path is time stamped anew (so it can be actually some microseconds later than keyframe
-//simple workaround is to round time stamps to miliseconds.TODO: possibly some patch to ccny_rgbd could be proposed?
+/**
+ * @brief Gets the mapper pointer from outside of the spinner thread
+ *
+ * @return mapper pointer (null if the mapper is not initialized)
+ */
+boost::shared_ptr<SurfelMapper> getMapper()
+{
+	std::unique_lock<std::mutex> lock(mapper_mutex) ;
+	return mapper ;
+}
 
 /**
- * @brief rounds the time stamp to miliseconds
- * 
- * @param time_stamp time stamp to round
- * @return rounded time stamp
+ * @brief Appends a message to the list of keyframe messages waiting for poses, the oldest message is dropped if the list is full
+ *
+ * @param queue message list
+ * @param msg new message
  */
-ros::Time roundTimeStamp(const ros::Time &time_stamp)
+template <typename ListT> void pushPendingKeyframe(ListT &queue, const typename ListT::value_type &msg)
 {
-	ros::Time rounded_time_stamp = time_stamp ;
-	uint32_t time_stamp_nsec_mod = time_stamp.nsec % 1000000l ;   
-	rounded_time_stamp.nsec -= time_stamp_nsec_mod ; //Results in full milliseconds contained in the timestamp 
-		if (time_stamp_nsec_mod > 500000l) { //If the remainder was grater than 0.5 millisecond
-			rounded_time_stamp.nsec += 1000000l ; //Round up to the full milisecond
-			if (rounded_time_stamp.nsec == 1000000000l) { //And if after addition we hit a full second (should not overflow on int32)
-				rounded_time_stamp.sec++ ;
-				rounded_time_stamp.nsec = 0l ;
-			}
-		}
-	return rounded_time_stamp ;
+	if (queue.size() >= MAX_PENDING_KEYFRAMES) {
+		ROS_WARN("Too many keyframes waiting for poses, keyframe [%d, %d] dropped", queue.front()->header.stamp.sec, queue.front()->header.stamp.nsec) ;
+		queue.pop_front() ;
+	}
+	queue.push_back(msg) ;
 }
 
+ros::Publisher surfel_map_pub ; /**< @brief surfel mapper marker publisher (debug mode) */ 
+ros::Publisher surfel_cloud_pub ; /**< @brief surfel mapper publisher (packed surfel cloud) */ 
+ros::Publisher surfel_delta_pub ; /**< @brief surfel map delta publisher */ 
+uint32_t published_epoch = 0 ; /**< @brief map epoch of the last published delta */
+
+//ccny_rgbd uses timestamps for keyframes compatible with rgb camera, but odometry path is time stamped anew (so it can be actually some microseconds later than keyframe).
+//Poses are interpolated, and time stamps up to a millisecond outside of the trajectory are clamped to its ends (the trajectory buffer tolerance).
+
 /**
  * @brief Retrieves sensor position associated with the given timestamp
  *
  * @param time_stamp time stamp to search for
- * @param sensor_pose output sensor pose
- * @return true if the time stamp was found, false otherwise
+ * @param sensor_pose output sensor pose (interpolated between the bracketing poses of the trajectory)
+ * @return POSE_AVAILABLE if the pose was found, POSE_PENDING if the trajectory does not reach the time stamp yet, POSE_UNAVAILABLE otherwise
+ */
+PoseLookupResult getSensorPosition(const ros::Time &time_stamp, SensorPose &sensor_pose)
+{
+	PoseLookupResult res = trajectory.getPose(time_stamp.toNSec(), sensor_pose.origin, sensor_pose.orientation) ;
+	if (res == POSE_PENDING)
+		ROS_WARN("Odometry path does not contain pose corresponding with the keyframe yet. Keyframe timestamp [%d.%d]", time_stamp.sec, time_stamp.nsec) ;
+	else if (res == POSE_UNAVAILABLE)
+		ROS_WARN("Keyframe timestamp [%d.%d] older than the odometry path", time_stamp.sec, time_stamp.nsec) ;
+	else {
+		std::cout << "Orientation: " << sensor_pose.orientation.w() << " " << sensor_pose.orientation.x() << " " << sensor_pose.orientation.y() << " " << sensor_pose.orientation.z() << std::endl ;
+		std::cout << "Pose: " << sensor_pose.origin.x() << " " << sensor_pose.origin.y() << " " << sensor_pose.origin.z() << " " << std::endl ;
+	}
+	return res ;
+}
+
+/**
+ * @brief Removes poses older than the oldest keyframe waiting for its pose
+ */
+void evictTrajectory()
+{
+	ros::Time oldest_stamp = last_keyframe_stamp ;
+	if (!cloudMsgQueue.empty())
+		oldest_stamp = std::min(oldest_stamp, cloudMsgQueue.front()->header.stamp) ;
+	if (!depthMsgQueue.empty())
+		oldest_stamp = std::min(oldest_stamp, depthMsgQueue.front()->header.stamp) ;
+	if (!rgbMsgQueue.empty())
+		oldest_stamp = std::min(oldest_stamp, rgbMsgQueue.front()->header.stamp) ;
+	trajectory.evictBefore(oldest_stamp.toNSec()) ;
+}
+
+/**
+ * @brief Gets offset of a 32-bit field of the cloud message
+ *
+ * @param msg cloud message
+ * @param name field name
+ * @param datatype expected field type
+ * @return offset of the field within the point, -1 if there is no such field
+ */
+int getFieldOffset(const sensor_msgs::PointCloud2 &msg, const std::string &name, uint8_t datatype)
+{
+	for (size_t k = 0; k < msg.fields.size() ; k++)
+		if (msg.fields[k].name == name && msg.fields[k].datatype == datatype)
+			return msg.fields[k].offset ;
+	return -1 ;
+}
+
+/**
+ * @brief Creates a view of the cloud message data (the view keeps the message alive)
+ *
+ * @param msg cloud message
+ * @param sensor_pose sensor pose of the cloud
+ * @return view of the message data or a null pointer if the message has no x, y, z fields
+ */
+boost::shared_ptr<CloudView> createCloudView(const sensor_msgs::PointCloud2::ConstPtr &msg, const SensorPose &sensor_pose)
+{
+	boost::shared_ptr<CloudView> view(new CloudView) ;
+	int x_offset = getFieldOffset(*msg, "x", sensor_msgs::PointField::FLOAT32) ;
+	int y_offset = getFieldOffset(*msg, "y", sensor_msgs::PointField::FLOAT32) ;
+	int z_offset = getFieldOffset(*msg, "z", sensor_msgs::PointField::FLOAT32) ;
+	if (x_offset < 0 || y_offset < 0 || z_offset < 0 || msg->data.size() < size_t(msg->row_step) * msg->height)
+		return boost::shared_ptr<CloudView>() ;
+
+	//Packed colors are sent either as a float 'rgb' or an integer 'rgba' field
+	view->rgb_offset = getFieldOffset(*msg, "rgb", sensor_msgs::PointField::FLOAT32) ;
+	if (view->rgb_offset < 0)
+		view->rgb_offset = getFieldOffset(*msg, "rgba", sensor_msgs::PointField::UINT32) ;
+
+	view->data = msg->data.empty() ? NULL : &msg->data[0] ;
+	view->width = msg->width ;
+	view->height = msg->height ;
+	view->point_step = msg->point_step ;
+	view->row_step = msg->row_step ;
+	view->x_offset = x_offset ;
+	view->y_offset = y_offset ;
+	view->z_offset = z_offset ;
+	view->is_dense = msg->is_dense ;
+	view->sensor_origin = sensor_pose.origin ;
+	view->sensor_orientation = sensor_pose.orientation ;
+	view->owner = msg ;
+	return view ;
+}
+
+/**
+ * @brief Creates a view of a depth and color image pair (the view keeps the messages alive)
+ *
+ * @param depth_msg depth image message (16UC1 in millimeters or 32FC1 in meters)
+ * @param rgb_msg color image message (rgb8, bgr8, rgba8 or bgra8) registered with the depth image
+ * @param sensor_pose sensor pose of the images
+ * @return view of the images or a null pointer if the images are not supported
  */
-bool getSensorPosition(const ros::Time &time_stamp, SensorPose &sensor_pose)
+boost::shared_ptr<DepthImageView> createDepthImageView(const sensor_msgs::Image::ConstPtr &depth_msg, const sensor_msgs::Image::ConstPtr &rgb_msg, const SensorPose &sensor_pose)
 {
-	ros::Time time_stamp_rounded = roundTimeStamp(time_stamp) ;	
-	if (!current_path) {
-		ROS_WARN("No odometry path message available!") ;
-		return false ;
-	} else if (current_path->poses.empty()) {
-		ROS_WARN("Empty list of poses in odometry path message") ;
-		return false ;
-	} else if (roundTimeStamp(current_path->poses.front().header.stamp) > time_stamp_rounded || roundTimeStamp(current_path->poses.back().header.stamp) < time_stamp_rounded) {
-		ROS_WARN("Odometry path message does not contain pose corresponding with the keyframe. Keyframe timestamp (rounded) [%d.%d]. Odometry timestamps (rounded) [%d.%d]-[%d.%d]", 
-				time_stamp_rounded.sec, time_stamp_rounded.nsec, roundTimeStamp(current_path->poses.front().header.stamp).sec, roundTimeStamp(current_path->poses.front().header.stamp).nsec, 
-				roundTimeStamp(current_path->poses.back().header.stamp).sec, roundTimeStamp(current_path->poses.back().header.stamp).nsec) ;
-		return false ;
-	} else {
-		//Search by bi-section
-		size_t i, j, k ;
-		i = 0 ; j = current_path->poses.size() - 1 ;
-		while (i + 1 < j) {
-			k = (i + j) / 2 ;
-			if (roundTimeStamp(current_path->poses[k].header.stamp) <= time_stamp_rounded)
-				i = k ;
-			else
-				j = k ;
+	namespace enc = sensor_msgs::image_encodings ;
+	boost::shared_ptr<DepthImageView> view(new DepthImageView) ;
+	if (depth_msg->encoding == enc::TYPE_16UC1 || depth_msg->encoding == enc::MONO16) {
+		view->depth_float = false ;
+		view->depth_scale = 0.001f ;
+	} else if (depth_msg->encoding == enc::TYPE_32FC1) {
+		view->depth_float = true ;
+		view->depth_scale = 1.0f ;
+	} else
+		return boost::shared_ptr<DepthImageView>() ;
+
+	if (rgb_msg->encoding == enc::RGB8 || rgb_msg->encoding == enc::BGR8)
+		view->rgb_channels = 3 ;
+	else if (rgb_msg->encoding == enc::RGBA8 || rgb_msg->encoding == enc::BGRA8)
+		view->rgb_channels = 4 ;
+	else
+		return boost::shared_ptr<DepthImageView>() ;
+	view->rgb_bgr = rgb_msg->encoding == enc::BGR8 || rgb_msg->encoding == enc::BGRA8 ;
+
+	if (depth_msg->width != rgb_msg->width || depth_msg->height != rgb_msg->height || depth_msg->width == 0 || depth_msg->height == 0 ||
+			depth_msg->data.size() < size_t(depth_msg->step) * depth_msg->height || rgb_msg->data.size() < size_t(rgb_msg->step) * rgb_msg->height)
+		return boost::shared_ptr<DepthImageView>() ;
+
+	view->depth = &depth_msg->data[0] ;
+	view->depth_step = depth_msg->step ;
+	view->rgb = &rgb_msg->data[0] ;
+	view->rgb_step = rgb_msg->step ;
+	view->width = depth_msg->width ;
+	view->height = depth_msg->height ;
+	view->sensor_origin = sensor_pose.origin ;
+	view->sensor_orientation = sensor_pose.orientation ;
+	view->depth_owner = depth_msg ;
+	view->rgb_owner = rgb_msg ;
+	return view ;
+}
+
+/**
+ * @brief Process queues of buffered depth and color image messages
+ *
+ * Depth and color images are paired by time stamps, images without a counterpart are dropped.
+ */
+void processImageMsgQueue()
+{
+	if (!mapper) {
+		ROS_INFO("processImageMsgQueue: mapper not initialized") ;
+		return ;
+	}
+
+	while (!depthMsgQueue.empty() && !rgbMsgQueue.empty()) {
+		sensor_msgs::Image::ConstPtr depth_msg = depthMsgQueue.front() ;
+		sensor_msgs::Image::ConstPtr rgb_msg = rgbMsgQueue.front() ;
+		if (depth_msg->header.stamp < rgb_msg->header.stamp) {
+			ROS_WARN("Depth image [%d, %d] without a color image dropped", depth_msg->header.stamp.sec, depth_msg->header.stamp.nsec) ;
+			depthMsgQueue.pop_front() ;
+			continue ;
+		} else if (rgb_msg->header.stamp < depth_msg->header.stamp) {
+			ROS_WARN("Color image [%d, %d] without a depth image dropped", rgb_msg->header.stamp.sec, rgb_msg->header.stamp.nsec) ;
+			rgbMsgQueue.pop_front() ;
+			continue ;
 		}
 
-		//Find closest match (nearest neighbor)	
-		ros::Duration duri = roundTimeStamp(time_stamp) - roundTimeStamp(current_path->poses[i].header.stamp) ;
-		ros::Duration durj = roundTimeStamp(current_path->poses[j].header.stamp) - roundTimeStamp(time_stamp) ;
-		if (duri < durj)
-			k = i ;
-		else
-			k = j ;
-
-		geometry_msgs::PoseStamped pose_stamped = current_path->poses[k] ;
-		//ROS_INFO("Stamp found for k = %ld (out of %ld), number of steps [%ld]", k, current_path->poses.size(), steps) ;
-		//ROS_INFO("search time stamp [%d,%d], found time stamp [%d,%d]", time_stamp.sec, time_stamp.nsec, current_path->poses[i].header.stamp.sec, current_path->poses[i].header.stamp.nsec) ;
-		//ROS_INFO("search time stamp [%d,%d], found time stamp [%d,%d]", time_stamp.sec, time_stamp.nsec, current_path->poses[j].header.stamp.sec, current_path->poses[j].header.stamp.nsec) ;
-		ROS_INFO("search time stamp (rounded) [%d,%d], found time stamp (rounded) [%d,%d]", time_stamp_rounded.sec, time_stamp_rounded.nsec, roundTimeStamp(pose_stamped.header.stamp).sec, roundTimeStamp(pose_stamped.header.stamp).nsec) ;
-
-		sensor_pose.origin = Eigen::Vector4f((float) pose_stamped.pose.position.x, (float) pose_stamped.pose.position.y, (float) pose_stamped.pose.position.z, 1.0f) ;
-		sensor_pose.orientation = Eigen::Quaternionf((float) pose_stamped.pose.orientation.w, (float) pose_stamped.pose.orientation.x, 
-							     (float) pose_stamped.pose.orientation.y, (float) pose_stamped.pose.orientation.z) ;
-		std::cout << "Orientation: " << pose_stamped.pose.orientation.w << " " << pose_stamped.pose.orientation.x << " " << pose_stamped.pose.orientation.y << " " << pose_stamped.pose.orientation.z << std::endl ;
-		std::cout << "Pose: " << pose_stamped.pose.position.x << " " << pose_stamped.pose.position.y << " " << pose_stamped.pose.position.z << " " << std::endl ;
-		return true ;
+		SensorPose sensor_pose ;
+		PoseLookupResult res = getSensorPosition(depth_msg->header.stamp, sensor_pose) ;
+		if (res == POSE_PENDING)
+			break ;
+		last_keyframe_stamp = depth_msg->header.stamp ;
+		if (res == POSE_UNAVAILABLE) {
+			depthMsgQueue.pop_front() ;
+			rgbMsgQueue.pop_front() ;
+			continue ;
+		}
+
+		boost::shared_ptr<DepthImageView> view = createDepthImageView(depth_msg, rgb_msg, sensor_pose) ;
+		if (view) {
+			ROS_INFO("-------------->Adding depth image [%d, %d]", depth_msg->header.stamp.sec, depth_msg->header.stamp.nsec) ;
+			if (!mapper->enqueueDepthImage(view))
+				ROS_WARN("Depth image [%d, %d] dropped, the integration queue is full", depth_msg->header.stamp.sec, depth_msg->header.stamp.nsec) ;
+		} else
+			ROS_WARN("Depth image [%s] and color image [%s] pair not supported, skipped", depth_msg->encoding.c_str(), rgb_msg->encoding.c_str()) ;
+		depthMsgQueue.pop_front() ;
+		rgbMsgQueue.pop_front() ;
 	}
 }
 
@@ -155,24 +319,29 @@ void processCloudMsgQueue()
 		while(!cloudMsgQueue.empty()) {
 			SensorPose sensor_pose ;
 			const sensor_msgs::PointCloud2::ConstPtr& msg = cloudMsgQueue.front() ;
-			bool res = getSensorPosition(msg->header.stamp, sensor_pose) ;
-			if (res) {
-				//Convert message to PointCloud
-				pcl::PCLPointCloud2 pcl_pc2;
-				pcl_conversions::toPCL(*msg, pcl_pc2);
-				pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>());
-				pcl::fromPCLPointCloud2(pcl_pc2, *cloud);
-
-				//Fix sensor pose		
-				cloud->sensor_origin_ = sensor_pose.origin ;
-				cloud->sensor_orientation_ = sensor_pose.orientation ;
+			PoseLookupResult res = getSensorPosition(msg->header.stamp, sensor_pose) ;
+			if (res == POSE_UNAVAILABLE) {
+				ROS_WARN("Point cloud [%d, %d] without pose skipped", msg->header.stamp.sec, msg->header.stamp.nsec) ;
+				last_keyframe_stamp = msg->header.stamp ;
+				cloudMsgQueue.pop_front() ;
+			} else if (res == POSE_AVAILABLE) {
+				last_keyframe_stamp = msg->header.stamp ;
+				//The mapper reads the message data in place (no intermediate PCL cloud), the sensor pose is fixed in the view
+				boost::shared_ptr<CloudView> view = createCloudView(msg, sensor_pose) ;
+				if (!view) {
+					ROS_WARN("Point cloud [%d, %d] without x, y, z fields skipped", msg->header.stamp.sec, msg->header.stamp.nsec) ;
+					cloudMsgQueue.pop_front() ;
+					continue ;
+				}
 
 				//Add cloud to the map
 				ROS_INFO("-------------->Adding point cloud [%d, %d]", msg->header.stamp.sec, msg->header.stamp.nsec) ;
-				ROS_INFO("Sensor position data: [%f, %f, %f, %f] ", cloud->sensor_origin_.x(), cloud->sensor_origin_.y(), cloud->sensor_origin_.z(), cloud->sensor_origin_.w()) ;
-				ROS_INFO("Sensor orientation data: [%f, %f, %f, %f] ", cloud->sensor_orientation_.x(), cloud->sensor_orientation_.y(), cloud->sensor_orientation_.z(), cloud->sensor_orientation_.w()) ;
+				ROS_INFO("Sensor position data: [%f, %f, %f, %f] ", view->sensor_origin.x(), view->sensor_origin.y(), view->sensor_origin.z(), view->sensor_origin.w()) ;
+				ROS_INFO("Sensor orientation data: [%f, %f, %f, %f] ", view->sensor_orientation.x(), view->sensor_orientation.y(), view->sensor_orientation.z(), view->sensor_orientation.w()) ;
 
-				mapper->addPointCloudToScene(cloud) ;
+				//Normals of the cloud are computed while the previous one is integrated (when pipeline_depth > 0)
+				if (!mapper->enqueueCloudView(view))
+					ROS_WARN("Point cloud [%d, %d] dropped, the integration queue is full", msg->header.stamp.sec, msg->header.stamp.nsec) ;
 				//addPointCloudToScene1(cloud) ;
 
 				//Remove message from queue
@@ -191,7 +360,24 @@ void processCloudMsgQueue()
 void pathCallback(const nav_msgs::Path::ConstPtr& msg)
 {
 	ROS_DEBUG("pathCallback: [%s]", msg->header.frame_id.c_str());
-	current_path = msg ;
+
+	//The path is re-sent in full, only poses newer than the last stored one are ingested
+	int64_t last_stamp = trajectory.getLastStamp() ;
+	size_t first_new = msg->poses.size() ;
+	while (first_new > 0 && int64_t(msg->poses[first_new - 1].header.stamp.toNSec()) > last_stamp)
+		first_new-- ;
+	for (size_t k = first_new; k < msg->poses.size() ; k++) {
+		const geometry_msgs::Pose &pose = msg->poses[k].pose ;
+		trajectory.addPose(msg->poses[k].header.stamp.toNSec(), Eigen::Vector3d(pose.position.x, pose.position.y, pose.position.z), 
+				Eigen::Quaterniond(pose.orientation.w, pose.orientation.x, pose.orientation.y, pose.orientation.z)) ;
+	}
+
+	//Keyframes waiting for the new poses are integrated right away
+	if (mapper) {
+		processCloudMsgQueue() ;
+		processImageMsgQueue() ;
+	}
+	evictTrajectory() ;
 }
 
 /**
@@ -203,10 +389,35 @@ void keyframeCallback(const sensor_msgs::PointCloud2::ConstPtr& msg)
 {
 	ROS_INFO("keyframeCallback: [%s]", msg->header.frame_id.c_str());
 	//Add point cloud to our local queue (the queue is needed since we must sometimes wait for a transform from a path)
-	cloudMsgQueue.push_back(msg) ;	
+	pushPendingKeyframe(cloudMsgQueue, msg) ;
 	processCloudMsgQueue() ;
 }
 
+/**
+ * @brief Callback for the incoming keyframe depth image message 
+ *
+ * @param msg incoming depth image message 
+ */
+void depthKeyframeCallback(const sensor_msgs::Image::ConstPtr& msg)
+{
+	ROS_INFO("depthKeyframeCallback: [%s]", msg->header.frame_id.c_str());
+	//Images wait in the queue for the counterpart image and a transform from a path
+	pushPendingKeyframe(depthMsgQueue, msg) ;
+	processImageMsgQueue() ;
+}
+
+/**
+ * @brief Callback for the incoming keyframe color image message 
+ *
+ * @param msg incoming color image message 
+ */
+void rgbKeyframeCallback(const sensor_msgs::Image::ConstPtr& msg)
+{
+	ROS_INFO("rgbKeyframeCallback: [%s]", msg->header.frame_id.c_str());
+	pushPendingKeyframe(rgbMsgQueue, msg) ;
+	processImageMsgQueue() ;
+}
+
 /**
  * @brief Callback for the incoming camera info message 
  *
@@ -223,14 +434,19 @@ void cameraInfoCallback(const sensor_msgs::CameraInfo::ConstPtr &msg)
 		camera_params.beta = msg->K[4] ;
 		camera_params.cx = msg->K[2] ;
 		camera_params.cy = msg->K[5] ;
+		camera_params.width = msg->width ;
+		camera_params.height = msg->height ;
 		
 		
+		std::unique_lock<std::mutex> lock(mapper_mutex) ;
 		mapper.reset(new SurfelMapper(dmax, min_kinect_dist, max_kinect_dist, octree_resolution,
 						preview_resolution, preview_color_samples_in_voxel,
 						confidence_threshold, min_scan_znormal, 
-						use_frustum, scene_size, logging, use_update, camera_params)) ;
+						use_frustum, scene_size, logging, use_update, use_index_map, num_threads, compaction_ratio, normal_estimation, spatial_index, pipeline_depth, queue_policy, verbosity, camera_params)) ;
+		lock.unlock() ;
 
 		processCloudMsgQueue() ; //In case we only waited for camera_info message
+		processImageMsgQueue() ;
 	}
 }
 
@@ -240,7 +456,8 @@ void cameraInfoCallback(const sensor_msgs::CameraInfo::ConstPtr &msg)
  *
  * @param downsampled_map_pub publisher of the downsampled clouds 
  */
-void sendDownsampledMapMessage(ros::Publisher &downsampled_map_pub) 
+
+void sendDownsampledMapMessage(boost::shared_ptr<SurfelMapper> &mapper, ros::Publisher &downsampled_map_pub) 
 {
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudSceneDownsampled = mapper->getCloudSceneDownsampled() ;
 
@@ -257,6 +474,100 @@ void sendDownsampledMapMessage(ros::Publisher &downsampled_map_pub)
  */
 #define MAX_MARKERS 100000 
 
+/**
+ * @brief Fills the header and the fields of a PointCloud2 message with the PackedSurfel layout
+ *
+ * @param cloud_msg message with data already set
+ */
+void initSurfelCloudMessage(sensor_msgs::PointCloud2 &cloud_msg)
+{
+	static const char *names[] = {"x", "y", "z", "normal_x", "normal_y", "normal_z", "rgba", "radius", "confidence", "count"} ;
+	static const uint32_t offsets[] = {offsetof(PackedSurfel, x), offsetof(PackedSurfel, y), offsetof(PackedSurfel, z), 
+		offsetof(PackedSurfel, normal_x), offsetof(PackedSurfel, normal_y), offsetof(PackedSurfel, normal_z), 
+		offsetof(PackedSurfel, rgba), offsetof(PackedSurfel, radius), offsetof(PackedSurfel, confidence), offsetof(PackedSurfel, count)} ;
+	static const uint8_t datatypes[] = {sensor_msgs::PointField::FLOAT32, sensor_msgs::PointField::FLOAT32, sensor_msgs::PointField::FLOAT32, 
+		sensor_msgs::PointField::FLOAT32, sensor_msgs::PointField::FLOAT32, sensor_msgs::PointField::FLOAT32,
+		sensor_msgs::PointField::UINT32, sensor_msgs::PointField::FLOAT32, sensor_msgs::PointField::UINT32, sensor_msgs::PointField::UINT32} ;
+
+	cloud_msg.header.frame_id = "/odom" ;
+	cloud_msg.header.stamp = ros::Time::now() ;
+	cloud_msg.fields.resize(sizeof(names) / sizeof(names[0])) ;
+	for (size_t i = 0; i < cloud_msg.fields.size() ; i++) {
+		cloud_msg.fields[i].name = names[i] ;
+		cloud_msg.fields[i].offset = offsets[i] ;
+		cloud_msg.fields[i].datatype = datatypes[i] ;
+		cloud_msg.fields[i].count = 1 ;
+	}
+	cloud_msg.is_bigendian = false ;
+	cloud_msg.is_dense = true ;
+	cloud_msg.point_step = sizeof(PackedSurfel) ;
+	cloud_msg.height = 1 ;
+	cloud_msg.width = cloud_msg.data.size() / sizeof(PackedSurfel) ;
+	cloud_msg.row_step = cloud_msg.data.size() ;
+}
+
+/**
+ * @brief Publishes surfels within the bounding box as a PointCloud2 message with the PackedSurfel layout
+ *
+ * @param cloud_pub publisher
+ * @param min_bb lower bounding box corner
+ * @param max_bb upper bounding box corner
+ */
+void sendSurfelCloudMessage(ros::Publisher &cloud_pub, Eigen::Vector3f &min_bb, Eigen::Vector3f &max_bb)
+{
+	sensor_msgs::PointCloud2 cloud_msg ;
+	//Surfels are serialized directly into the message buffer
+	size_t npoints = mapper->getPackedSurfels(min_bb, max_bb, cloud_msg.data) ;
+	initSurfelCloudMessage(cloud_msg) ;
+
+	ROS_INFO("Publishing: %d surfels (%d bytes)", (int) npoints, (int) cloud_msg.data.size()) ;
+	cloud_pub.publish(cloud_msg) ;
+}
+
+/**
+ * @brief Fills the map delta message with surfels changed since the given epoch
+ *
+ * @param since_epoch epoch of the receiver
+ * @param delta output message
+ */
+void fillMapDeltaMessage(uint32_t since_epoch, surfel_mapper::SurfelMapDelta &delta)
+{
+	uint32_t epoch ;
+	delta.incremental = mapper->getMapDelta(since_epoch, epoch, delta.slots, delta.surfels.data, delta.removed_slots) ;
+	initSurfelCloudMessage(delta.surfels) ;
+	delta.header = delta.surfels.header ;
+	delta.since_epoch = since_epoch ;
+	delta.epoch = epoch ;
+}
+
+/**
+ * @brief Publishes surfels changed since the last published delta
+ *
+ * @param delta_pub publisher
+ */
+void sendMapDeltaMessage(ros::Publisher &delta_pub)
+{
+	surfel_mapper::SurfelMapDelta delta ;
+	fillMapDeltaMessage(published_epoch, delta) ;
+	published_epoch = delta.epoch ;
+	ROS_DEBUG("Publishing map delta [%u-%u]: %d changed, %d removed surfels", delta.since_epoch, delta.epoch, (int) delta.slots.size(), (int) delta.removed_slots.size()) ;
+	delta_pub.publish(delta) ;
+}
+
+/**
+ * @brief Publishes the map delta and compacts the map when the mapper is idle (timer callback run on the spinner thread)
+ */
+void maintenanceTimerCallback(const ros::TimerEvent &event)
+{
+	evictTrajectory() ;
+	//Deltas are extracted only when somebody listens
+	if (mapper && publish_deltas && surfel_delta_pub.getNumSubscribers() > 0 && mapper->getMapEpoch() != published_epoch)
+		sendMapDeltaMessage(surfel_delta_pub) ;
+	//Compact the map when idle (no frames waiting for integration)
+	if (mapper && cloudMsgQueue.empty() && (depthMsgQueue.empty() || rgbMsgQueue.empty()) && mapper->isPipelineIdle() && mapper->needsCompaction())
+		mapper->compactMap() ;
+}
+
 /**
  * @brief Sends surfel map message 
  *
@@ -293,7 +604,7 @@ void sendMapMessage(ros::Publisher &map_pub, Eigen::Vector3f &min_bb, Eigen::Vec
 	size_t nmarkers = std::min<unsigned int>(point_indices.size(), MAX_MARKERS) ;
 	for (size_t i = 0; i < nmarkers ; i++) {
 		PointCustomSurfel &point = cloudScene->at(point_indices[i]) ;
-		if (pcl::isFinite(point) && i % 2 == 0) { 
+		if (pcl::isFinite(point)) { 
 			Eigen::Vector3f normal(point.normal_x, point.normal_y, point.normal_z) ;
 			orientation.setFromTwoVectors(zaxis, normal) ;
 
@@ -329,68 +640,25 @@ void sendMapMessage(ros::Publisher &map_pub, Eigen::Vector3f &min_bb, Eigen::Vec
 }
 
 /**
- * @brief Saves map under the filename specified 
+ * @brief Callback for the GetMapDelta service. 
  *
- * Only XYZRGB components of surfels are saved.
+ * Returns surfels changed since the requested epoch (a full resynchronization if the changes cannot be tracked).
  *
- * @param fileName point cloud file name 
+ * @param request service request object
+ * @param response service response object
+ *
+ * @return true if service call is correctly handled
  */
-void saveMap(const std::string &fileName) 
+bool getMapDeltaCallback(
+  surfel_mapper::GetMapDelta::Request& request,
+  surfel_mapper::GetMapDelta::Response& response)
 {
-	//Copy map to standard RGBXYZ point cloud. Leave only points that are actually valid (octree indices are present) 
-	pcl::PointCloud<PointCustomSurfel>::Ptr cloud = mapper->getCloudScene() ;
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudXYZRGB(new pcl::PointCloud<pcl::PointXYZRGB>) ;
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudXYZRGBfilt(new pcl::PointCloud<pcl::PointXYZRGB>) ;
-	std::vector<int> indv ;
-	mapper->getAllIndices(indv) ;
-	//Divide point downcasting and filtering in two steps (one step approach causes crash frequently...)
-	//Investigate if this was due to unordered indices
-
-	pcl::copyPointCloud(*cloud, *cloudXYZRGB) ;
-
-	//We cannot perform in-place copy - indices may be unordered
-	pcl::copyPointCloud(*cloudXYZRGB, indv, *cloudXYZRGBfilt) ;
-
-	pcl::io::savePCDFileBinary(fileName, *cloudXYZRGBfilt) ;
-
-	/*	
-	std::cout << "Cloud length: " << cloudXYZRGB->size() << std::endl ;
-	//pcl::removeNaNFromPointCloud(*cloudXYZRGB, *cloudXYZRGB, indv) ;
-	int count = 0 ;
-	for (int i = 0; i < cloudXYZRGB->points.size() ; i++)
-		if (!pcl_isfinite(cloudXYZRGB->points[i].x))
-			count++ ;	
-
-	std::vector<int> ind1 ;
-	ind1.resize(cloudXYZRGB->size()) ;	
-	for (int i = 0; i < ind1.size() ; i++)
-		ind1[i] = 0 ;
-	
-	for (int i = 0; i < indv.size() ; i++)
-		ind1[indv[i]] = 1 ;
-
-	int count1 = 0 ;
-	int count2 = 0 ;
-	for (int i = 0; i < ind1.size() ; i++)
-		if (ind1[i] == 0) {
-			std::cout << "*" << i << "+" << cloudXYZRGB->points[i].x << std::endl ;
-			count1++ ;
-			if (pcl_isfinite(cloudXYZRGB->points[i].x))
-				count2++ ;
-		}
-
-	std::cout << "Number of non nans: " << indv.size() << std::endl ;
-	std::cout << "Number of nans: " << count << std::endl ;
-	std::cout << "Cloud length: " << cloudXYZRGB->size() << std::endl ;
-	std::cout << "Count1: " << count1 << std::endl ;
-	std::cout << "Count2: " << count2 << std::endl ;
-
-	if (mapper->getPointCount() != indv.size())
-		std::cerr << "saveMap: mapper->getPointCount does not match cloud index vector size" ;
-
-	std::cout << "Saving map. Point count: " << mapper->getPointCount() << std::endl ;
-	std::cout.flush() ;
-	*/	
+	if (mapper) {
+		fillMapDeltaMessage(request.since_epoch, response.delta) ;
+		ROS_INFO("GetMapDelta request for epoch [%u] served: %d changed, %d removed surfels", request.since_epoch, (int) response.delta.slots.size(), (int) response.delta.removed_slots.size()) ;
+	} else
+		ROS_INFO("getMapDeltaCallback: Mapper not initialized.") ;
+	return true ;
 }
 
 /**
@@ -436,17 +704,37 @@ bool publishMapCallback(
 
 	ROS_INFO("PublishMap request arrived for bb. [%f,%f,%f]-[%f,%f,%f]", minbb[0], minbb[1], minbb[2], maxbb[0], maxbb[1], maxbb[2]) ;	
 	if (mapper) {
-		sendMapMessage(surfel_map_pub, minbb, maxbb) ;	
+		sendSurfelCloudMessage(surfel_cloud_pub, minbb, maxbb) ;
+		if (publish_markers)
+			sendMapMessage(surfel_map_pub, minbb, maxbb) ;	
 		ROS_INFO("The map has been sent") ;	
 	} else
 		ROS_INFO("resetMapCallback: Mapper not initialized.") ;
 	return true ;
 }
 
+/**
+ * @brief Saves the map snapshot (run on the background save thread)
+ *
+ * @param snapshot map snapshot
+ * @param file_name output file name
+ */
+void saveSnapshot(boost::shared_ptr<const SurfelMapSnapshot> snapshot, std::string file_name)
+{
+	ros::WallTime start = ros::WallTime::now() ;
+	size_t nsaved ;
+	if (snapshot->save(file_name, nsaved))
+		ROS_INFO("The map has been saved to [%s]. Point count: [%d], time (s): [%.3lf]", file_name.c_str(), (int) nsaved, (ros::WallTime::now() - start).toSec()) ;	
+	else
+		ROS_ERROR("saveSnapshot: Saving the map to [%s] failed.", file_name.c_str()) ;
+	save_busy = false ;
+}
+
 /**
  * @brief Callback for the SaveMap service. 
  *
- * Save the current map as a RGBXYZ point cloud 
+ * Saves live surfels with all attributes as a binary PCD or PLY file, or as a native map file (chosen by the file name 
+ * extension). A snapshot of the map is taken and saved on a background thread, so mapping continues during the save.
  *
  * @param request service request object
  * @param response service response object
@@ -457,15 +745,57 @@ bool saveMapCallback(
   surfel_mapper::SaveMap::Request& request,
   surfel_mapper::SaveMap::Response& response)
 {
-	ROS_INFO("SaveMap request arrived.") ;	
+	std::string file_name = request.file_name.empty() ? "cloud.pcd" : request.file_name ;
+	ROS_INFO("SaveMap request arrived [%s].", file_name.c_str()) ;	
+	response.success = false ;
+	response.point_count = 0 ;
 	if (mapper) {
-		saveMap("cloud.pcd") ;	
-		ROS_INFO("The map has been saved") ;	
+		if (save_busy) {
+			ROS_WARN("saveMapCallback: The previous map is still being saved.") ;
+			return true ;
+		}
+		boost::shared_ptr<const SurfelMapSnapshot> snapshot = mapper->takeSnapshot() ;
+		if (save_thread.joinable())
+			save_thread.join() ;
+		save_busy = true ;
+		save_thread = std::thread(saveSnapshot, snapshot, file_name) ;
+		response.success = true ;
+		response.point_count = snapshot->getLiveCount() ;
 	} else
 		ROS_INFO("saveMapCallback: Mapper not initialized.") ;
 	return true ;
 }
 
+/**
+ * @brief Callback for the LoadMap service. 
+ *
+ * Replaces the current map with the one stored in a native map file (saved by the SaveMap service with the .smap extension).
+ *
+ * @param request service request object
+ * @param response service response object
+ *
+ * @return true if service call is correctly handled
+ */
+bool loadMapCallback(
+  surfel_mapper::LoadMap::Request& request,
+  surfel_mapper::LoadMap::Response& response)
+{
+	ROS_INFO("LoadMap request arrived [%s].", request.file_name.c_str()) ;	
+	response.success = false ;
+	response.point_count = 0 ;
+	if (mapper) {
+		size_t nloaded ;
+		response.success = mapper->loadMap(request.file_name, nloaded) ;
+		response.point_count = nloaded ;
+		if (response.success)
+			ROS_INFO("The map has been loaded. Point count: [%d]", (int) nloaded) ;	
+		else
+			ROS_ERROR("loadMapCallback: [%s] is not a valid map file.", request.file_name.c_str()) ;
+	} else
+		ROS_INFO("loadMapCallback: Mapper not initialized.") ;
+	return true ;
+}
+
 /**
  * @brief Main program function 
  *
@@ -493,17 +823,38 @@ int main(int argc, char **argv)
 	if (!np.getParam("scene_size", scene_size)) scene_size = 3e7 ;
 	if (!np.getParam("logging", logging)) logging = true ;
 	if (!np.getParam("use_update", use_update)) use_update = true ;
+	if (!np.getParam("use_index_map", use_index_map)) use_index_map = false ;
+	if (!np.getParam("num_threads", num_threads)) num_threads = 1 ;
+	if (!np.getParam("compaction_ratio", compaction_ratio)) compaction_ratio = 0.0 ;
+	if (!np.getParam("normal_estimation", normal_estimation)) normal_estimation = 0 ;
+	if (!np.getParam("spatial_index", spatial_index)) spatial_index = 0 ;
+	if (!np.getParam("pipeline_depth", pipeline_depth)) pipeline_depth = 2 ;
+	if (!np.getParam("queue_policy", queue_policy)) queue_policy = 0 ;
+	if (!np.getParam("verbosity", verbosity)) verbosity = 1 ;
+	if (!np.getParam("input_mode", input_mode)) input_mode = 0 ;
+	if (!np.getParam("publish_markers", publish_markers)) publish_markers = false ;
+	if (!np.getParam("publish_deltas", publish_deltas)) publish_deltas = false ;
 
 	ros::Subscriber sub_path = n.subscribe("mapper_path", 3, pathCallback);
-	ros::Subscriber sub_keyframe = n.subscribe("keyframes", 200, keyframeCallback);
+	ros::Subscriber sub_keyframe, sub_keyframe_depth, sub_keyframe_rgb ;
+	if (input_mode == 1) {
+		sub_keyframe_depth = n.subscribe("keyframe_depth", 200, depthKeyframeCallback);
+		sub_keyframe_rgb = n.subscribe("keyframe_rgb", 200, rgbKeyframeCallback);
+	} else
+		sub_keyframe = n.subscribe("keyframes", 200, keyframeCallback);
 	ros::Subscriber sub_camerainfo = n.subscribe("camera/rgb/camera_info", 3, cameraInfoCallback);
 
 	ros::Publisher downsampled_map_pub = n.advertise<sensor_msgs::PointCloud2>("surfelmap_preview", 5);
-	surfel_map_pub = n.advertise<visualization_msgs::MarkerArray>( "surfelmap", 1);
+	surfel_cloud_pub = n.advertise<sensor_msgs::PointCloud2>( "surfelmap_cloud", 1);
+	surfel_delta_pub = n.advertise<surfel_mapper::SurfelMapDelta>( "surfelmap_delta", 10);
+	if (publish_markers)
+		surfel_map_pub = n.advertise<visualization_msgs::MarkerArray>( "surfelmap", 1);
 
 	ros::ServiceServer resetmap_service = n.advertiseService("reset_map", resetMapCallback);
 	ros::ServiceServer publishmap_service = n.advertiseService("publish_map", publishMapCallback);
 	ros::ServiceServer savemap_service = n.advertiseService("save_map", saveMapCallback);
+	ros::ServiceServer loadmap_service = n.advertiseService("load_map", loadMapCallback);
+	ros::ServiceServer getmapdelta_service = n.advertiseService("get_map_delta", getMapDeltaCallback);
 
 	ros::Rate r(2) ;
 
@@ -532,22 +883,16 @@ int main(int argc, char **argv)
 	}*/
 
 
-	ros::Time time_stamp, time_stamp_rounded ;
-	time_stamp.sec = 100l ;
-	time_stamp.nsec = 999501341l ;
-	
-
-	time_stamp_rounded = roundTimeStamp(time_stamp) ;
-
-	ROS_INFO("Test time_stamp rounding: original: sec = %d, nsec = %d", time_stamp.sec, time_stamp.nsec) ;
-	ROS_INFO("Test time_stamp rounding: rounded: sec = %d, nsec = %d", time_stamp_rounded.sec, time_stamp_rounded.nsec) ;
+	//Callbacks (keyframe ingestion, services, maintenance) run on the spinner thread, integration runs on the mapper worker
+	ros::Timer maintenance_timer = n.createTimer(ros::Duration(0.5), maintenanceTimerCallback) ;
+	ros::AsyncSpinner spinner(1) ;
+	spinner.start() ;
 
 	while(ros::ok()) {
-		ros::spinOnce();
-		processCloudMsgQueue() ;
-		if (mapper) {
+		boost::shared_ptr<SurfelMapper> current_mapper = getMapper() ;
+		if (current_mapper) {
 			ros::Time start = ros::Time::now() ;
-			sendDownsampledMapMessage(downsampled_map_pub) ;
+			sendDownsampledMapMessage(current_mapper, downsampled_map_pub) ;
 			ros::Time stop = ros::Time::now() ;
 			ROS_DEBUG("Sending Map Message time (s): [%.6lf]", (stop - start).toSec()) ;
 		} else 
@@ -571,5 +916,8 @@ int main(int argc, char **argv)
 		//ROS_INFO("Sensor orientation data: [%f, %f, %f, %f] ", sensor_pose.orientation.x(), sensor_pose.orientation.y(), sensor_pose.orientation.z(), sensor_pose.orientation.w()) ;
 	}
 
+	if (save_thread.joinable())
+		save_thread.join() ;
+
 	return 0;
 }